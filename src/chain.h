@@ -96,6 +96,10 @@ enum BlockStatus: uint32_t {
     BLOCK_FAILED_VALID = 32, //! stage after last reached validness failed
     BLOCK_FAILED_CHILD = 64, //! descends from failed block
     BLOCK_FAILED_MASK = BLOCK_FAILED_VALID | BLOCK_FAILED_CHILD,
+
+    //! At or below the base of a loaded UTXO snapshot: never connected, so there is no undo data, and the
+    //! block data may still be missing. Counts as linked (nChainTx is set) whether or not the data is there.
+    BLOCK_SNAPSHOT = 128,
 };
 
 /** The block chain is a tree shaped structure starting with the
@@ -445,7 +449,7 @@ public:
         READWRITE(nNonce);
     }
 
-    uint256 GetBlockHash() const
+    CBlockHeader GetBlockHeader() const
     {
         CBlockHeader block;
         block.nVersion = nVersion;
@@ -454,7 +458,12 @@ public:
         block.nTime = nTime;
         block.nBits = nBits;
         block.nNonce = nNonce;
-        return block.GetHash();
+        return block;
+    }
+
+    uint256 GetBlockHash() const
+    {
+        return GetBlockHeader().GetHash();
     }
 
     std::string ToString() const
@@ -6,9 +6,11 @@
 #define BITCOIN_CHECKQUEUE_H
 
 #include <algorithm>
+#include <atomic>
+#include <deque>
+#include <stdint.h>
 #include <vector>
 
-#include <boost/foreach.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
@@ -16,7 +18,10 @@
 template <typename T>
 class CCheckQueueControl;
 
-/** 
+/** Maximum number of worker threads that get a work queue of their own */
+static const int MAX_CHECKQUEUE_WORKERS = 64;
+
+/**
  * Queue for verifications that have to be performed.
   * The verifications are represented by a type T, which must provide an
   * operator(), returning a bool.
@@ -25,12 +30,67 @@ class CCheckQueueControl;
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
   * as an N'th worker, until all jobs are done.
+  *
+  * The master deals the verifications round-robin over one work queue per
+  * thread. A thread takes from its own queue and, once that is empty,
+  * steals part of another's. The queues are lock-free; the mutex is only
+  * taken to put idle threads to sleep and wake them up.
   */
 template <typename T>
 class CCheckQueue
 {
 private:
-    //! Mutex to protect the inner state
+    /**
+     * Bounded queue of verifications with a single producer, the master,
+     * and any number of consumers: the owning thread and those stealing
+     * from it. Positions only grow, so a consumer whose compare-and-swap
+     * succeeds knows the entries it read were neither taken nor reused.
+     */
+    class CWorkQueue
+    {
+    public:
+        static const uint64_t SIZE = 1 << 14;
+
+    private:
+        std::atomic<T*> vSlots[SIZE];
+        std::atomic<uint64_t> nHead;
+        std::atomic<uint64_t> nTail;
+
+    public:
+        CWorkQueue() : nHead(0), nTail(0) {}
+
+        bool Empty() const { return nHead >= nTail; }
+
+        //! Append check; only called by the master. Fails when full.
+        bool Push(T* check)
+        {
+            uint64_t nPos = nTail.load(std::memory_order_relaxed);
+            if (nPos - nHead >= SIZE)
+                return false;
+            vSlots[nPos % SIZE].store(check, std::memory_order_relaxed);
+            nTail = nPos + 1;
+            return true;
+        }
+
+        //! Take up to nMax checks, or half of what is left if fHalf, into vOut.
+        unsigned int Take(T** vOut, unsigned int nMax, bool fHalf)
+        {
+            uint64_t nPos = nHead;
+            while (true) {
+                uint64_t nEnd = nTail;
+                if (nPos >= nEnd)
+                    return 0;
+                uint64_t nAvail = nEnd - nPos;
+                unsigned int nNow = std::max((uint64_t)1, std::min((uint64_t)nMax, fHalf ? nAvail / 2 : nAvail));
+                for (unsigned int i = 0; i < nNow; i++)
+                    vOut[i] = vSlots[(nPos + i) % SIZE].load(std::memory_order_relaxed);
+                if (nHead.compare_exchange_weak(nPos, nPos + nNow))
+                    return nNow;
+            }
+        }
+    };
+
+    //! Mutex for sleeping and waking up threads
     boost::mutex mutex;
 
     //! Worker threads block on this when out of work
@@ -39,136 +99,164 @@ private:
     //! Master thread blocks on this when out of work
     boost::condition_variable condMaster;
 
-    //! The queue of elements to be processed.
-    //! As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
+    //! Work queue of the master (0) and of each registered worker
+    std::atomic<CWorkQueue*> vQueues[MAX_CHECKQUEUE_WORKERS + 1];
 
-    //! The number of workers (including the master) that are idle.
-    int nIdle;
+    //! The number of registered workers, excluding the master.
+    std::atomic<int> nWorkers;
 
-    //! The total number of workers (including the master).
-    int nTotal;
+    //! The number of workers asleep on condWorker.
+    std::atomic<int> nSleeping;
 
     //! The temporary evaluation result.
-    bool fAllOk;
+    std::atomic<bool> fAllOk;
 
     /**
      * Number of verifications that haven't completed yet.
-     * This includes elements that are not anymore in queue, but still in
-     * worker's own batches.
+     * This includes elements that are not anymore in a queue, but still in
+     * a thread's own batch.
      */
-    unsigned int nTodo;
+    std::atomic<unsigned int> nTodo;
 
-    //! Whether we're shutting down.
-    bool fQuit;
-
-    //! The maximum number of elements to be processed in one batch
+    //! The maximum number of elements stolen in one batch
     unsigned int nBatchSize;
 
-    /** Internal function that does bulk of the verification work. */
-    bool Loop(bool fMaster = false)
+    //! The checks added since the last Wait(); only touched by the master.
+    std::deque<T> vStorage;
+
+    //! The queue the master deals the next check to.
+    int nNextQueue;
+
+    /** Whether any queue has checks left to take. */
+    bool HaveWork()
     {
-        boost::condition_variable& cond = fMaster ? condMaster : condWorker;
-        std::vector<T> vChecks;
-        vChecks.reserve(nBatchSize);
-        unsigned int nNow = 0;
-        bool fOk = true;
-        do {
-            {
-                boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master he can exit and return the result
-                        condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
-                }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if ((fMaster || fQuit) && nTodo == 0) {
-                        nTotal--;
-                        bool fRet = fAllOk;
-                        // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
-                        // return the current status
-                        return fRet;
-                    }
-                    nIdle++;
-                    cond.wait(lock); // wait
-                    nIdle--;
-                }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                    // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                    // queue to the local batch vector instead of copying.
-                    vChecks[i].swap(queue.back());
-                    queue.pop_back();
-                }
-                // Check whether we need to do work at all
-                fOk = fAllOk;
+        int nQueues = std::min((int)nWorkers, MAX_CHECKQUEUE_WORKERS) + 1;
+        for (int i = 0; i < nQueues; i++) {
+            CWorkQueue* pqueue = vQueues[i];
+            if (pqueue && !pqueue->Empty())
+                return true;
+        }
+        return false;
+    }
+
+    /** Run a batch of checks, skipping them all once one has failed. */
+    void Run(T** vChecks, unsigned int nCount)
+    {
+        for (unsigned int i = 0; i < nCount; i++) {
+            if (fAllOk.load(std::memory_order_relaxed) && !(*vChecks[i])())
+                fAllOk = false;
+        }
+        if (nTodo.fetch_sub(nCount) == nCount) {
+            // We processed the last element; inform the master it can exit and return the result
+            boost::unique_lock<boost::mutex> lock(mutex);
+            condMaster.notify_one();
+        }
+    }
+
+    /** Take and run checks, first from queue nId and then from the others, until none are left. */
+    void Loop(int nId, std::vector<T*>& vBatch)
+    {
+        vBatch.resize(std::max(nBatchSize, 1U));
+        while (true) {
+            CWorkQueue* pown = nId <= MAX_CHECKQUEUE_WORKERS ? vQueues[nId].load() : NULL;
+            unsigned int nNow = pown ? pown->Take(&vBatch[0], 1, false) : 0;
+            int nQueues = std::min((int)nWorkers, MAX_CHECKQUEUE_WORKERS) + 1;
+            for (int i = 1; i <= nQueues && nNow == 0; i++) {
+                CWorkQueue* pvictim = vQueues[(nId + i) % nQueues];
+                if (pvictim && pvictim != pown)
+                    nNow = pvictim->Take(&vBatch[0], vBatch.size(), true);
             }
-            // execute work
-            BOOST_FOREACH (T& check, vChecks)
-                if (fOk)
-                    fOk = check();
-            vChecks.clear();
-        } while (true);
+            if (nNow == 0)
+                return;
+            Run(&vBatch[0], nNow);
+        }
     }
 
 public:
     //! Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    CCheckQueue(unsigned int nBatchSizeIn) : nWorkers(0), nSleeping(0), fAllOk(true), nTodo(0), nBatchSize(nBatchSizeIn), nNextQueue(0)
+    {
+        vQueues[0] = new CWorkQueue();
+        for (int i = 1; i <= MAX_CHECKQUEUE_WORKERS; i++)
+            vQueues[i] = NULL;
+    }
 
     //! Worker thread
     void Thread()
     {
-        Loop();
+        // Until its queue is there, the master checks what it would deal to it
+        int nId = ++nWorkers;
+        if (nId <= MAX_CHECKQUEUE_WORKERS)
+            vQueues[nId] = new CWorkQueue();
+        std::vector<T*> vBatch;
+        while (true) {
+            Loop(nId, vBatch);
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nSleeping++;
+            while (!HaveWork())
+                condWorker.wait(lock);
+            nSleeping--;
+        }
     }
 
     //! Wait until execution finishes, and return whether all evaluations where successful.
     bool Wait()
     {
-        return Loop(true);
+        std::vector<T*> vBatch;
+        Loop(0, vBatch);
+        {
+            // Only checks already taken by workers are left
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (nTodo > 0)
+                condMaster.wait(lock);
+        }
+        bool fRet = fAllOk;
+        // reset the status for new work later
+        fAllOk = true;
+        vStorage.clear();
+        return fRet;
     }
 
     //! Add a batch of checks to the queue
     void Add(std::vector<T>& vChecks)
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH (T& check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
-        }
+        if (vChecks.empty())
+            return;
         nTodo += vChecks.size();
-        if (vChecks.size() == 1)
-            condWorker.notify_one();
-        else if (vChecks.size() > 1)
-            condWorker.notify_all();
+        int nQueues = std::min((int)nWorkers, MAX_CHECKQUEUE_WORKERS) + 1;
+        for (typename std::vector<T>::iterator it = vChecks.begin(); it != vChecks.end(); ++it) {
+            vStorage.push_back(T());
+            it->swap(vStorage.back());
+            T* check = &vStorage.back();
+            nNextQueue = (nNextQueue + 1) % nQueues;
+            CWorkQueue* pqueue = vQueues[nNextQueue];
+            if (!pqueue || !pqueue->Push(check)) {
+                // Nowhere to put it: the master checks it itself
+                Run(&check, 1);
+            }
+        }
+        if (nSleeping > 0) {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (vChecks.size() == 1)
+                condWorker.notify_one();
+            else
+                condWorker.notify_all();
+        }
     }
 
     ~CCheckQueue()
     {
+        for (int i = 0; i <= MAX_CHECKQUEUE_WORKERS; i++)
+            delete vQueues[i].load();
     }
 
     bool IsIdle()
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        return (nTotal == nIdle && nTodo == 0 && fAllOk == true);
+        return (nTodo == 0 && fAllOk == true);
     }
 };
 
-/** 
+/**
  * RAII-style controller object for a CCheckQueue that guarantees the passed
  * queue is finished before continuing.
  */
@@ -4,149 +4,242 @@
 
 #include "coins.h"
 
+#include "primitives/block.h"
 #include "random.h"
+#include "streams.h"
+#include "version.h"
 
 #include <assert.h>
 
-/**
- * calculate number of bytes for the bitmask, and its number of non-zero bytes
- * each bit in the bitmask represents the availability of one output, but the
- * availabilities of the first two outputs are encoded separately
- */
-void CCoins::CalcMaskSize(unsigned int& nBytes, unsigned int& nNonzeroBytes) const
-{
-    unsigned int nLastUsedByte = 0;
-    for (unsigned int b = 0; 2 + b * 8 < vout.size(); b++) {
-        bool fZero = true;
-        for (unsigned int i = 0; i < 8 && 2 + b * 8 + i < vout.size(); i++) {
-            if (!vout[2 + b * 8 + i].IsNull()) {
-                fZero = false;
-                continue;
-            }
-        }
-        if (!fZero) {
-            nLastUsedByte = b + 1;
-            nNonzeroBytes++;
-        }
-    }
-    nBytes += nLastUsedByte;
-}
+#include <stdexcept>
 
-bool CCoins::Spend(const COutPoint& out, CTxInUndo& undo)
-{
-    if (out.n >= vout.size())
-        return false;
-    if (vout[out.n].IsNull())
-        return false;
-    undo = CTxInUndo(vout[out.n]);
-    vout[out.n].SetNull();
-    Cleanup();
-    if (vout.size() == 0) {
-        undo.nHeight = nHeight;
-        undo.fCoinBase = fCoinBase;
-        undo.fCoinStake = fCoinStake;
-        undo.nVersion = this->nVersion;
-    }
-    return true;
-}
+bool CCoinsView::GetCoin(const COutPoint& outpoint, Coin& coin) const { return false; }
+bool CCoinsView::HaveCoin(const COutPoint& outpoint) const { return false; }
+uint256 CCoinsView::GetBestBlock() const { return uint256(0); }
+bool CCoinsView::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, const CCoinsRunningStats* pstats) { return false; }
+bool CCoinsView::GetStats(CCoinsStats& stats) const { return false; }
+bool CCoinsView::GetRunningStats(CCoinsRunningStats& stats) const { return false; }
+bool CCoinsView::ForEachCoin(CCoinsVisitor& visitor) const { return false; }
 
-bool CCoins::Spend(int nPos)
+bool CCoinsView::FindCoinByTxid(const uint256& txid, uint32_t nFrom, uint32_t nEnd, COutPoint& outpoint) const
 {
-    CTxInUndo undo;
-    COutPoint out(0, nPos);
-    return Spend(out, undo);
+    for (COutPoint iter(txid, nFrom); iter.n < nEnd; ++iter.n) {
+        if (HaveCoin(iter)) {
+            outpoint = iter;
+            return true;
+        }
+    }
+    return false;
 }
 
 
-bool CCoinsView::GetCoins(const uint256& txid, CCoins& coins) const { return false; }
-bool CCoinsView::HaveCoins(const uint256& txid) const { return false; }
-uint256 CCoinsView::GetBestBlock() const { return uint256(0); }
-bool CCoinsView::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock) { return false; }
-bool CCoinsView::GetStats(CCoinsStats& stats) const { return false; }
-
-
 CCoinsViewBacked::CCoinsViewBacked(CCoinsView* viewIn) : base(viewIn) {}
-bool CCoinsViewBacked::GetCoins(const uint256& txid, CCoins& coins) const { return base->GetCoins(txid, coins); }
-bool CCoinsViewBacked::HaveCoins(const uint256& txid) const { return base->HaveCoins(txid); }
+bool CCoinsViewBacked::GetCoin(const COutPoint& outpoint, Coin& coin) const { return base->GetCoin(outpoint, coin); }
+bool CCoinsViewBacked::HaveCoin(const COutPoint& outpoint) const { return base->HaveCoin(outpoint); }
 uint256 CCoinsViewBacked::GetBestBlock() const { return base->GetBestBlock(); }
 void CCoinsViewBacked::SetBackend(CCoinsView& viewIn) { base = &viewIn; }
-bool CCoinsViewBacked::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock) { return base->BatchWrite(mapCoins, hashBlock); }
+bool CCoinsViewBacked::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, const CCoinsRunningStats* pstats) { return base->BatchWrite(mapCoins, hashBlock, pstats); }
 bool CCoinsViewBacked::GetStats(CCoinsStats& stats) const { return base->GetStats(stats); }
+bool CCoinsViewBacked::GetRunningStats(CCoinsRunningStats& stats) const { return base->GetRunningStats(stats); }
+bool CCoinsViewBacked::ForEachCoin(CCoinsVisitor& visitor) const { return base->ForEachCoin(visitor); }
+bool CCoinsViewBacked::FindCoinByTxid(const uint256& txid, uint32_t nFrom, uint32_t nEnd, COutPoint& outpoint) const { return base->FindCoinByTxid(txid, nFrom, nEnd, outpoint); }
+
+bool FindCoinByTxidOverlay(const CCoinsOverlay& overlay, uint32_t nMaxIndex, const CCoinsView& base, const uint256& txid, uint32_t nFrom, uint32_t nEnd, COutPoint& outpoint)
+{
+    uint32_t n = nFrom;
+    while (n < nEnd) {
+        COutPoint found;
+        uint32_t nBase = base.FindCoinByTxid(txid, n, nEnd, found) ? found.n : nEnd;
+        // Below the next unspent output of base, only our own entries can be unspent
+        uint32_t nStop = std::min(nBase, std::min(nMaxIndex, nEnd - 1) + 1);
+        bool fUnspent;
+        for (; n < nStop; n++) {
+            if (overlay.Lookup(COutPoint(txid, n), fUnspent) && fUnspent) {
+                outpoint = COutPoint(txid, n);
+                return true;
+            }
+        }
+        if (nBase == nEnd)
+            return false;
+        // The output base has may be spent on top of it
+        if (!overlay.Lookup(found, fUnspent) || fUnspent) {
+            outpoint = found;
+            return true;
+        }
+        n = nBase + 1;
+    }
+    return false;
+}
 
 CCoinsKeyHasher::CCoinsKeyHasher() : salt(GetRandHash()) {}
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView* baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), hashBlock(0) {}
+SaltedOutpointHasher::SaltedOutpointHasher() : salt(GetRandHash()) {}
+
+void CCoinsRunningStats::AddCoin(const COutPoint& outpoint, const Coin& coin)
+{
+    CDataStream ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << outpoint << coin;
+    muhash.Insert((const unsigned char*)&ss[0], ss.size());
+    nTransactionOutputs++;
+    nTotalAmount += coin.out.nValue;
+}
+
+void CCoinsRunningStats::RemoveCoin(const COutPoint& outpoint, const Coin& coin)
+{
+    CDataStream ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << outpoint << coin;
+    muhash.Remove((const unsigned char*)&ss[0], ss.size());
+    nTransactionOutputs--;
+    nTotalAmount -= coin.out.nValue;
+}
+
+uint256 CCoinsRunningStats::GetHash() const
+{
+    uint256 hash;
+    muhash.Finalize(hash.begin());
+    return hash;
+}
+
+CCoinsViewCache::CCoinsViewCache(CCoinsView* baseIn) : CCoinsViewBacked(baseIn), hashBlock(0), cachedCoinsUsage(0), nMaxCachedIndex(0), fRunningStatsFetched(false), fHaveRunningStats(false) {}
 
-CCoinsViewCache::~CCoinsViewCache()
+size_t CCoinsViewCache::DynamicMemoryUsage() const
 {
-    assert(!hasModifier);
+    return memusage::DynamicUsage(cacheCoins) + cachedCoinsUsage;
 }
 
-CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256& txid) const
+CCoinsMap::iterator CCoinsViewCache::FetchCoin(const COutPoint& outpoint) const
 {
-    CCoinsMap::iterator it = cacheCoins.find(txid);
+    CCoinsMap::iterator it = cacheCoins.find(outpoint);
     if (it != cacheCoins.end())
         return it;
-    CCoins tmp;
-    if (!base->GetCoins(txid, tmp))
+    Coin tmp;
+    if (!base->GetCoin(outpoint, tmp))
         return cacheCoins.end();
-    CCoinsMap::iterator ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry())).first;
-    tmp.swap(ret->second.coins);
-    if (ret->second.coins.IsPruned()) {
-        // The parent only has an empty entry for this txid; we can consider our
-        // version as fresh.
+    CCoinsMap::iterator ret = cacheCoins.insert(std::make_pair(outpoint, CCoinsCacheEntry())).first;
+    nMaxCachedIndex = std::max(nMaxCachedIndex, outpoint.n);
+    std::swap(ret->second.coin, tmp);
+    if (ret->second.coin.IsSpent()) {
+        // The parent only has an empty entry for this outpoint; we can consider
+        // our version as fresh.
         ret->second.flags = CCoinsCacheEntry::FRESH;
     }
+    cachedCoinsUsage += ret->second.coin.DynamicMemoryUsage();
     return ret;
 }
 
-bool CCoinsViewCache::GetCoins(const uint256& txid, CCoins& coins) const
+bool CCoinsViewCache::GetCoin(const COutPoint& outpoint, Coin& coin) const
 {
-    CCoinsMap::const_iterator it = FetchCoins(txid);
+    CCoinsMap::const_iterator it = FetchCoin(outpoint);
     if (it != cacheCoins.end()) {
-        coins = it->second.coins;
-        return true;
+        coin = it->second.coin;
+        return !coin.IsSpent();
     }
     return false;
 }
 
-CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256& txid)
-{
-    assert(!hasModifier);
-    std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
-    if (ret.second) {
-        if (!base->GetCoins(txid, ret.first->second.coins)) {
-            // The parent view does not have this entry; mark it as fresh.
-            ret.first->second.coins.Clear();
-            ret.first->second.flags = CCoinsCacheEntry::FRESH;
-        } else if (ret.first->second.coins.IsPruned()) {
-            // The parent view only has a pruned entry for this; mark it as fresh.
-            ret.first->second.flags = CCoinsCacheEntry::FRESH;
-        }
+void CCoinsViewCache::AddCoin(const COutPoint& outpoint, const Coin& coin, bool fPossibleOverwrite)
+{
+    assert(!coin.IsSpent());
+    if (coin.out.scriptPubKey.IsUnspendable())
+        return;
+    std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(outpoint, CCoinsCacheEntry()));
+    nMaxCachedIndex = std::max(nMaxCachedIndex, outpoint.n);
+    CCoinsCacheEntry& entry = ret.first->second;
+    if (!ret.second)
+        cachedCoinsUsage -= entry.coin.DynamicMemoryUsage();
+    bool fFresh = false;
+    if (!fPossibleOverwrite) {
+        if (!entry.coin.IsSpent())
+            throw std::logic_error("Adding new coin that replaces non-pruned entry");
+        // A spent entry that was never written to the parent does not exist
+        // there either, so the new coin is fresh.
+        fFresh = !(entry.flags & CCoinsCacheEntry::DIRTY);
+    }
+    entry.coin = coin;
+    entry.flags |= CCoinsCacheEntry::DIRTY | (fFresh ? CCoinsCacheEntry::FRESH : 0);
+    cachedCoinsUsage += entry.coin.DynamicMemoryUsage();
+}
+
+void AddCoins(CCoinsViewCache& cache, const CTransaction& tx, int nHeight, bool fCheck)
+{
+    bool fCoinBase = tx.IsCoinBase();
+    bool fCoinStake = tx.IsCoinStake();
+    const uint256& txid = tx.GetHash();
+    for (size_t i = 0; i < tx.vout.size(); ++i) {
+        COutPoint outpoint(txid, i);
+        // Always allow overwrites for coinbase transactions, in order to
+        // correctly deal with pre-BIP30 duplicate coinbases.
+        bool fOverwrite = fCheck ? cache.HaveCoin(outpoint) : fCoinBase;
+        cache.AddCoin(outpoint, Coin(tx.vout[i], nHeight, fCoinBase, fCoinStake, tx.nTime), fOverwrite);
+    }
+}
+
+bool CCoinsViewCache::SpendCoin(const COutPoint& outpoint, Coin* moveto)
+{
+    CCoinsMap::iterator it = FetchCoin(outpoint);
+    if (it == cacheCoins.end())
+        return false;
+    cachedCoinsUsage -= it->second.coin.DynamicMemoryUsage();
+    if (moveto)
+        std::swap(*moveto, it->second.coin);
+    if (it->second.flags & CCoinsCacheEntry::FRESH) {
+        cacheCoins.erase(it);
+    } else {
+        it->second.flags |= CCoinsCacheEntry::DIRTY;
+        it->second.coin.Clear();
+        cachedCoinsUsage += it->second.coin.DynamicMemoryUsage();
+    }
+    return true;
+}
+
+static const Coin coinEmpty;
+
+namespace
+{
+class CCacheOverlay : public CCoinsOverlay
+{
+private:
+    const CCoinsMap& cacheCoins;
+
+public:
+    CCacheOverlay(const CCoinsMap& cacheCoinsIn) : cacheCoins(cacheCoinsIn) {}
+
+    bool Lookup(const COutPoint& outpoint, bool& fUnspent) const
+    {
+        CCoinsMap::const_iterator it = cacheCoins.find(outpoint);
+        if (it == cacheCoins.end())
+            return false;
+        fUnspent = !it->second.coin.IsSpent();
+        return true;
     }
-    // Assume that whenever ModifyCoins is called, the entry will be modified.
-    ret.first->second.flags |= CCoinsCacheEntry::DIRTY;
-    return CCoinsModifier(*this, ret.first);
+};
+} // anon namespace
+
+bool CCoinsViewCache::FindCoinByTxid(const uint256& txid, uint32_t nFrom, uint32_t nEnd, COutPoint& outpoint) const
+{
+    return FindCoinByTxidOverlay(CCacheOverlay(cacheCoins), nMaxCachedIndex, *base, txid, nFrom, nEnd, outpoint);
 }
 
-const CCoins* CCoinsViewCache::AccessCoins(const uint256& txid) const
+const Coin& CCoinsViewCache::AccessCoin(const COutPoint& outpoint) const
 {
-    CCoinsMap::const_iterator it = FetchCoins(txid);
+    CCoinsMap::const_iterator it = FetchCoin(outpoint);
     if (it == cacheCoins.end()) {
-        return NULL;
+        return coinEmpty;
     } else {
-        return &it->second.coins;
+        return it->second.coin;
     }
 }
 
-bool CCoinsViewCache::HaveCoins(const uint256& txid) const
+bool CCoinsViewCache::HaveCoin(const COutPoint& outpoint) const
+{
+    CCoinsMap::const_iterator it = FetchCoin(outpoint);
+    return (it != cacheCoins.end() && !it->second.coin.IsSpent());
+}
+
+bool CCoinsViewCache::HaveCoinInCache(const COutPoint& outpoint) const
 {
-    CCoinsMap::const_iterator it = FetchCoins(txid);
-    // We're using vtx.empty() instead of IsPruned here for performance reasons,
-    // as we only care about the case where a transaction was replaced entirely
-    // in a reorganization (which wipes vout entirely, as opposed to spending
-    // which just cleans individual outputs).
-    return (it != cacheCoins.end() && !it->second.coins.vout.empty());
+    CCoinsMap::const_iterator it = cacheCoins.find(outpoint);
+    return (it != cacheCoins.end() && !it->second.coin.IsSpent());
 }
 
 uint256 CCoinsViewCache::GetBestBlock() const
@@ -161,32 +254,68 @@ void CCoinsViewCache::SetBestBlock(const uint256& hashBlockIn)
     hashBlock = hashBlockIn;
 }
 
-bool CCoinsViewCache::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlockIn)
+void CCoinsViewCache::FetchRunningStats() const
+{
+    if (!fRunningStatsFetched) {
+        fHaveRunningStats = base->GetRunningStats(runningStats);
+        fRunningStatsFetched = true;
+    }
+}
+
+bool CCoinsViewCache::GetRunningStats(CCoinsRunningStats& stats) const
+{
+    FetchRunningStats();
+    if (fHaveRunningStats)
+        stats = runningStats;
+    return fHaveRunningStats;
+}
+
+CCoinsRunningStats* CCoinsViewCache::RunningStats()
+{
+    FetchRunningStats();
+    return fHaveRunningStats ? &runningStats : NULL;
+}
+
+bool CCoinsViewCache::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlockIn, const CCoinsRunningStats* pstats)
 {
-    assert(!hasModifier);
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) { // Ignore non-dirty entries (optimization).
             CCoinsMap::iterator itUs = cacheCoins.find(it->first);
             if (itUs == cacheCoins.end()) {
-                if (!it->second.coins.IsPruned()) {
-                    // The parent cache does not have an entry, while the child
-                    // cache does have (a non-pruned) one. Move the data up, and
-                    // mark it as fresh (if the grandparent did have it, we
-                    // would have pulled it in at first GetCoins).
-                    assert(it->second.flags & CCoinsCacheEntry::FRESH);
+                // The parent cache does not have an entry, while the child
+                // does. It can be ignored if it is both fresh and spent in the
+                // child; otherwise move the data up.
+                if (!((it->second.flags & CCoinsCacheEntry::FRESH) && it->second.coin.IsSpent())) {
                     CCoinsCacheEntry& entry = cacheCoins[it->first];
-                    entry.coins.swap(it->second.coins);
-                    entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH;
+                    nMaxCachedIndex = std::max(nMaxCachedIndex, it->first.n);
+                    std::swap(entry.coin, it->second.coin);
+                    cachedCoinsUsage += entry.coin.DynamicMemoryUsage();
+                    entry.flags = CCoinsCacheEntry::DIRTY;
+                    // The entry can only be marked fresh in the parent if it
+                    // was fresh in the child; otherwise it may just have been
+                    // flushed from the parent and still exist in the grandparent.
+                    if (it->second.flags & CCoinsCacheEntry::FRESH)
+                        entry.flags |= CCoinsCacheEntry::FRESH;
                 }
             } else {
-                if ((itUs->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned()) {
+                // A child entry marked fresh on top of an unspent parent entry
+                // means the FRESH flag was misapplied somewhere.
+                if ((it->second.flags & CCoinsCacheEntry::FRESH) && !itUs->second.coin.IsSpent())
+                    throw std::logic_error("FRESH flag misapplied to cache entry for an unspent output");
+
+                if ((itUs->second.flags & CCoinsCacheEntry::FRESH) && it->second.coin.IsSpent()) {
                     // The grandparent does not have an entry, and the child is
                     // modified and being pruned. This means we can just delete
                     // it from the parent.
+                    cachedCoinsUsage -= itUs->second.coin.DynamicMemoryUsage();
                     cacheCoins.erase(itUs);
                 } else {
-                    // A normal modification.
-                    itUs->second.coins.swap(it->second.coins);
+                    // A normal modification. The child's FRESH flag is not
+                    // copied, as a spent parent entry may still need to be
+                    // communicated to the grandparent.
+                    cachedCoinsUsage -= itUs->second.coin.DynamicMemoryUsage();
+                    std::swap(itUs->second.coin, it->second.coin);
+                    cachedCoinsUsage += itUs->second.coin.DynamicMemoryUsage();
                     itUs->second.flags |= CCoinsCacheEntry::DIRTY;
                 }
             }
@@ -195,16 +324,43 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlockIn
         mapCoins.erase(itOld);
     }
     hashBlock = hashBlockIn;
+    if (pstats) {
+        runningStats = *pstats;
+        fRunningStatsFetched = fHaveRunningStats = true;
+    }
     return true;
 }
 
 bool CCoinsViewCache::Flush()
 {
-    bool fOk = base->BatchWrite(cacheCoins, hashBlock);
+    // Totals that were never fetched were not changed either
+    bool fOk = base->BatchWrite(cacheCoins, hashBlock, fHaveRunningStats ? &runningStats : NULL);
     cacheCoins.clear();
+    cachedCoinsUsage = 0;
+    nMaxCachedIndex = 0;
     return fOk;
 }
 
+void CCoinsViewCache::PrefetchCoin(const COutPoint& outpoint, Coin& coin)
+{
+    assert(!coin.IsSpent());
+    std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(outpoint, CCoinsCacheEntry()));
+    if (!ret.second)
+        return;
+    nMaxCachedIndex = std::max(nMaxCachedIndex, outpoint.n);
+    std::swap(ret.first->second.coin, coin);
+    cachedCoinsUsage += ret.first->second.coin.DynamicMemoryUsage();
+}
+
+void CCoinsViewCache::Uncache(const COutPoint& outpoint)
+{
+    CCoinsMap::iterator it = cacheCoins.find(outpoint);
+    if (it != cacheCoins.end() && it->second.flags == 0) {
+        cachedCoinsUsage -= it->second.coin.DynamicMemoryUsage();
+        cacheCoins.erase(it);
+    }
+}
+
 unsigned int CCoinsViewCache::GetCacheSize() const
 {
     return cacheCoins.size();
@@ -212,9 +368,9 @@ unsigned int CCoinsViewCache::GetCacheSize() const
 
 const CTxOut& CCoinsViewCache::GetOutputFor(const CTxIn& input) const
 {
-    const CCoins* coins = AccessCoins(input.prevout.hash);
-    assert(coins && coins->IsAvailable(input.prevout.n));
-    return coins->vout[input.prevout.n];
+    const Coin& coin = AccessCoin(input.prevout);
+    assert(!coin.IsSpent());
+    return coin.out;
 }
 
 CAmount CCoinsViewCache::GetValueIn(const CTransaction& tx) const
@@ -233,9 +389,7 @@ bool CCoinsViewCache::HaveInputs(const CTransaction& tx) const
 {
     if (!tx.IsCoinBase()) {
         for (unsigned int i = 0; i < tx.vin.size(); i++) {
-            const COutPoint& prevout = tx.vin[i].prevout;
-            const CCoins* coins = AccessCoins(prevout.hash);
-            if (!coins || !coins->IsAvailable(prevout.n)) {
+            if (!HaveCoin(tx.vin[i].prevout)) {
                 return false;
             }
         }
@@ -249,28 +403,21 @@ double CCoinsViewCache::GetPriority(const CTransaction& tx, int nHeight) const
         return 0.0;
     double dResult = 0.0;
     for (const CTxIn& txin:  tx.vin) {
-        const CCoins* coins = AccessCoins(txin.prevout.hash);
-        assert(coins);
-        if (!coins->IsAvailable(txin.prevout.n)) continue;
-        if (coins->nHeight < nHeight) {
-            dResult += coins->vout[txin.prevout.n].nValue * (nHeight - coins->nHeight);
+        const Coin& coin = AccessCoin(txin.prevout);
+        if (coin.IsSpent()) continue;
+        if (coin.nHeight < (unsigned int)nHeight) {
+            dResult += coin.out.nValue * (nHeight - coin.nHeight);
         }
     }
     return tx.ComputePriority(dResult);
 }
 
-CCoinsModifier::CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_) : cache(cache_), it(it_)
-{
-    assert(!cache.hasModifier);
-    cache.hasModifier = true;
-}
+static const size_t MAX_OUTPUTS_PER_TX = MAX_BLOCK_SIZE / ::GetSerializeSize(CTxOut(), SER_NETWORK, PROTOCOL_VERSION);
 
-CCoinsModifier::~CCoinsModifier()
+const Coin& AccessByTxid(const CCoinsViewCache& view, const uint256& txid, uint32_t nOutputs)
 {
-    assert(cache.hasModifier);
-    cache.hasModifier = false;
-    it->second.coins.Cleanup();
-    if ((it->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned()) {
-        cache.cacheCoins.erase(it);
-    }
+    COutPoint outpoint;
+    if (!view.FindCoinByTxid(txid, 0, std::min(nOutputs, (uint32_t)MAX_OUTPUTS_PER_TX), outpoint))
+        return coinEmpty;
+    return view.AccessCoin(outpoint);
 }
@@ -0,0 +1,182 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Copyright (c) 2015-2017 The LUX developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "crypto/muhash.h"
+
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+
+#include <string.h>
+
+namespace
+{
+/** 2^3072 - MAX_PRIME_DIFF is the largest prime below 2^3072 */
+const Num3072::limb_t MAX_PRIME_DIFF = 1103717;
+const Num3072::limb_t MAX_LIMB = ~(Num3072::limb_t)0;
+} // anon namespace
+
+Num3072::Num3072(const unsigned char data[BYTE_SIZE])
+{
+    for (int i = 0; i < LIMBS; i++) {
+        limbs[i] = 0;
+        for (int j = LIMB_SIZE / 8 - 1; j >= 0; j--)
+            limbs[i] = (limbs[i] << 8) | data[i * (LIMB_SIZE / 8) + j];
+    }
+}
+
+void Num3072::ToBytes(unsigned char out[BYTE_SIZE]) const
+{
+    for (int i = 0; i < LIMBS; i++) {
+        limb_t limb = limbs[i];
+        for (int j = 0; j < LIMB_SIZE / 8; j++) {
+            out[i * (LIMB_SIZE / 8) + j] = limb & 0xff;
+            limb >>= 8;
+        }
+    }
+}
+
+void Num3072::SetToOne()
+{
+    limbs[0] = 1;
+    for (int i = 1; i < LIMBS; i++)
+        limbs[i] = 0;
+}
+
+/** Whether the value is at least the modulus; it is always below 2^3072. */
+bool Num3072::IsOverflow() const
+{
+    if (limbs[0] <= MAX_LIMB - MAX_PRIME_DIFF)
+        return false;
+    for (int i = 1; i < LIMBS; i++) {
+        if (limbs[i] != MAX_LIMB)
+            return false;
+    }
+    return true;
+}
+
+/** Subtract the modulus, which is adding MAX_PRIME_DIFF and dropping bit 3072. */
+void Num3072::FullReduce()
+{
+    limb_t carry = MAX_PRIME_DIFF;
+    for (int i = 0; i < LIMBS && carry; i++) {
+        double_limb_t v = (double_limb_t)limbs[i] + carry;
+        limbs[i] = (limb_t)v;
+        carry = (limb_t)(v >> LIMB_SIZE);
+    }
+}
+
+/** Fold carry * 2^3072, which is carry * MAX_PRIME_DIFF modulo the prime, back in. */
+void Num3072::Reduce(limb_t carry)
+{
+    while (carry) {
+        double_limb_t v = (double_limb_t)carry * MAX_PRIME_DIFF;
+        for (int i = 0; i < LIMBS && v; i++) {
+            v += limbs[i];
+            limbs[i] = (limb_t)v;
+            v >>= LIMB_SIZE;
+        }
+        // Only wraps again when the value was within MAX_PRIME_DIFF^2 of
+        // 2^3072, after which it is small and the next round ends it.
+        carry = (limb_t)v;
+    }
+    if (IsOverflow())
+        FullReduce();
+}
+
+void Num3072::Multiply(const Num3072& a)
+{
+    // Schoolbook product into 2 * LIMBS limbs; a may be *this.
+    limb_t t[2 * LIMBS];
+    memset(t, 0, sizeof(t));
+    for (int i = 0; i < LIMBS; i++) {
+        limb_t carry = 0;
+        for (int j = 0; j < LIMBS; j++) {
+            double_limb_t v = (double_limb_t)limbs[i] * a.limbs[j] + t[i + j] + carry;
+            t[i + j] = (limb_t)v;
+            carry = (limb_t)(v >> LIMB_SIZE);
+        }
+        t[i + LIMBS] = carry;
+    }
+
+    // high * 2^3072 + low == high * MAX_PRIME_DIFF + low
+    limb_t carry = 0;
+    for (int i = 0; i < LIMBS; i++) {
+        double_limb_t v = (double_limb_t)t[LIMBS + i] * MAX_PRIME_DIFF + t[i] + carry;
+        limbs[i] = (limb_t)v;
+        carry = (limb_t)(v >> LIMB_SIZE);
+    }
+    Reduce(carry);
+}
+
+/** Fermat inverse: this^(p - 2) */
+Num3072 Num3072::GetInverse() const
+{
+    const limb_t nLowestLimb = (limb_t)0 - (MAX_PRIME_DIFF + 2);
+    Num3072 r;
+    for (int i = LIMBS * LIMB_SIZE - 1; i >= 0; i--) {
+        r.Multiply(r);
+        limb_t e = i < LIMB_SIZE ? nLowestLimb : MAX_LIMB;
+        if ((e >> (i % LIMB_SIZE)) & 1)
+            r.Multiply(*this);
+    }
+    return r;
+}
+
+void Num3072::Divide(const Num3072& a)
+{
+    Num3072 inv = a.GetInverse();
+    Multiply(inv);
+}
+
+Num3072 MuHash3072::ToNum3072(const unsigned char* data, size_t len)
+{
+    // Stretch the element's SHA256 to 384 bytes with SHA256 in counter mode;
+    // the counter blocks are independent, so they are hashed side by side.
+    static const size_t BLOCKS = Num3072::BYTE_SIZE / CSHA256::OUTPUT_SIZE;
+    unsigned char seeds[BLOCKS][CSHA256::OUTPUT_SIZE + 4];
+    const unsigned char* in[BLOCKS];
+    CSHA256().Write(data, len).Finalize(seeds[0]);
+    for (uint32_t i = 0; i < BLOCKS; i++) {
+        memcpy(seeds[i], seeds[0], CSHA256::OUTPUT_SIZE);
+        WriteLE32(seeds[i] + CSHA256::OUTPUT_SIZE, i);
+        in[i] = seeds[i];
+    }
+    unsigned char buf[Num3072::BYTE_SIZE];
+    SHA256Multi(in, sizeof(seeds[0]), BLOCKS, buf);
+    return Num3072(buf);
+}
+
+MuHash3072& MuHash3072::Insert(const unsigned char* data, size_t len)
+{
+    numerator.Multiply(ToNum3072(data, len));
+    return *this;
+}
+
+MuHash3072& MuHash3072::Remove(const unsigned char* data, size_t len)
+{
+    denominator.Multiply(ToNum3072(data, len));
+    return *this;
+}
+
+void MuHash3072::Finalize(unsigned char hash[OUTPUT_SIZE]) const
+{
+    Num3072 quotient = numerator;
+    quotient.Divide(denominator);
+    unsigned char buf[Num3072::BYTE_SIZE];
+    quotient.ToBytes(buf);
+    CSHA256().Write(buf, sizeof(buf)).Finalize(hash);
+}
+
+void MuHash3072::ToBytes(unsigned char out[STATE_SIZE]) const
+{
+    numerator.ToBytes(out);
+    denominator.ToBytes(out + Num3072::BYTE_SIZE);
+}
+
+void MuHash3072::FromBytes(const unsigned char in[STATE_SIZE])
+{
+    numerator = Num3072(in);
+    denominator = Num3072(in + Num3072::BYTE_SIZE);
+}
@@ -0,0 +1,152 @@
+// Copyright (c) 2015-2017 The LUX developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#if defined(HAVE_CONFIG_H)
+#include "config/lux-config.h"
+#endif
+
+#include "crypto/phi1612.h"
+
+#include "crypto/phi1612_lanes.h"
+#include "crypto/sph_cubehash.h"
+#include "crypto/sph_echo.h"
+#include "crypto/sph_fugue.h"
+#include "crypto/sph_gost.h"
+#include "crypto/sph_jh.h"
+#include "crypto/sph_skein.h"
+
+#include <string.h>
+
+namespace phi1612
+{
+#if defined(ENABLE_SSE2)
+void Hash4WaySSE2(const unsigned char* const in[4], unsigned char* out);
+#endif
+#if defined(ENABLE_AVX2)
+void Hash8WayAVX2(const unsigned char* const in[8], unsigned char* out);
+#endif
+
+void Skein512_80(const unsigned char* in, unsigned char* out)
+{
+    sph_skein512_context ctx;
+    sph_skein512_init(&ctx);
+    sph_skein512(&ctx, in, PHI1612_HEADER_SIZE);
+    sph_skein512_close(&ctx, out);
+}
+
+void JH512_64(const unsigned char* in, unsigned char* out)
+{
+    sph_jh512_context ctx;
+    sph_jh512_init(&ctx);
+    sph_jh512(&ctx, in, 64);
+    sph_jh512_close(&ctx, out);
+}
+
+void Fugue512_64(const unsigned char* in, unsigned char* out)
+{
+    sph_fugue512_context ctx;
+    sph_fugue512_init(&ctx);
+    sph_fugue512(&ctx, in, 64);
+    sph_fugue512_close(&ctx, out);
+}
+
+void Gost512_64(const unsigned char* in, unsigned char* out)
+{
+    sph_gost512_context ctx;
+    sph_gost512_init(&ctx);
+    sph_gost512(&ctx, in, 64);
+    sph_gost512_close(&ctx, out);
+}
+
+void Echo512_64(const unsigned char* in, unsigned char* out)
+{
+    sph_echo512_context ctx;
+    sph_echo512_init(&ctx);
+    sph_echo512(&ctx, in, 64);
+    sph_echo512_close(&ctx, out);
+}
+
+namespace
+{
+typedef void (*HashNWayFn)(const unsigned char* const in[], unsigned char* out);
+
+struct Backend {
+    const char* name;
+    size_t lanes;
+    HashNWayFn fn;
+};
+
+Backend SelectBackend()
+{
+    Backend backend = {"scalar", 1, NULL};
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__amd64__) || defined(__i386__))
+    __builtin_cpu_init();
+#if defined(ENABLE_AVX2)
+    if (__builtin_cpu_supports("avx2")) {
+        backend.name = "avx2";
+        backend.lanes = 8;
+        backend.fn = Hash8WayAVX2;
+        return backend;
+    }
+#endif
+#if defined(ENABLE_SSE2)
+    if (__builtin_cpu_supports("sse2")) {
+        backend.name = "sse2";
+        backend.lanes = 4;
+        backend.fn = Hash4WaySSE2;
+        return backend;
+    }
+#endif
+#endif
+    return backend;
+}
+
+const Backend& GetBackend()
+{
+    static const Backend backend = SelectBackend();
+    return backend;
+}
+} // anon namespace
+} // namespace phi1612
+
+void Phi1612Scalar(const unsigned char* in, unsigned char* out)
+{
+    unsigned char a[64];
+    unsigned char b[64];
+
+    phi1612::Skein512_80(in, a);
+    phi1612::JH512_64(a, b);
+
+    sph_cubehash512_context ctx_cubehash;
+    sph_cubehash512_init(&ctx_cubehash);
+    sph_cubehash512(&ctx_cubehash, b, 64);
+    sph_cubehash512_close(&ctx_cubehash, a);
+
+    phi1612::Fugue512_64(a, b);
+    phi1612::Gost512_64(b, a);
+    phi1612::Echo512_64(a, b);
+    memcpy(out, b, PHI1612_OUTPUT_SIZE);
+}
+
+void Phi1612Batch(const unsigned char* const in[], size_t n, unsigned char* out)
+{
+    const phi1612::Backend& backend = phi1612::GetBackend();
+    size_t i = 0;
+    if (backend.fn) {
+        for (; i + backend.lanes <= n; i += backend.lanes)
+            backend.fn(in + i, out + PHI1612_OUTPUT_SIZE * i);
+    }
+    for (; i < n; i++)
+        Phi1612Scalar(in[i], out + PHI1612_OUTPUT_SIZE * i);
+}
+
+size_t Phi1612BatchLanes()
+{
+    return phi1612::GetBackend().lanes;
+}
+
+const char* Phi1612BatchImplementation()
+{
+    return phi1612::GetBackend().name;
+}
@@ -0,0 +1,34 @@
+// Copyright (c) 2015-2017 The LUX developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CRYPTO_PHI1612_H
+#define BITCOIN_CRYPTO_PHI1612_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/** Size in bytes of a serialized block header, the only input the batch API accepts. */
+static const size_t PHI1612_HEADER_SIZE = 80;
+/** Size in bytes of a PHI1612 digest (the low half of the final 512-bit echo state). */
+static const size_t PHI1612_OUTPUT_SIZE = 32;
+
+/**
+ * Hash n 80-byte block headers with PHI1612 (skein, jh, cubehash, fugue, gost,
+ * echo). Digest i is written to out + 32 * i. Headers are processed in groups
+ * of Phi1612BatchLanes() using the widest multi-buffer backend the CPU supports;
+ * any remainder goes through the scalar reference path. The result is identical
+ * to calling Phi1612() on each header.
+ */
+void Phi1612Batch(const unsigned char* const in[], size_t n, unsigned char* out);
+
+/** Hash a single 80-byte header with the scalar reference path. */
+void Phi1612Scalar(const unsigned char* in, unsigned char* out);
+
+/** Number of headers the selected backend hashes per pass (1, 4 or 8). */
+size_t Phi1612BatchLanes();
+
+/** Name of the selected backend ("avx2", "sse2" or "scalar"). */
+const char* Phi1612BatchImplementation();
+
+#endif // BITCOIN_CRYPTO_PHI1612_H
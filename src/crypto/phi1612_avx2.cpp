@@ -0,0 +1,15 @@
+// Copyright (c) 2015-2017 The LUX developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Built with AVX2_CXXFLAGS: eight headers per pass, one per 32-bit ymm lane.
+
+#include "crypto/phi1612_lanes.h"
+
+namespace phi1612
+{
+void Hash8WayAVX2(const unsigned char* const in[8], unsigned char* out)
+{
+    HashLanes<8>(in, out);
+}
+} // namespace phi1612
@@ -0,0 +1,145 @@
+// Copyright (c) 2015-2017 The LUX developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Internal header: multi-buffer kernels shared by the SSE2 and AVX2 PHI1612
+// backends. Each translation unit including this file is built with its own
+// instruction set flags, so the same generic vector code is lowered to xmm or
+// ymm registers. CubeHash is 32-bit ARX with no data-dependent lookups and
+// spends the most rounds of the chain, so it is the stage vectorized here.
+// Skein is 64-bit ARX and is faster with native scalar rotates than split
+// across vector halves without a rotate instruction; it and the table-driven
+// stages (jh, fugue, gost, echo) run per lane in phi1612.cpp.
+
+#ifndef BITCOIN_CRYPTO_PHI1612_LANES_H
+#define BITCOIN_CRYPTO_PHI1612_LANES_H
+
+#include "crypto/common.h"
+#include "crypto/phi1612.h"
+
+#include <stdint.h>
+#include <string.h>
+
+namespace phi1612
+{
+/** Scalar stages, implemented in phi1612.cpp. Each hashes one lane. */
+void Skein512_80(const unsigned char* in, unsigned char* out);
+void JH512_64(const unsigned char* in, unsigned char* out);
+void Fugue512_64(const unsigned char* in, unsigned char* out);
+void Gost512_64(const unsigned char* in, unsigned char* out);
+void Echo512_64(const unsigned char* in, unsigned char* out);
+
+template <int N>
+struct Lanes;
+
+template <>
+struct Lanes<4> {
+    typedef uint32_t V32 __attribute__((vector_size(16)));
+};
+
+template <>
+struct Lanes<8> {
+    typedef uint32_t V32 __attribute__((vector_size(32)));
+};
+
+#define PHI_ROTL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+/* ----------- CubeHash16/32-512, 64-byte message --------------------------- */
+
+static const uint32_t CUBEHASH_IV512[32] = {
+    0x2AEA2A61, 0x50F494D4, 0x2D538B8B, 0x4167D83E, 0x3FEE2313, 0xC701CF8C, 0xCC39968E, 0x50AC5695,
+    0x4D42C787, 0xA647A8B3, 0x97CF0BEF, 0x825B4537, 0xEEF864D2, 0xF22090C4, 0xD0E5CD33, 0xA23911AE,
+    0xFCD398D9, 0x148FE485, 0x1B017BEF, 0xB6444532, 0x6A536159, 0x2FF5781C, 0x91FA7934, 0x0DBADEA9,
+    0xD65C8A2B, 0xA5A70E75, 0xB1C62456, 0xBC796576, 0x1921C8F7, 0xE7989AF1, 0x7795D246, 0xD43E3B44};
+
+#define PHI_X16(M) M(0) M(1) M(2) M(3) M(4) M(5) M(6) M(7) M(8) M(9) M(10) M(11) M(12) M(13) M(14) M(15)
+#define CH_ADD_ROT7(i) x[16 + i] += x[i]; t[i] = PHI_ROTL32(x[i], 7);
+#define CH_SWAP8_XOR(i) x[i] = t[i ^ 8] ^ x[16 + i];
+#define CH_SWAP2(i) t[i] = x[16 + (i ^ 2)];
+#define CH_ADD_ROT11(i) x[16 + i] = t[i] + x[i]; t[i] = PHI_ROTL32(x[i], 11);
+#define CH_SWAP4_XOR(i) x[i] = t[i ^ 4] ^ x[16 + i];
+#define CH_SWAP1(i) t[i] = x[16 + (i ^ 1)];
+#define CH_STORE(i) x[16 + i] = t[i];
+
+/**
+ * nRounds CubeHash rounds. The swap steps of the specification are folded
+ * into the index pattern; every index is a constant so the state stays in
+ * registers.
+ */
+template <int N>
+inline void CubeHashRounds(typename Lanes<N>::V32 x[32], int nRounds)
+{
+    typedef typename Lanes<N>::V32 V;
+    V t[16];
+    for (int r = 0; r < nRounds; r++) {
+        PHI_X16(CH_ADD_ROT7)
+        PHI_X16(CH_SWAP8_XOR)
+        PHI_X16(CH_SWAP2)
+        PHI_X16(CH_ADD_ROT11)
+        PHI_X16(CH_SWAP4_XOR)
+        PHI_X16(CH_SWAP1)
+        PHI_X16(CH_STORE)
+    }
+}
+
+#undef CH_ADD_ROT7
+#undef CH_SWAP8_XOR
+#undef CH_SWAP2
+#undef CH_ADD_ROT11
+#undef CH_SWAP4_XOR
+#undef CH_SWAP1
+#undef CH_STORE
+#undef PHI_X16
+
+/** CubeHash-512 of N 64-byte messages, identical to sph_cubehash512 on each. */
+template <int N>
+inline void CubeHash512_64(const unsigned char in[N][64], unsigned char out[N][64])
+{
+    typedef typename Lanes<N>::V32 V;
+    V x[32];
+    for (int i = 0; i < 32; i++)
+        for (int l = 0; l < N; l++)
+            x[i][l] = CUBEHASH_IV512[i];
+
+    for (int b = 0; b < 2; b++) {
+        for (int i = 0; i < 8; i++)
+            for (int l = 0; l < N; l++)
+                x[i][l] ^= ReadLE32(in[l] + 32 * b + 4 * i);
+        CubeHashRounds<N>(x, 16);
+    }
+
+    // Padding block (a single 0x80 byte), then finalization.
+    x[0] ^= 0x80;
+    CubeHashRounds<N>(x, 16);
+    x[31] ^= 1;
+    CubeHashRounds<N>(x, 160);
+
+    for (int i = 0; i < 16; i++)
+        for (int l = 0; l < N; l++)
+            WriteLE32(out[l] + 4 * i, x[i][l]);
+}
+
+#undef PHI_ROTL32
+
+/** Full PHI1612 chain over N headers; cubehash runs N lanes wide. */
+template <int N>
+inline void HashLanes(const unsigned char* const in[N], unsigned char* out)
+{
+    unsigned char a[N][64];
+    unsigned char b[N][64];
+
+    for (int l = 0; l < N; l++) {
+        Skein512_80(in[l], a[l]);
+        JH512_64(a[l], b[l]);
+    }
+    CubeHash512_64<N>(b, a);
+    for (int l = 0; l < N; l++) {
+        Fugue512_64(a[l], b[l]);
+        Gost512_64(b[l], a[l]);
+        Echo512_64(a[l], b[l]);
+        memcpy(out + PHI1612_OUTPUT_SIZE * l, b[l], PHI1612_OUTPUT_SIZE);
+    }
+}
+} // namespace phi1612
+
+#endif // BITCOIN_CRYPTO_PHI1612_LANES_H
@@ -0,0 +1,15 @@
+// Copyright (c) 2015-2017 The LUX developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Built with SSE2_CXXFLAGS: four headers per pass, one per 32-bit xmm lane.
+
+#include "crypto/phi1612_lanes.h"
+
+namespace phi1612
+{
+void Hash4WaySSE2(const unsigned char* const in[4], unsigned char* out)
+{
+    HashLanes<4>(in, out);
+}
+} // namespace phi1612
@@ -2,12 +2,48 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#if defined(HAVE_CONFIG_H)
+#include "config/lux-config.h"
+#endif
+
+// libbitcoinconsensus is linked without the intrinsics backends, which are
+// only built as static archives for the executables, so it keeps to the
+// scalar code.
+#if defined(BUILD_BITCOIN_INTERNAL)
+#undef ENABLE_SHANI
+#undef ENABLE_SSE41
+#undef ENABLE_AVX2
+#endif
+
 #include "crypto/sha256.h"
 
 #include "crypto/common.h"
 
 #include <string.h>
 
+#if defined(ENABLE_SHANI)
+#include <cpuid.h>
+#endif
+
+#if defined(ENABLE_SHANI)
+namespace sha256_shani
+{
+void Transform(uint32_t* s, const unsigned char* chunk, size_t blocks);
+}
+#endif
+
+namespace sha256_lanes
+{
+#if defined(ENABLE_SSE41)
+void Hash4WaySSE41(const unsigned char* const in[4], size_t len, unsigned char* out);
+void D64_4WaySSE41(unsigned char* out, const unsigned char* in);
+#endif
+#if defined(ENABLE_AVX2)
+void Hash8WayAVX2(const unsigned char* const in[8], size_t len, unsigned char* out);
+void D64_8WayAVX2(unsigned char* out, const unsigned char* in);
+#endif
+}
+
 // Internal implementation code.
 namespace
 {
@@ -127,7 +163,138 @@ void Transform(uint32_t* s, const unsigned char* chunk)
     s[7] += h;
 }
 
+/** The scalar reference over consecutive chunks. */
+void TransformBlocks(uint32_t* s, const unsigned char* chunk, size_t blocks)
+{
+    while (blocks--) {
+        Transform(s, chunk);
+        chunk += 64;
+    }
+}
+
 } // namespace sha256
+
+typedef void (*TransformType)(uint32_t* s, const unsigned char* chunk, size_t blocks);
+typedef void (*HashNWayType)(const unsigned char* const in[], size_t len, unsigned char* out);
+typedef void (*D64NWayType)(unsigned char* out, const unsigned char* in);
+
+// Set once by SHA256AutoDetect() during startup, before other threads hash.
+TransformType Transform = sha256::TransformBlocks;
+HashNWayType Hash8Way = NULL;
+HashNWayType Hash4Way = NULL;
+D64NWayType D64_8Way = NULL;
+D64NWayType D64_4Way = NULL;
+
+/** The digest of the state s, as CSHA256::Finalize writes it. */
+void inline WriteDigest(unsigned char* out, const uint32_t* s)
+{
+    WriteBE32(out, s[0]);
+    WriteBE32(out + 4, s[1]);
+    WriteBE32(out + 8, s[2]);
+    WriteBE32(out + 12, s[3]);
+    WriteBE32(out + 16, s[4]);
+    WriteBE32(out + 20, s[5]);
+    WriteBE32(out + 24, s[6]);
+    WriteBE32(out + 28, s[7]);
+}
+
+/** Double SHA-256 of one 64-byte input on the single-stream transform. */
+void TransformD64(unsigned char* out, const unsigned char* in)
+{
+    // The input followed by its padding block: the terminator and the 512-bit
+    // length, so both blocks go through a single Transform call.
+    unsigned char buf[128] = {0};
+    memcpy(buf, in, 64);
+    buf[64] = 0x80;
+    buf[126] = 0x02;
+    uint32_t s[8];
+    sha256::Initialize(s);
+    Transform(s, buf, 2);
+    // The 32-byte digest, its terminator and its 256-bit length
+    memset(buf + 32, 0, 32);
+    WriteDigest(buf, s);
+    buf[32] = 0x80;
+    buf[62] = 0x01;
+    sha256::Initialize(s);
+    Transform(s, buf, 1);
+    WriteDigest(out, s);
+}
+
+/** Test data for the self-tests: enough for 8 lanes at different offsets. */
+void FillSelfTestData(unsigned char* data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+        data[i] = (unsigned char)(i * 131 + 7);
+}
+
+/** Whether transform agrees with the scalar reference. */
+bool SelfTestTransform(TransformType transform)
+{
+    unsigned char data[256];
+    FillSelfTestData(data, sizeof(data));
+    for (size_t blocks = 1; blocks <= 4; blocks++) {
+        uint32_t s1[8], s2[8];
+        sha256::Initialize(s1);
+        sha256::Initialize(s2);
+        sha256::TransformBlocks(s1, data, blocks);
+        transform(s2, data, blocks);
+        if (memcmp(s1, s2, sizeof(s1)))
+            return false;
+    }
+    return true;
+}
+
+/** Whether hash agrees with the scalar reference on lanes messages of several lengths. */
+bool SelfTestMulti(HashNWayType hash, size_t lanes)
+{
+    static const size_t LENGTHS[] = {0, 1, 32, 36, 55, 56, 63, 64, 65, 119, 120, 200};
+    unsigned char data[256];
+    FillSelfTestData(data, sizeof(data));
+    for (size_t t = 0; t < sizeof(LENGTHS) / sizeof(LENGTHS[0]); t++) {
+        const unsigned char* in[8];
+        unsigned char out[8 * CSHA256::OUTPUT_SIZE];
+        for (size_t l = 0; l < lanes; l++)
+            in[l] = data + 7 * l;
+        hash(in, LENGTHS[t], out);
+        for (size_t l = 0; l < lanes; l++) {
+            unsigned char ref[CSHA256::OUTPUT_SIZE];
+            CSHA256().Write(in[l], LENGTHS[t]).Finalize(ref);
+            if (memcmp(ref, out + CSHA256::OUTPUT_SIZE * l, sizeof(ref)))
+                return false;
+        }
+    }
+    return true;
+}
+
+/** Whether the lanes-wide double SHA-256 agrees with the single-stream one. */
+bool SelfTestD64(D64NWayType d64, size_t lanes)
+{
+    unsigned char data[64 * 8];
+    unsigned char out[8 * CSHA256::OUTPUT_SIZE];
+    FillSelfTestData(data, sizeof(data));
+    d64(out, data);
+    for (size_t l = 0; l < lanes; l++) {
+        unsigned char ref[CSHA256::OUTPUT_SIZE];
+        TransformD64(ref, data + 64 * l);
+        if (memcmp(ref, out + CSHA256::OUTPUT_SIZE * l, sizeof(ref)))
+            return false;
+    }
+    return true;
+}
+
+#if defined(ENABLE_SHANI)
+/** The SHA extensions and SSE4.1, which the SHA-NI backend also uses. */
+bool HaveSHANI()
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid_max(0, NULL) < 7)
+        return false;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    bool fSHA = (ebx >> 29) & 1;
+    __cpuid(1, eax, ebx, ecx, edx);
+    return fSHA && ((ecx >> 19) & 1);
+}
+#endif
 } // namespace
 
 
@@ -147,14 +314,15 @@ CSHA256& CSHA256::Write(const unsigned char* data, size_t len)
         memcpy(buf + bufsize, data, 64 - bufsize);
         bytes += 64 - bufsize;
         data += 64 - bufsize;
-        sha256::Transform(s, buf);
+        Transform(s, buf, 1);
         bufsize = 0;
     }
-    while (end >= data + 64) {
+    if (end - data >= 64) {
         // Process full chunks directly from the source.
-        sha256::Transform(s, data);
-        bytes += 64;
-        data += 64;
+        size_t blocks = (end - data) / 64;
+        Transform(s, data, blocks);
+        bytes += 64 * blocks;
+        data += 64 * blocks;
     }
     if (end > data) {
         // Fill the buffer with what remains.
@@ -187,3 +355,82 @@ CSHA256& CSHA256::Reset()
     sha256::Initialize(s);
     return *this;
 }
+
+std::string SHA256AutoDetect()
+{
+    std::string strSingle = "scalar";
+    std::string strMulti;
+    Transform = sha256::TransformBlocks;
+    Hash8Way = NULL;
+    Hash4Way = NULL;
+    D64_8Way = NULL;
+    D64_4Way = NULL;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__amd64__) || defined(__i386__))
+    __builtin_cpu_init();
+#if defined(ENABLE_SHANI)
+    if (HaveSHANI()) {
+        if (SelfTestTransform(sha256_shani::Transform)) {
+            Transform = sha256_shani::Transform;
+            strSingle = "shani";
+        } else {
+            strSingle = "scalar (shani failed its self-test)";
+        }
+    }
+#endif
+    // One SHA-NI stream is faster than the multi-buffer backends, which only
+    // help the scalar path.
+    bool fMultiBuffer = Transform == sha256::TransformBlocks;
+#if defined(ENABLE_AVX2)
+    if (fMultiBuffer && __builtin_cpu_supports("avx2")) {
+        if (SelfTestMulti(sha256_lanes::Hash8WayAVX2, 8) && SelfTestD64(sha256_lanes::D64_8WayAVX2, 8)) {
+            Hash8Way = sha256_lanes::Hash8WayAVX2;
+            D64_8Way = sha256_lanes::D64_8WayAVX2;
+            strMulti += ", avx2 (8-way)";
+        } else {
+            strMulti += ", avx2 failed its self-test";
+        }
+    }
+#endif
+#if defined(ENABLE_SSE41)
+    if (fMultiBuffer && __builtin_cpu_supports("sse4.1")) {
+        if (SelfTestMulti(sha256_lanes::Hash4WaySSE41, 4) && SelfTestD64(sha256_lanes::D64_4WaySSE41, 4)) {
+            Hash4Way = sha256_lanes::Hash4WaySSE41;
+            D64_4Way = sha256_lanes::D64_4WaySSE41;
+            strMulti += ", sse4.1 (4-way)";
+        } else {
+            strMulti += ", sse4.1 failed its self-test";
+        }
+    }
+#endif
+#endif
+    return strSingle + strMulti;
+}
+
+void SHA256Multi(const unsigned char* const in[], size_t len, size_t n, unsigned char* out)
+{
+    size_t i = 0;
+    if (Hash8Way) {
+        for (; i + 8 <= n; i += 8)
+            Hash8Way(in + i, len, out + CSHA256::OUTPUT_SIZE * i);
+    }
+    if (Hash4Way) {
+        for (; i + 4 <= n; i += 4)
+            Hash4Way(in + i, len, out + CSHA256::OUTPUT_SIZE * i);
+    }
+    for (; i < n; i++)
+        CSHA256().Write(in[i], len).Finalize(out + CSHA256::OUTPUT_SIZE * i);
+}
+
+void SHA256D64(unsigned char* out, const unsigned char* in, size_t blocks)
+{
+    if (D64_8Way) {
+        for (; blocks >= 8; blocks -= 8, in += 64 * 8, out += CSHA256::OUTPUT_SIZE * 8)
+            D64_8Way(out, in);
+    }
+    if (D64_4Way) {
+        for (; blocks >= 4; blocks -= 4, in += 64 * 4, out += CSHA256::OUTPUT_SIZE * 4)
+            D64_4Way(out, in);
+    }
+    for (; blocks > 0; blocks--, in += 64, out += CSHA256::OUTPUT_SIZE)
+        TransformD64(out, in);
+}
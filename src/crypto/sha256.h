@@ -7,6 +7,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string>
 
 /** A hasher class for SHA-256. */
 class CSHA256
@@ -25,4 +26,25 @@ public:
     CSHA256& Reset();
 };
 
+/**
+ * Select the fastest SHA-256 backends the CPU supports, each only after it
+ * matches the scalar reference on a self-test, and describe the choice.
+ * Until this is called everything runs on the scalar reference.
+ */
+std::string SHA256AutoDetect();
+
+/**
+ * SHA-256 of n messages of len bytes each. Digest i is written to
+ * out + 32 * i. Messages are hashed several at a time on the multi-buffer
+ * backends; the result is identical to CSHA256 on each message.
+ */
+void SHA256Multi(const unsigned char* const in[], size_t len, size_t n, unsigned char* out);
+
+/**
+ * Double SHA-256 of each of blocks consecutive 64-byte inputs, as the nodes of
+ * a merkle tree level are: out + 32 * i = SHA256(SHA256(in + 64 * i)). Inputs
+ * are hashed 8 or 4 at a time on the multi-buffer backends.
+ */
+void SHA256D64(unsigned char* out, const unsigned char* in, size_t blocks);
+
 #endif // BITCOIN_CRYPTO_SHA256_H
@@ -0,0 +1,20 @@
+// Copyright (c) 2015-2017 The LUX developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Built with AVX2_CXXFLAGS: eight messages per pass, one per 32-bit ymm lane.
+
+#include "crypto/sha256_lanes.h"
+
+namespace sha256_lanes
+{
+void Hash8WayAVX2(const unsigned char* const in[8], size_t len, unsigned char* out)
+{
+    HashLanes<8>(in, len, out);
+}
+
+void D64_8WayAVX2(unsigned char* out, const unsigned char* in)
+{
+    HashD64Lanes<8>(out, in);
+}
+} // namespace sha256_lanes
@@ -0,0 +1,207 @@
+// Copyright (c) 2015-2017 The LUX developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Internal header: multi-buffer SHA-256 shared by the SSE4.1 and AVX2
+// backends. Each translation unit including this file is built with its own
+// instruction set flags, so the same generic vector code is lowered to xmm or
+// ymm registers, one independent message per 32-bit lane.
+
+#ifndef BITCOIN_CRYPTO_SHA256_LANES_H
+#define BITCOIN_CRYPTO_SHA256_LANES_H
+
+#include "crypto/common.h"
+
+#include <stdint.h>
+#include <string.h>
+
+namespace sha256_lanes
+{
+template <int N>
+struct Lanes;
+
+template <>
+struct Lanes<4> {
+    typedef uint32_t V32 __attribute__((vector_size(16)));
+};
+
+template <>
+struct Lanes<8> {
+    typedef uint32_t V32 __attribute__((vector_size(32)));
+};
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static const uint32_t IV[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+#define SHA_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/** W + K for the padding block of a 64-byte message, the same in every lane. */
+static const uint32_t PAD64_WK[64] = {
+    0xc28a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf374,
+    0x649b69c1, 0xf0fe4786, 0x0fe1edc6, 0x240cf254, 0x4fe9346f, 0x6cc984be, 0x61b9411e, 0x16f988fa,
+    0xf2c65152, 0xa88e5a6d, 0xb019fc65, 0xb9d99ec7, 0x9a1231c3, 0xe70eeaa0, 0xfdb1232b, 0xc7353eb0,
+    0x3069bad5, 0xcb976d5f, 0x5a0f118f, 0xdc1eeefd, 0x0a35b689, 0xde0b7a04, 0x58f4ca9d, 0xe15d5b16,
+    0x007f3e86, 0x37088980, 0xa507ea32, 0x6fab9537, 0x17406110, 0x0d8cd6f1, 0xcdaa3b6d, 0xc0bbbe37,
+    0x83613bda, 0xdb48a363, 0x0b02e931, 0x6fd15ca7, 0x521afaca, 0x31338431, 0x6ed41a95, 0x6d437890,
+    0xc39c91f2, 0x9eccabbd, 0xb5c9a0e6, 0x532fb63c, 0xd2c741c6, 0x07237ea3, 0xa4954b68, 0x4c191d76};
+
+#define SHA_ROUND(a, b, c, d, e, f, g, h, wk)                                                          \
+    do {                                                                                               \
+        V t1 = h + (SHA_ROTR(e, 6) ^ SHA_ROTR(e, 11) ^ SHA_ROTR(e, 25)) + (g ^ (e & (f ^ g))) + (wk); \
+        V t2 = (SHA_ROTR(a, 2) ^ SHA_ROTR(a, 13) ^ SHA_ROTR(a, 22)) + ((a & b) | (c & (a | b)));      \
+        h = g;                                                                                         \
+        g = f;                                                                                         \
+        f = e;                                                                                         \
+        e = d + t1;                                                                                    \
+        d = c;                                                                                         \
+        c = b;                                                                                         \
+        b = a;                                                                                         \
+        a = t1 + t2;                                                                                   \
+    } while (0)
+
+/** One block with message words w (overwritten by the schedule) into the state s. */
+template <int N>
+inline void TransformWords(typename Lanes<N>::V32 s[8], typename Lanes<N>::V32 w[16])
+{
+    typedef typename Lanes<N>::V32 V;
+    V a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = 0; i < 64; i++) {
+        if (i >= 16) {
+            V w15 = w[(i - 15) & 15], w2 = w[(i - 2) & 15];
+            w[i & 15] += (SHA_ROTR(w2, 17) ^ SHA_ROTR(w2, 19) ^ (w2 >> 10)) + w[(i - 7) & 15] +
+                         (SHA_ROTR(w15, 7) ^ SHA_ROTR(w15, 18) ^ (w15 >> 3));
+        }
+        SHA_ROUND(a, b, c, d, e, f, g, h, K[i] + w[i & 15]);
+    }
+    s[0] += a;
+    s[1] += b;
+    s[2] += c;
+    s[3] += d;
+    s[4] += e;
+    s[5] += f;
+    s[6] += g;
+    s[7] += h;
+}
+
+/** The padding block of a 64-byte message, whose schedule is a constant. */
+template <int N>
+inline void TransformPad64(typename Lanes<N>::V32 s[8])
+{
+    typedef typename Lanes<N>::V32 V;
+    V a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = 0; i < 64; i++)
+        SHA_ROUND(a, b, c, d, e, f, g, h, PAD64_WK[i]);
+    s[0] += a;
+    s[1] += b;
+    s[2] += c;
+    s[3] += d;
+    s[4] += e;
+    s[5] += f;
+    s[6] += g;
+    s[7] += h;
+}
+
+/** One 64-byte block of each lane's message into the state s. */
+template <int N>
+inline void TransformLanes(typename Lanes<N>::V32 s[8], const unsigned char* const chunk[N])
+{
+    typedef typename Lanes<N>::V32 V;
+    V w[16];
+    for (int i = 0; i < 16; i++)
+        for (int l = 0; l < N; l++)
+            w[i][l] = ReadBE32(chunk[l] + 4 * i);
+    TransformWords<N>(s, w);
+}
+
+#undef SHA_ROUND
+#undef SHA_ROTR
+
+/** SHA-256 of N messages of len bytes each, identical to CSHA256 on each. */
+template <int N>
+inline void HashLanes(const unsigned char* const in[N], size_t len, unsigned char* out)
+{
+    typedef typename Lanes<N>::V32 V;
+    V s[8];
+    for (int i = 0; i < 8; i++)
+        for (int l = 0; l < N; l++)
+            s[i][l] = IV[i];
+
+    const unsigned char* chunk[N];
+    size_t nBlocks = len / 64;
+    for (size_t b = 0; b < nBlocks; b++) {
+        for (int l = 0; l < N; l++)
+            chunk[l] = in[l] + 64 * b;
+        TransformLanes<N>(s, chunk);
+    }
+
+    // The remaining bytes, the 0x80 terminator and the bit length take one
+    // or two more blocks, the same for every lane.
+    unsigned char tail[N][128];
+    size_t nRemain = len % 64;
+    size_t nTail = nRemain + 9 <= 64 ? 64 : 128;
+    for (int l = 0; l < N; l++) {
+        memcpy(tail[l], in[l] + 64 * nBlocks, nRemain);
+        tail[l][nRemain] = 0x80;
+        memset(tail[l] + nRemain + 1, 0, nTail - nRemain - 9);
+        WriteBE64(tail[l] + nTail - 8, (uint64_t)len << 3);
+    }
+    for (size_t nPos = 0; nPos < nTail; nPos += 64) {
+        for (int l = 0; l < N; l++)
+            chunk[l] = tail[l] + nPos;
+        TransformLanes<N>(s, chunk);
+    }
+
+    for (int l = 0; l < N; l++)
+        for (int i = 0; i < 8; i++)
+            WriteBE32(out + 32 * l + 4 * i, s[i][l]);
+}
+
+/**
+ * Double SHA-256 of N consecutive 64-byte inputs, as hashed by each level
+ * of a merkle tree: out + 32 * l = SHA256(SHA256(in + 64 * l)).
+ */
+template <int N>
+inline void HashD64Lanes(unsigned char* out, const unsigned char* in)
+{
+    typedef typename Lanes<N>::V32 V;
+    V s[8];
+    for (int i = 0; i < 8; i++)
+        for (int l = 0; l < N; l++)
+            s[i][l] = IV[i];
+    const unsigned char* chunk[N];
+    for (int l = 0; l < N; l++)
+        chunk[l] = in + 64 * l;
+    TransformLanes<N>(s, chunk);
+    TransformPad64<N>(s);
+
+    // The first digest's words are the second message as they are; then the
+    // padding of a 32-byte message.
+    V w[16];
+    for (int i = 0; i < 8; i++) {
+        w[i] = s[i];
+        for (int l = 0; l < N; l++)
+            s[i][l] = IV[i];
+    }
+    for (int i = 8; i < 16; i++)
+        for (int l = 0; l < N; l++)
+            w[i][l] = i == 8 ? 0x80000000 : i == 15 ? 256 : 0;
+    TransformWords<N>(s, w);
+
+    for (int l = 0; l < N; l++)
+        for (int i = 0; i < 8; i++)
+            WriteBE32(out + 32 * l + 4 * i, s[i][l]);
+}
+} // namespace sha256_lanes
+
+#endif // BITCOIN_CRYPTO_SHA256_LANES_H
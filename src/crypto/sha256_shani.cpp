@@ -0,0 +1,115 @@
+// Copyright (c) 2015-2017 The LUX developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Built with SHANI_CXXFLAGS: the x86 SHA extensions, which run two rounds
+// per sha256rnds2 and compute the message schedule with sha256msg1/msg2.
+// The state is kept as ABEF and CDGH, the layout those instructions expect.
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <immintrin.h>
+
+namespace
+{
+const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+/** Load four big endian message words. */
+inline __m128i Load(const unsigned char* in)
+{
+    const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)in), MASK);
+}
+
+/** Rounds 4 * g to 4 * g + 3 with message words msg. */
+inline void QuadRound(__m128i& state0, __m128i& state1, __m128i msg, int g)
+{
+    msg = _mm_add_epi32(msg, _mm_loadu_si128((const __m128i*)&K[4 * g]));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+    msg = _mm_shuffle_epi32(msg, 0x0E);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+}
+
+/** First half of a schedule step: adds sigma0 of the following words to m0. */
+inline void ShiftMessageA(__m128i& m0, __m128i m1)
+{
+    m0 = _mm_sha256msg1_epu32(m0, m1);
+}
+
+/** Second half: adds the rest of the schedule terms to m2, which becomes the next four words. */
+inline void ShiftMessageC(__m128i m0, __m128i m1, __m128i& m2)
+{
+    m2 = _mm_sha256msg2_epu32(_mm_add_epi32(m2, _mm_alignr_epi8(m1, m0, 4)), m1);
+}
+
+inline void ShiftMessageB(__m128i& m0, __m128i m1, __m128i& m2)
+{
+    ShiftMessageC(m0, m1, m2);
+    ShiftMessageA(m0, m1);
+}
+} // anon namespace
+
+namespace sha256_shani
+{
+void Transform(uint32_t* s, const unsigned char* chunk, size_t blocks)
+{
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&s[0]), 0xB1); // CDAB
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&s[4]), 0x1B); // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);      // CDGH
+
+    while (blocks--) {
+        __m128i abef = state0, cdgh = state1;
+        __m128i m0 = Load(chunk), m1 = Load(chunk + 16), m2 = Load(chunk + 32), m3 = Load(chunk + 48);
+
+        QuadRound(state0, state1, m0, 0);
+        QuadRound(state0, state1, m1, 1);
+        ShiftMessageA(m0, m1);
+        QuadRound(state0, state1, m2, 2);
+        ShiftMessageA(m1, m2);
+        QuadRound(state0, state1, m3, 3);
+        ShiftMessageB(m2, m3, m0);
+        QuadRound(state0, state1, m0, 4);
+        ShiftMessageB(m3, m0, m1);
+        QuadRound(state0, state1, m1, 5);
+        ShiftMessageB(m0, m1, m2);
+        QuadRound(state0, state1, m2, 6);
+        ShiftMessageB(m1, m2, m3);
+        QuadRound(state0, state1, m3, 7);
+        ShiftMessageB(m2, m3, m0);
+        QuadRound(state0, state1, m0, 8);
+        ShiftMessageB(m3, m0, m1);
+        QuadRound(state0, state1, m1, 9);
+        ShiftMessageB(m0, m1, m2);
+        QuadRound(state0, state1, m2, 10);
+        ShiftMessageB(m1, m2, m3);
+        QuadRound(state0, state1, m3, 11);
+        ShiftMessageB(m2, m3, m0);
+        QuadRound(state0, state1, m0, 12);
+        ShiftMessageB(m3, m0, m1);
+        QuadRound(state0, state1, m1, 13);
+        ShiftMessageC(m0, m1, m2);
+        QuadRound(state0, state1, m2, 14);
+        ShiftMessageC(m1, m2, m3);
+        QuadRound(state0, state1, m3, 15);
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+        chunk += 64;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);    // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xB1); // DCHG
+    _mm_storeu_si128((__m128i*)&s[0], _mm_blend_epi16(tmp, state1, 0xF0)); // DCBA
+    _mm_storeu_si128((__m128i*)&s[4], _mm_alignr_epi8(state1, tmp, 8));    // HGFE
+}
+} // namespace sha256_shani
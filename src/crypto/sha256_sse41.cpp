@@ -0,0 +1,20 @@
+// Copyright (c) 2015-2017 The LUX developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Built with SSE41_CXXFLAGS: four messages per pass, one per 32-bit xmm lane.
+
+#include "crypto/sha256_lanes.h"
+
+namespace sha256_lanes
+{
+void Hash4WaySSE41(const unsigned char* const in[4], size_t len, unsigned char* out)
+{
+    HashLanes<4>(in, len, out);
+}
+
+void D64_4WaySSE41(unsigned char* out, const unsigned char* in)
+{
+    HashD64Lanes<4>(out, in);
+}
+} // namespace sha256_lanes
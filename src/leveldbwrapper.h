@@ -31,8 +31,20 @@ class CLevelDBBatch
 
 private:
     leveldb::WriteBatch batch;
+    size_t nSizeEstimate;
 
 public:
+    CLevelDBBatch() : nSizeEstimate(0) {}
+
+    void Clear()
+    {
+        batch.Clear();
+        nSizeEstimate = 0;
+    }
+
+    //! Approximate number of bytes queued in this batch
+    size_t SizeEstimate() const { return nSizeEstimate; }
+
     template <typename K, typename V>
     void Write(const K& key, const V& value)
     {
@@ -47,6 +59,7 @@ public:
         leveldb::Slice slValue(&ssValue[0], ssValue.size());
 
         batch.Put(slKey, slValue);
+        nSizeEstimate += ssKey.size() + ssValue.size();
     }
 
     template <typename K>
@@ -58,6 +71,7 @@ public:
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
         batch.Delete(slKey);
+        nSizeEstimate += ssKey.size();
     }
 };
 
@@ -163,6 +177,18 @@ public:
         return WriteBatch(batch, true);
     }
 
+    //! Compact the key range [begin, end], reclaiming space left by erased entries
+    template <typename K>
+    void CompactRange(const K& keyBegin, const K& keyEnd) const
+    {
+        CDataStream ssKeyBegin(SER_DISK, CLIENT_VERSION), ssKeyEnd(SER_DISK, CLIENT_VERSION);
+        ssKeyBegin << keyBegin;
+        ssKeyEnd << keyEnd;
+        leveldb::Slice slKeyBegin(&ssKeyBegin[0], ssKeyBegin.size());
+        leveldb::Slice slKeyEnd(&ssKeyEnd[0], ssKeyEnd.size());
+        pdb->CompactRange(&slKeyBegin, &slKeyEnd);
+    }
+
     // not exactly clean encapsulation, but it's easiest for now
     leveldb::Iterator* NewIterator()
     {
@@ -9,9 +9,11 @@
 
 #include "addrman.h"
 #include "alert.h"
+#include "blockencodings.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
+#include "crypto/phi1612.h"
 #include "init.h"
 #include "stake.h"
 #include "masternode.h"
@@ -32,6 +34,7 @@
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 #if defined(DEBUG_DUMP_STAKING_INFO)
 #  include "DEBUG_DUMP_STAKING_INFO.hpp"
@@ -65,13 +68,21 @@ int64_t nTimeBestReceived = 0;
 CWaitableCriticalSection csBestBlock;
 CConditionVariable cvBlockChange;
 int nScriptCheckThreads = 0;
+int nCoinsFetchThreads = 0;
 bool fImporting = false;
 bool fReindex = false;
 bool fTxIndex = true;
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
-unsigned int nCoinCacheSize = 5000;
+uint256 hashAssumeValid;
+bool fHavePruned = false;
+bool fPruneMode = false;
+uint64_t nPruneTarget = 0;
+size_t nCoinCacheUsage = 5000 * 300;
 bool fAlerts = DEFAULT_ALERTS;
+uint64_t nPhi1612LastBlock = 0;
+uint64_t nPhi1612AcceptedTotal = 0;
+uint64_t nPhi1612AcceptedBlocks = 0;
 
 uint256 bnProofOfStakeLimit = (~uint256(0) >> 20);
 uint256 bnProofOfStakeLimitV2 = (~uint256(0) >> 34);
@@ -170,11 +181,26 @@ int nQueuedValidatedHeaders = 0;
 /** Number of preferable block download peers. */
 int nPreferredDownload = 0;
 
+/** Peers that push new blocks to us as cmpctblock, oldest first. Protected by cs_main. */
+static list<NodeId> lNodesAnnouncingHeaderAndIDs;
+
+/** Number of peers asked to push new blocks to us as cmpctblock (BIP 152 high-bandwidth mode). */
+static const unsigned int MAX_HB_CMPCTBLOCK_PEERS = 3;
+
 /** Dirty block index entries. */
 set<CBlockIndex*> setDirtyBlockIndex;
 
 /** Dirty block file entries. */
 set<int> setDirtyFileInfo;
+
+/** Global flag to indicate we should check to see if there are block/undo files that should be deleted. Set on startup or if we allocate more file space when we're in prune mode. */
+bool fCheckForPruning = false;
+
+/** Lowest active chain height that may be a BLOCK_SNAPSHOT block still to be fetched, or -1 once there are none. Protected by cs_main. */
+int nSnapshotFetchHeight = 1;
+
+/** Base block of the UTXO snapshot being loaded, or NULL. No blocks are connected meanwhile. Protected by cs_main. */
+CBlockIndex* pindexTxOutSetLoading = NULL;
 } // anon namespace
 
 //////////////////////////////////////////////////////////////////////////////
@@ -284,6 +310,9 @@ struct CNodeState {
     int nBlocksInFlight;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! Block being rebuilt from this peer's cmpctblock, waiting for its blocktxn.
+    boost::shared_ptr<PartiallyDownloadedBlock> partialBlock;
+    uint256 hashPartialBlock;
 
     CNodeState()
     {
@@ -297,6 +326,7 @@ struct CNodeState {
         nStallingSince = 0;
         nBlocksInFlight = 0;
         fPreferredDownload = false;
+        hashPartialBlock = uint256(0);
     }
 };
 
@@ -358,6 +388,7 @@ void FinalizeNode(NodeId nodeid)
         mapBlocksInFlight.erase(entry.hash);
     EraseOrphansFor(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
+    lNodesAnnouncingHeaderAndIDs.remove(nodeid);
 
     mapNodeState.erase(nodeid);
 }
@@ -392,6 +423,36 @@ void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, CBlockIndex* pindex
     mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
 }
 
+/**
+ * Ask a peer that just gave us a new tip to push its next blocks to us as
+ * cmpctblock, demoting the longest-standing such peer if there are already
+ * MAX_HB_CMPCTBLOCK_PEERS of them. Requires cs_main.
+ */
+void MaybeSetPeerAsAnnouncingHeaderAndIDs(CNode* pfrom)
+{
+    if (!pfrom->fProvidesHeaderAndIDs)
+        return;
+    NodeId nodeid = pfrom->GetId();
+    if (std::find(lNodesAnnouncingHeaderAndIDs.begin(), lNodesAnnouncingHeaderAndIDs.end(), nodeid) != lNodesAnnouncingHeaderAndIDs.end())
+        return;
+
+    bool fAnnounceUsingCMPCTBLOCK = false;
+    uint64_t nCMPCTBLOCKVersion = 1;
+    if (lNodesAnnouncingHeaderAndIDs.size() >= MAX_HB_CMPCTBLOCK_PEERS) {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes) {
+            if (pnode->GetId() == lNodesAnnouncingHeaderAndIDs.front()) {
+                pnode->PushMessage("sendcmpct", fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+                break;
+            }
+        }
+        lNodesAnnouncingHeaderAndIDs.pop_front();
+    }
+    fAnnounceUsingCMPCTBLOCK = true;
+    pfrom->PushMessage("sendcmpct", fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+    lNodesAnnouncingHeaderAndIDs.push_back(nodeid);
+}
+
 /** Check whether the last unknown block a peer advertized is not yet known. */
 void ProcessBlockAvailability(NodeId nodeid)
 {
@@ -447,6 +508,35 @@ CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb)
     return pa;
 }
 
+/** Add the not-in-flight blocks below a UTXO snapshot that were never received to vBlocks, oldest
+ *  first, until it has at most count entries. Proof-of-stake checks read the staked transactions
+ *  from them. */
+void FindSnapshotBlocksToDownload(CNodeState* state, unsigned int count, std::vector<CBlockIndex*>& vBlocks)
+{
+    // Skip what has arrived since the last call
+    while (nSnapshotFetchHeight >= 0 && nSnapshotFetchHeight <= chainActive.Height()) {
+        CBlockIndex* pindex = chainActive[nSnapshotFetchHeight];
+        if (!(pindex->nStatus & BLOCK_SNAPSHOT)) {
+            nSnapshotFetchHeight = -1;
+            return;
+        }
+        if (pindex->nTx == 0)
+            break;
+        nSnapshotFetchHeight++;
+    }
+    if (nSnapshotFetchHeight < 0)
+        return;
+
+    int nWindowEnd = std::min(nSnapshotFetchHeight + (int)BLOCK_DOWNLOAD_WINDOW, chainActive.Height() + 1);
+    for (int nHeight = nSnapshotFetchHeight; nHeight < nWindowEnd && vBlocks.size() < count; nHeight++) {
+        CBlockIndex* pindex = chainActive[nHeight];
+        if (!(pindex->nStatus & BLOCK_SNAPSHOT) || state->pindexBestKnownBlock->GetAncestor(nHeight) != pindex)
+            return;
+        if (pindex->nTx == 0 && mapBlocksInFlight.count(pindex->GetBlockHash()) == 0)
+            vBlocks.push_back(pindex);
+    }
+}
+
 /** Update pindexLastCommonBlock and add not-in-flight missing successors to vBlocks, until it has
  *  at most count entries. */
 void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller)
@@ -466,6 +556,10 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
         return;
     }
 
+    FindSnapshotBlocksToDownload(state, count, vBlocks);
+    if (vBlocks.size() == count)
+        return;
+
     if (state->pindexLastCommonBlock == NULL) {
         // Bootstrap quickly by guessing a parent of our best tip is the forking point.
         // Guessing wrong in either direction is not a problem.
@@ -506,7 +600,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
                 // We consider the chain that this peer is on invalid.
                 return;
             }
-            if (pindex->nStatus & BLOCK_HAVE_DATA) {
+            if (pindex->nStatus & BLOCK_HAVE_DATA || chainActive.Contains(pindex)) {
                 if (pindex->nChainTx)
                     state->pindexLastCommonBlock = pindex;
             } else if (mapBlocksInFlight.count(pindex->GetBlockHash()) == 0) {
@@ -582,6 +676,7 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache* pcoinsTip = NULL;
+CCoinsViewAsyncWriter* pcoinsWriter = NULL;
 CBlockTreeDB* pblocktree = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
@@ -847,11 +942,11 @@ int GetInputAge(CTxIn& vin)
         CCoinsViewMemPool viewMempool(pcoinsTip, mempool);
         view.SetBackend(viewMempool); // temporarily switch cache backend to db+mempool view
 
-        const CCoins* coins = view.AccessCoins(vin.prevout.hash);
+        const Coin& coin = view.AccessCoin(vin.prevout);
 
-        if (coins) {
-            if (coins->nHeight < 0) return 0;
-            return (chainActive.Tip()->nHeight + 1) - coins->nHeight;
+        if (!coin.IsSpent()) {
+            if (coin.nHeight == MEMPOOL_HEIGHT) return 0;
+            return (chainActive.Tip()->nHeight + 1) - coin.nHeight;
         } else
             return -1;
     }
@@ -1042,7 +1137,19 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 }
 
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
+void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age)
+{
+    int expired = pool.Expire(GetTime() - age);
+    if (expired != 0)
+        LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
+
+    std::vector<COutPoint> vNoSpendsRemaining;
+    pool.TrimToSize(limit, &vNoSpendsRemaining);
+    BOOST_FOREACH (const COutPoint& removed, vNoSpendsRemaining)
+        pcoinsTip->Uncache(removed);
+}
+
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees, bool fOverrideMempoolLimit)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1108,14 +1215,13 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
             view.SetBackend(viewMemPool);
 
             // do we already have it?
-            if (view.HaveCoins(hash))
+            COutPoint outpointExisting;
+            if (view.FindCoinByTxid(hash, 0, tx.vout.size(), outpointExisting))
                 return false;
 
             // do all inputs exist?
-            // Note that this does not check for the presence of actual outputs (see the next check for that),
-            // only helps filling in pfMissingInputs (to determine missing vs spent).
             BOOST_FOREACH (const CTxIn txin, tx.vin) {
-                if (!view.HaveCoins(txin.prevout.hash)) {
+                if (!view.HaveCoin(txin.prevout)) {
 #                   if defined(DEBUG_DUMP_STAKING_INFO)&&defined(DEBUG_DUMP_AcceptToMemoryPool)
                     DEBUG_DUMP_AcceptToMemoryPool();
 #                   endif
@@ -1125,11 +1231,6 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
                 }
             }
 
-            // are the actual inputs available?
-            if (!view.HaveInputs(tx))
-                return state.Invalid(error("AcceptToMemoryPool : inputs already spent"),
-                    REJECT_DUPLICATE, "bad-txns-inputs-spent");
-
             // Bring the best block into scope
             view.GetBestBlock();
 
@@ -1164,6 +1265,14 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
         // Don't accept it if it can't get into a block
         // but prioritise dstx and don't check fees for it
         if (!ignoreFees) {
+            CAmount nModifiedFees = nFees;
+            double nPriorityDummy = 0;
+            pool.ApplyDeltas(hash, nPriorityDummy, nModifiedFees);
+
+            CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+            if (mempoolRejectFee > 0 && nModifiedFees < mempoolRejectFee)
+                return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+
             CAmount txMinFee = GetMinRelayFee(tx, nSize, true);
             if (fLimitFree && nFees < txMinFee)
                 return state.DoS(0, error("AcceptToMemoryPool : not enough fees %s, %d < %d",
@@ -1223,8 +1332,29 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
             return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
         }
 
-        // Store transaction in memory
-        pool.addUnchecked(hash, entry);
+        // Calculate in-mempool ancestors, up to a limit.
+        CTxMemPool::setEntries setAncestors;
+        size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+        size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT) * 1000;
+        size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+        size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000;
+        std::string errString;
+        {
+            LOCK(pool.cs);
+            if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString))
+                return state.DoS(0, error("AcceptToMemoryPool : %s %s", hash.ToString(), errString),
+                    REJECT_NONSTANDARD, "too-long-mempool-chain");
+
+            // Store transaction in memory
+            pool.addUnchecked(hash, entry, setAncestors);
+        }
+
+        // trim mempool and check if tx was trimmed
+        if (!fOverrideMempoolLimit) {
+            LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+            if (!pool.exists(hash))
+                return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
+        }
     }
 
     SyncWithWallets(tx, NULL);
@@ -1295,25 +1425,19 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
             view.SetBackend(viewMemPool);
 
             // do we already have it?
-            if (view.HaveCoins(hash))
+            COutPoint outpointExisting;
+            if (view.FindCoinByTxid(hash, 0, tx.vout.size(), outpointExisting))
                 return false;
 
             // do all inputs exist?
-            // Note that this does not check for the presence of actual outputs (see the next check for that),
-            // only helps filling in pfMissingInputs (to determine missing vs spent).
             BOOST_FOREACH (const CTxIn txin, tx.vin) {
-                if (!view.HaveCoins(txin.prevout.hash)) {
+                if (!view.HaveCoin(txin.prevout)) {
                     if (pfMissingInputs)
                         *pfMissingInputs = true;
                     return false;
                 }
             }
 
-            // are the actual inputs available?
-            if (!view.HaveInputs(tx))
-                return state.Invalid(error("AcceptableInputs : inputs already spent"),
-                    REJECT_DUPLICATE, "bad-txns-inputs-spent");
-
             // Bring the best block into scope
             view.GetBestBlock();
 
@@ -1459,10 +1583,9 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock
         if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
             int nHeight = -1;
             {
-                CCoinsViewCache& view = *pcoinsTip;
-                const CCoins* coins = view.AccessCoins(hash);
-                if (coins)
-                    nHeight = coins->nHeight;
+                const Coin& coin = AccessByTxid(*pcoinsTip, hash);
+                if (!coin.IsSpent())
+                    nHeight = coin.nHeight;
             }
             if (nHeight > 0)
                 pindexSlow = chainActive[nHeight];
@@ -1485,6 +1608,33 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock
     return false;
 }
 
+bool GetTransactionTime(const uint256& hash, int nHeight, unsigned int& nTime)
+{
+    CTransaction tx;
+    uint256 hashBlock;
+    if (GetTransaction(hash, tx, hashBlock, false)) {
+        nTime = tx.nTime;
+        return true;
+    }
+
+    // Not through the coin database: this serves its upgrade and undo data
+    CBlockIndex* pindex = NULL;
+    {
+        LOCK(cs_main);
+        pindex = chainActive[nHeight];
+    }
+    CBlock block;
+    if (!pindex || !ReadBlockFromDisk(block, pindex))
+        return false;
+    BOOST_FOREACH (const CTransaction& txBlock, block.vtx) {
+        if (txBlock.GetHash() == hash) {
+            nTime = txBlock.nTime;
+            return true;
+        }
+    }
+    return false;
+}
+
 
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -1513,18 +1663,114 @@ bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos)
     return true;
 }
 
+/**
+ * Read-only mappings of finalized blk and rev files, least recently used
+ * unmapped first beyond MAX_MAPPED_BLOCK_FILES. Reading a block from a
+ * mapping deserializes straight from the page cache, without an
+ * open/seek/read round trip per block. The file currently appended to is
+ * never mapped, as it may still be truncated by FlushBlockFile.
+ */
+class CBlockFileMaps
+{
+private:
+    typedef std::pair<std::string, int> Key;
+    typedef std::pair<Key, boost::shared_ptr<const CMappedFile> > Entry;
+
+    CCriticalSection cs;
+    std::list<Entry> listMaps;
+
+public:
+    /** Mapping of the file holding pos, or NULL if it is not (or cannot be) mapped. */
+    boost::shared_ptr<const CMappedFile> Get(const CDiskBlockPos& pos, const char* prefix)
+    {
+        boost::shared_ptr<const CMappedFile> mapped;
+        // Whole-file mappings would exhaust a 32-bit address space
+        if (sizeof(void*) < 8 || pos.IsNull())
+            return mapped;
+        {
+            LOCK(cs_LastBlockFile);
+            if (pos.nFile >= nLastBlockFile)
+                return mapped;
+        }
+
+        Key key(prefix, pos.nFile);
+        LOCK(cs);
+        for (std::list<Entry>::iterator it = listMaps.begin(); it != listMaps.end(); ++it) {
+            if (it->first == key) {
+                listMaps.splice(listMaps.begin(), listMaps, it);
+                return it->second;
+            }
+        }
+        boost::shared_ptr<const CMappedFile> mappedNew(new CMappedFile(GetBlockPosFilename(pos, prefix)));
+        if (mappedNew->IsNull())
+            return mapped;
+        listMaps.push_front(Entry(key, mappedNew));
+        if (listMaps.size() > MAX_MAPPED_BLOCK_FILES)
+            listMaps.pop_back();
+        return mappedNew;
+    }
+
+    /** Forget the mappings of a file number; readers still using them keep them alive. */
+    void Erase(int nFile)
+    {
+        LOCK(cs);
+        for (std::list<Entry>::iterator it = listMaps.begin(); it != listMaps.end();) {
+            if (it->first.second == nFile)
+                it = listMaps.erase(it);
+            else
+                ++it;
+        }
+    }
+};
+
+static CBlockFileMaps blockFileMaps;
+
+/**
+ * Locate the record stored at pos (the data written after its message start
+ * and size, followed by nTrailer more bytes) in a mapped file. Returns false
+ * if the file is not mapped or the record is not entirely inside the mapping,
+ * in which case the caller reads it through the FILE* path instead.
+ */
+static bool GetMappedRecord(const CDiskBlockPos& pos, const char* prefix, unsigned int nTrailer,
+    boost::shared_ptr<const CMappedFile>& mapped, const char*& pbegin, const char*& pend)
+{
+    static const unsigned int nHeaderSize = MESSAGE_START_SIZE + sizeof(unsigned int);
+    if (pos.nPos < nHeaderSize)
+        return false;
+    mapped = blockFileMaps.Get(pos, prefix);
+    if (!mapped || pos.nPos > mapped->size())
+        return false;
+
+    const char* pheader = mapped->begin() + pos.nPos - nHeaderSize;
+    if (memcmp(pheader, Params().MessageStart(), MESSAGE_START_SIZE))
+        return false;
+    unsigned int nSize;
+    memcpy(&nSize, pheader + MESSAGE_START_SIZE, sizeof(nSize));
+    if ((uint64_t)pos.nPos + nSize + nTrailer > mapped->size())
+        return false;
+
+    pbegin = mapped->begin() + pos.nPos;
+    pend = pbegin + nSize;
+    return true;
+}
+
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
 {
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("ReadBlockFromDisk : OpenBlockFile failed");
-
-    // Read block
+    // Read block, from a mapping of the history file if there is one
     try {
-        filein >> block;
+        boost::shared_ptr<const CMappedFile> mapped;
+        const char *pbegin, *pend;
+        if (GetMappedRecord(pos, "blk", 0, mapped, pbegin, pend)) {
+            CBufferReader filein(pbegin, pend, SER_DISK, CLIENT_VERSION);
+            filein >> block;
+        } else {
+            CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+            if (filein.IsNull())
+                return error("ReadBlockFromDisk : OpenBlockFile failed");
+            filein >> block;
+        }
     } catch (std::exception& e) {
         return error("%s : Deserialize or I/O error - %s", __func__, e.what());
     }
@@ -1540,6 +1786,41 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
     return true;
 }
 
+bool ReadRawBlockFromDisk(CDataStream& block, const CDiskBlockPos& pos)
+{
+    boost::shared_ptr<const CMappedFile> mapped;
+    const char *pbegin, *pend;
+    if (GetMappedRecord(pos, "blk", 0, mapped, pbegin, pend)) {
+        block.clear();
+        block.write(pbegin, pend - pbegin);
+        return true;
+    }
+
+    // The block is preceded by the message start and its size, see WriteBlockToDisk.
+    CDiskBlockPos posHeader = pos;
+    posHeader.nPos -= MESSAGE_START_SIZE + sizeof(unsigned int);
+    CAutoFile filein(OpenBlockFile(posHeader, true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("ReadRawBlockFromDisk : OpenBlockFile failed");
+
+    try {
+        MessageStartChars pchMessageStart;
+        unsigned int nSize;
+        filein >> FLATDATA(pchMessageStart) >> nSize;
+        if (memcmp(pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE))
+            return error("%s : Block magic mismatch in file %d at %u", __func__, pos.nFile, pos.nPos);
+        if (nSize > MAX_SIZE)
+            return error("%s : Block size %u in file %d at %u is too large", __func__, nSize, pos.nFile, pos.nPos);
+        block.resize(nSize);
+        if (nSize)
+            filein.read(&block[0], nSize);
+    } catch (std::exception& e) {
+        return error("%s : I/O error - %s", __func__, e.what());
+    }
+
+    return true;
+}
+
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
 {
     if (!ReadBlockFromDisk(block, pindex->GetBlockPos()))
@@ -1782,26 +2063,26 @@ void UpdateCoins(const CTransaction& tx, CValidationState& state, CCoinsViewCach
     if (!tx.IsCoinBase()) {
         txundo.vprevout.reserve(tx.vin.size());
         BOOST_FOREACH (const CTxIn& txin, tx.vin) {
-            txundo.vprevout.push_back(CTxInUndo());
-            bool ret = inputs.ModifyCoins(txin.prevout.hash)->Spend(txin.prevout, txundo.vprevout.back());
+            txundo.vprevout.push_back(Coin());
+            bool ret = inputs.SpendCoin(txin.prevout, &txundo.vprevout.back());
             assert(ret);
         }
     }
 
     // add outputs
-    inputs.ModifyCoins(tx.GetHash())->FromTx(tx, nHeight);
+    AddCoins(inputs, tx, nHeight);
 }
 
 bool CScriptCheck::operator()()
 {
     const CScript& scriptSig = ptxTo->vin[nIn].scriptSig;
-    if (!VerifyScript(scriptSig, scriptPubKey, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, cacheStore), &error)) {
+    if (!VerifyScript(scriptSig, scriptPubKey, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, cacheStore, txdata), &error)) {
         return ::error("CScriptCheck(): %s:%d VerifySignature failed: %s", ptxTo->GetHash().ToString(), nIn, ScriptErrorString(error));
     }
     return true;
 }
 
-bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, std::vector<CScriptCheck>* pvChecks)
+bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, std::vector<CScriptCheck>* pvChecks, const PrecomputedTransactionData* txdata)
 {
     if (!tx.IsCoinBase()) {
         if (pvChecks)
@@ -1834,20 +2115,20 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
         CAmount nFees = 0;
         for (unsigned int i = 0; i < tx.vin.size(); i++) {
             const COutPoint& prevout = tx.vin[i].prevout;
-            const CCoins* coins = inputs.AccessCoins(prevout.hash);
-            assert(coins);
+            const Coin& coin = inputs.AccessCoin(prevout);
+            assert(!coin.IsSpent());
 
             // If prev is coinbase, check that it's matured
-            if (coins->IsCoinBase() || coins->IsCoinStake()) {
-                if (nSpendHeight - coins->nHeight < Params().COINBASE_MATURITY())
+            if (coin.IsCoinBase() || coin.IsCoinStake()) {
+                if (nSpendHeight - (int)coin.nHeight < Params().COINBASE_MATURITY())
                     return state.Invalid(
-                        error("CheckInputs() : tried to spend coinbase at depth %d, coinstake=%d", nSpendHeight - coins->nHeight, coins->IsCoinStake()),
+                        error("CheckInputs() : tried to spend coinbase at depth %d, coinstake=%d", nSpendHeight - (int)coin.nHeight, coin.IsCoinStake()),
                         REJECT_INVALID, "bad-txns-premature-spend-of-coinbase");
             }
 
             // Check for negative or overflow input values
-            nValueIn += coins->vout[prevout.n].nValue;
-            if (!MoneyRange(coins->vout[prevout.n].nValue) || !MoneyRange(nValueIn))
+            nValueIn += coin.out.nValue;
+            if (!MoneyRange(coin.out.nValue) || !MoneyRange(nValueIn))
                 return state.DoS(100, error("CheckInputs() : txin values out of range"),
                     REJECT_INVALID, "bad-txns-inputvalues-outofrange");
         }
@@ -1876,13 +2157,20 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
         // before the last block chain checkpoint. This is safe because block merkle hashes are
         // still computed and checked, and any change will be caught at the next checkpoint.
         if (fScriptChecks) {
+            // Inline checks share a precomputation local to this call; queued
+            // ones can only use the caller's.
+            PrecomputedTransactionData txdataLocal;
+            if (!txdata && !pvChecks) {
+                txdataLocal = PrecomputedTransactionData(tx);
+                txdata = &txdataLocal;
+            }
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint& prevout = tx.vin[i].prevout;
-                const CCoins* coins = inputs.AccessCoins(prevout.hash);
-                assert(coins);
+                const Coin& coin = inputs.AccessCoin(prevout);
+                assert(!coin.IsSpent());
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore);
+                CScriptCheck check(coin.out.scriptPubKey, tx, i, flags, cacheStore, txdata);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -1894,8 +2182,8 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
                         // arguments; if so, don't trigger DoS protection to
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
-                        CScriptCheck check(*coins, tx, i,
-                            flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore);
+                        CScriptCheck check(coin.out.scriptPubKey, tx, i,
+                            flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore, txdata);
                         if (check())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
                     }
@@ -1915,9 +2203,44 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
     return true;
 }
 
+/**
+ * Restore a spent output from its undo record. Clears fClean when the output
+ * unexpectedly exists already; returns false if the record lacks metadata
+ * that cannot be recovered from the view.
+ */
+static bool ApplyTxInUndo(Coin& undo, CCoinsViewCache& view, const COutPoint& out, bool& fClean)
+{
+    bool fOverwrite = view.HaveCoin(out);
+    if (fOverwrite)
+        fClean = fClean && error("DisconnectBlock() : undo data overwriting existing output");
+
+    if (undo.nHeight == 0) {
+        // Undo records written by the per-transaction chainstate only carry
+        // height and coinbase/coinstake flags for the last spent output of a
+        // transaction; the metadata is then available from a sibling output
+        // restored earlier.
+        const Coin& alternate = AccessByTxid(view, out.hash);
+        if (alternate.IsSpent())
+            return false;
+        undo.nHeight = alternate.nHeight;
+        undo.fCoinBase = alternate.fCoinBase;
+        undo.fCoinStake = alternate.fCoinStake;
+        undo.nTime = alternate.nTime;
+    }
+    if (undo.nTime == 0) {
+        // Nor do they carry the transaction time, which is read back from
+        // the transaction
+        if (!GetTransactionTime(out.hash, undo.nHeight, undo.nTime))
+            return false;
+    }
+    view.AddCoin(out, undo, fOverwrite);
+    return true;
+}
+
 bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
 {
     assert(pindex->GetBlockHash() == view.GetBestBlock());
+    CCoinsRunningStats* pstats = view.RunningStats();
 
     if (pfClean)
         *pfClean = false;
@@ -1940,53 +2263,29 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
         uint256 hash = tx.GetHash();
 
         // Check that all outputs are available and match the outputs in the block itself
-        // exactly. Note that transactions with only provably unspendable outputs won't
-        // have outputs available even in the block itself, so we handle that case
-        // specially with outsEmpty.
-        {
-            CCoins outsEmpty;
-            CCoinsModifier outs = view.ModifyCoins(hash);
-            outs->ClearUnspendable();
-
-            CCoins outsBlock(tx, pindex->nHeight);
-            // The CCoins serialization does not serialize negative numbers.
-            // No network rules currently depend on the version here, so an inconsistency is harmless
-            // but it must be corrected before txout nversion ever influences a network rule.
-            if (outsBlock.nVersion < 0)
-                outs->nVersion = outsBlock.nVersion;
-            if (*outs != outsBlock)
+        // exactly. Provably unspendable outputs were never added to the view.
+        for (unsigned int o = 0; o < tx.vout.size(); o++) {
+            if (tx.vout[o].scriptPubKey.IsUnspendable())
+                continue;
+            Coin coin;
+            bool fSpent = view.SpendCoin(COutPoint(hash, o), &coin);
+            if (fSpent && pstats)
+                pstats->RemoveCoin(COutPoint(hash, o), coin);
+            if (!fSpent || tx.vout[o].nValue != coin.out.nValue || tx.vout[o].scriptPubKey != coin.out.scriptPubKey ||
+                (int)coin.nHeight != pindex->nHeight || coin.fCoinBase != tx.IsCoinBase() || coin.fCoinStake != tx.IsCoinStake() || coin.nTime != tx.nTime)
                 fClean = fClean && error("DisconnectBlock() : added transaction mismatch? database corrupted");
-
-            // remove outputs
-            outs->Clear();
         }
 
         // restore inputs
         if (i > 0) { // not coinbases
-            const CTxUndo& txundo = blockUndo.vtxundo[i - 1];
+            CTxUndo& txundo = blockUndo.vtxundo[i - 1];
             if (txundo.vprevout.size() != tx.vin.size())
                 return error("DisconnectBlock() : transaction and undo data inconsistent - txundo.vprevout.siz=%d tx.vin.siz=%d", txundo.vprevout.size(), tx.vin.size());
             for (unsigned int j = tx.vin.size(); j-- > 0;) {
-                const COutPoint& out = tx.vin[j].prevout;
-                const CTxInUndo& undo = txundo.vprevout[j];
-                CCoinsModifier coins = view.ModifyCoins(out.hash);
-                if (undo.nHeight != 0) {
-                    // undo data contains height: this is the last output of the prevout tx being spent
-                    if (!coins->IsPruned())
-                        fClean = fClean && error("DisconnectBlock() : undo data overwriting existing transaction");
-                    coins->Clear();
-                    coins->fCoinBase = undo.fCoinBase;
-                    coins->nHeight = undo.nHeight;
-                    coins->nVersion = undo.nVersion;
-                } else {
-                    if (coins->IsPruned())
-                        fClean = fClean && error("DisconnectBlock() : undo data adding output to missing transaction");
-                }
-                if (coins->IsAvailable(out.n))
-                    fClean = fClean && error("DisconnectBlock() : undo data overwriting existing output");
-                if (coins->vout.size() < out.n + 1)
-                    coins->vout.resize(out.n + 1);
-                coins->vout[out.n] = undo.txout;
+                if (!ApplyTxInUndo(txundo.vprevout[j], view, tx.vin[j].prevout, fClean))
+                    return error("DisconnectBlock() : undo data for %s:%u has no metadata", tx.vin[j].prevout.hash.ToString(), tx.vin[j].prevout.n);
+                if (pstats)
+                    pstats->AddCoin(tx.vin[j].prevout, txundo.vprevout[j]);
             }
         }
     }
@@ -2035,6 +2334,93 @@ void ThreadScriptCheck()
     scriptcheckqueue.Thread();
 }
 
+/** Reads one block input from the backing coin view for PrefetchInputs(). */
+class CCoinsFetch
+{
+private:
+    const CCoinsView* view;
+    const COutPoint* outpoint;
+    Coin* coin;
+
+public:
+    CCoinsFetch() : view(NULL), outpoint(NULL), coin(NULL) {}
+    CCoinsFetch(const CCoinsView* viewIn, const COutPoint* outpointIn, Coin* coinIn) : view(viewIn), outpoint(outpointIn), coin(coinIn) {}
+
+    bool operator()()
+    {
+        if (!view->GetCoin(*outpoint, *coin))
+            coin->Clear();
+        return true;
+    }
+
+    void swap(CCoinsFetch& check)
+    {
+        std::swap(view, check.view);
+        std::swap(outpoint, check.outpoint);
+        std::swap(coin, check.coin);
+    }
+};
+
+static CCheckQueue<CCoinsFetch> coinsfetchqueue(16);
+
+void ThreadCoinsFetch()
+{
+    RenameThread("lux-coinsfetch");
+    coinsfetchqueue.Thread();
+}
+
+/**
+ * Warm cache with the inputs of block before it is connected. The reads go
+ * to the view backing cache, which must allow concurrent readers, and are
+ * spread over the fetch threads so disk latency overlaps. The cache itself
+ * is not thread safe and is only filled once all reads are done.
+ */
+static void PrefetchInputs(const CBlock& block, CCoinsViewCache& cache)
+{
+    if (!nCoinsFetchThreads)
+        return;
+
+    int64_t nTimeStart = GetTimeMicros();
+    // Outputs created by the block itself are never in the coin database.
+    std::set<uint256> setBlockTxids;
+    BOOST_FOREACH (const CTransaction& tx, block.vtx)
+        setBlockTxids.insert(tx.GetHash());
+
+    std::vector<COutPoint> vOutpoints;
+    std::set<COutPoint> setQueued;
+    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+        if (tx.IsCoinBase())
+            continue;
+        BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+            if (setBlockTxids.count(txin.prevout.hash) || cache.HaveCoinInCache(txin.prevout))
+                continue;
+            if (setQueued.insert(txin.prevout).second)
+                vOutpoints.push_back(txin.prevout);
+        }
+    }
+    // A single read is not worth handing to another thread.
+    if (vOutpoints.size() < 2)
+        return;
+
+    std::vector<Coin> vCoins(vOutpoints.size());
+    std::vector<CCoinsFetch> vFetches;
+    vFetches.reserve(vOutpoints.size());
+    for (unsigned int i = 0; i < vOutpoints.size(); i++)
+        vFetches.push_back(CCoinsFetch(cache.GetBackend(), &vOutpoints[i], &vCoins[i]));
+    CCheckQueueControl<CCoinsFetch> control(&coinsfetchqueue);
+    control.Add(vFetches);
+    control.Wait();
+
+    unsigned int nFound = 0;
+    for (unsigned int i = 0; i < vOutpoints.size(); i++) {
+        if (vCoins[i].IsSpent())
+            continue;
+        cache.PrefetchCoin(vOutpoints[i], vCoins[i]);
+        nFound++;
+    }
+    LogPrint("bench", "    - Prefetch inputs: %u of %u found in %.2fms\n", nFound, (unsigned int)vOutpoints.size(), (GetTimeMicros() - nTimeStart) * 0.001);
+}
+
 static bool IsBlockValueValid(const CBlock& block, int64_t nExpectedValue)
 {
     CBlockIndex* pindexPrev = chainActive.Tip();
@@ -2062,6 +2448,25 @@ static int64_t nTimeIndex = 0;
 static int64_t nTimeCallbacks = 0;
 static int64_t nTimeTotal = 0;
 
+/** Apply the outputs a connected block spent and created to the running UTXO set totals. */
+static void UpdateRunningStats(CCoinsRunningStats& stats, const CBlock& block, const CBlockUndo& blockundo, int nHeight)
+{
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        const CTransaction& tx = block.vtx[i];
+        if (i > 0) {
+            const CTxUndo& txundo = blockundo.vtxundo[i - 1];
+            for (unsigned int j = 0; j < tx.vin.size(); j++)
+                stats.RemoveCoin(tx.vin[j].prevout, txundo.vprevout[j]);
+        }
+        // Provably unspendable outputs were never added to the view
+        const uint256& hash = tx.GetHash();
+        for (unsigned int o = 0; o < tx.vout.size(); o++) {
+            if (!tx.vout[o].scriptPubKey.IsUnspendable())
+                stats.AddCoin(COutPoint(hash, o), Coin(tx.vout[o], nHeight, tx.IsCoinBase(), tx.IsCoinStake(), tx.nTime));
+        }
+    }
+}
+
 bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck)
 {
     const CChainParams& chainParams = Params();
@@ -2099,6 +2504,15 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             REJECT_INVALID, "PoW-ended");
 
     bool fScriptChecks = pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate(chainParams.Checkpoints());
+    if (fScriptChecks && hashAssumeValid != 0 && pindexBestHeader) {
+        // Only the scripts are assumed valid: every other check still runs.
+        // The assumed block must be in our best header chain, so a peer
+        // cannot get scripts skipped on a chain we would not follow anyway.
+        BlockMap::const_iterator it = mapBlockIndex.find(hashAssumeValid);
+        if (it != mapBlockIndex.end() && it->second->GetAncestor(pindex->nHeight) == pindex &&
+            pindexBestHeader->GetAncestor(it->second->nHeight) == it->second)
+            fScriptChecks = false;
+    }
 
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
     // unless those are already completely spent.
@@ -2117,10 +2531,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                              (pindex->nHeight == 91880 && pindex->GetBlockHash() == uint256("0x00000000000743f190a18c5577a3c2d2a1f610ae9601ac046a38084ccb7cd721")));
     if (fEnforceBIP30) {
         BOOST_FOREACH (const CTransaction& tx, block.vtx) {
-            const CCoins* coins = view.AccessCoins(tx.GetHash());
-            if (coins && !coins->IsPruned())
-                return state.DoS(100, error("%s: tried to overwrite transaction", __func__),
-                    REJECT_INVALID, "bad-txns-BIP30");
+            for (unsigned int o = 0; o < tx.vout.size(); o++) {
+                if (view.HaveCoin(COutPoint(tx.GetHash(), o)))
+                    return state.DoS(100, error("%s: tried to overwrite transaction", __func__),
+                        REJECT_INVALID, "bad-txns-BIP30");
+            }
         }
     }
 
@@ -2137,6 +2552,10 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     CBlockUndo blockundo;
 
+    // Shared by the queued script checks of each transaction: declared before
+    // control, whose destructor waits for them, and never reallocated.
+    std::vector<PrecomputedTransactionData> vTxData;
+    vTxData.reserve(block.vtx.size());
     CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
 
     int64_t nTimeStart = GetTimeMicros();
@@ -2183,8 +2602,13 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                 nFees += view.GetValueIn(tx) - tx.GetValueOut();
             }
 
+            const PrecomputedTransactionData* txdata = NULL;
+            if (fScriptChecks) {
+                vTxData.push_back(PrecomputedTransactionData(tx));
+                txdata = &vTxData.back();
+            }
             std::vector<CScriptCheck> vChecks;
-            if (!CheckInputs(tx, state, view, fScriptChecks, flags, false, nScriptCheckThreads ? &vChecks : NULL))
+            if (!CheckInputs(tx, state, view, fScriptChecks, flags, false, nScriptCheckThreads ? &vChecks : NULL, txdata))
                 return false;
             control.Add(vChecks);
         }
@@ -2262,6 +2686,10 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         if (!pblocktree->WriteTxIndex(vPos))
             return state.Abort("Failed to write transaction index");
 
+    CCoinsRunningStats* pstats = view.RunningStats();
+    if (pstats)
+        UpdateRunningStats(*pstats, block, blockundo, pindex->nHeight);
+
     // add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
 
@@ -2281,6 +2709,105 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     return true;
 }
 
+uint64_t CalculateCurrentUsage()
+{
+    LOCK(cs_LastBlockFile);
+
+    uint64_t retval = 0;
+    BOOST_FOREACH (const CBlockFileInfo& file, vinfoBlockFile) {
+        retval += file.nSize + file.nUndoSize;
+    }
+    return retval;
+}
+
+/** Prune a block file (modify associated database entries) */
+static void PruneOneBlockFile(const int fileNumber)
+{
+    for (BlockMap::iterator it = mapBlockIndex.begin(); it != mapBlockIndex.end(); ++it) {
+        CBlockIndex* pindex = it->second;
+        if (pindex->nFile == fileNumber) {
+            pindex->nStatus &= ~BLOCK_HAVE_DATA;
+            pindex->nStatus &= ~BLOCK_HAVE_UNDO;
+            pindex->nFile = 0;
+            pindex->nDataPos = 0;
+            pindex->nUndoPos = 0;
+            setDirtyBlockIndex.insert(pindex);
+
+            // Prune from mapBlocksUnlinked -- any block we prune would have
+            // to be downloaded again in order to consider its chain, at which
+            // point it would be considered as a candidate for
+            // mapBlocksUnlinked or setBlockIndexCandidates.
+            std::pair<std::multimap<CBlockIndex*, CBlockIndex*>::iterator, std::multimap<CBlockIndex*, CBlockIndex*>::iterator> range = mapBlocksUnlinked.equal_range(pindex->pprev);
+            while (range.first != range.second) {
+                std::multimap<CBlockIndex*, CBlockIndex*>::iterator itUnlinked = range.first;
+                range.first++;
+                if (itUnlinked->second == pindex)
+                    mapBlocksUnlinked.erase(itUnlinked);
+            }
+        }
+    }
+
+    vinfoBlockFile[fileNumber].SetNull();
+    setDirtyFileInfo.insert(fileNumber);
+}
+
+/**
+ * Calculate the block/rev files that should be deleted to remain under target.
+ * Block files are deleted once all their blocks are MIN_BLOCKS_TO_KEEP below
+ * the tip. The stake kernel check takes what it needs of a staked output
+ * (its txout and transaction time) from the chain state, not from the file.
+ */
+static void FindFilesToPrune(std::set<int>& setFilesToPrune)
+{
+    LOCK2(cs_main, cs_LastBlockFile);
+    if (chainActive.Tip() == NULL || nPruneTarget == 0)
+        return;
+    if (chainActive.Tip()->nHeight <= (int)MIN_BLOCKS_TO_KEEP)
+        return;
+
+    unsigned int nLastBlockWeCanPrune = chainActive.Tip()->nHeight - MIN_BLOCKS_TO_KEEP;
+    uint64_t nCurrentUsage = CalculateCurrentUsage();
+    // We don't check to prune until after we've allocated new space for files,
+    // so we should leave a buffer under our target to account for another allocation
+    // before the next pruning.
+    uint64_t nBuffer = BLOCKFILE_CHUNK_SIZE + UNDOFILE_CHUNK_SIZE;
+    if (nCurrentUsage + nBuffer < nPruneTarget)
+        return;
+
+    for (int fileNumber = 0; fileNumber < nLastBlockFile; fileNumber++) {
+        if (nCurrentUsage + nBuffer < nPruneTarget)
+            break;
+        if (vinfoBlockFile[fileNumber].nSize == 0)
+            continue;
+        // don't prune files that could have a block within MIN_BLOCKS_TO_KEEP of the main chain's tip
+        if (vinfoBlockFile[fileNumber].nHeightLast > nLastBlockWeCanPrune)
+            continue;
+
+        uint64_t nBytesToPrune = vinfoBlockFile[fileNumber].nSize + vinfoBlockFile[fileNumber].nUndoSize;
+        PruneOneBlockFile(fileNumber);
+        // Queue up the files for removal
+        setFilesToPrune.insert(fileNumber);
+        nCurrentUsage -= nBytesToPrune;
+    }
+
+    LogPrint("prune", "Prune: target=%dMiB actual=%dMiB diff=%dMiB max_prune_height=%d removed %d blk/rev pairs\n",
+        nPruneTarget / 1024 / 1024, nCurrentUsage / 1024 / 1024,
+        ((int64_t)nPruneTarget - (int64_t)nCurrentUsage) / 1024 / 1024,
+        nLastBlockWeCanPrune, setFilesToPrune.size());
+}
+
+/** Actually unlink the specified files */
+static void UnlinkPrunedFiles(const std::set<int>& setFilesToPrune)
+{
+    for (std::set<int>::const_iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
+        CDiskBlockPos pos(*it, 0);
+        blockFileMaps.Erase(*it);
+        boost::filesystem::remove(GetBlockPosFilename(pos, "blk"));
+        boost::filesystem::remove(GetBlockPosFilename(pos, "rev"));
+        LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
+    }
+}
+
 enum FlushStateMode {
     FLUSH_STATE_IF_NEEDED,
     FLUSH_STATE_PERIODIC,
@@ -2303,15 +2830,34 @@ static bool FlushStateToDisk(CValidationState& state, FlushStateMode mode)
     {
 		bool isExceptionOccured = false;
 		try {
-		    if ((mode == FLUSH_STATE_ALWAYS) ||
-		        ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && pcoinsTip->GetCacheSize() > nCoinCacheSize) ||
-		        (mode == FLUSH_STATE_PERIODIC && GetTimeMicros() > nLastWrite + DATABASE_WRITE_INTERVAL * 1000000)) {
-		        // Typical CCoins structures on disk are around 100 bytes in size.
+		    std::set<int> setFilesToPrune;
+		    bool fFlushForPrune = false;
+		    if (fPruneMode && fCheckForPruning && !fReindex) {
+		        FindFilesToPrune(setFilesToPrune);
+		        fCheckForPruning = false;
+		        if (!setFilesToPrune.empty()) {
+		            fFlushForPrune = true;
+		            if (!fHavePruned) {
+		                pblocktree->WriteFlag("prunedblockfiles", true);
+		                fHavePruned = true;
+		            }
+		        }
+		    }
+		    int64_t nNow = GetTimeMicros();
+		    size_t cacheSize = pcoinsTip->DynamicMemoryUsage();
+		    // The cache is large and close to the limit, but we have time now (not in the middle of a block processing).
+		    bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize * (10.0 / 9) > nCoinCacheUsage;
+		    // The cache is over the limit, we have to write now.
+		    bool fCacheCritical = mode == FLUSH_STATE_IF_NEEDED && cacheSize > nCoinCacheUsage;
+		    // It's been a while since we wrote the block index to disk. Do this frequently, so we don't need to redownload after a crash.
+		    bool fPeriodicWrite = mode == FLUSH_STATE_PERIODIC && nNow > nLastWrite + (int64_t)DATABASE_WRITE_INTERVAL * 1000000;
+		    if (mode == FLUSH_STATE_ALWAYS || fCacheLarge || fCacheCritical || fPeriodicWrite || fFlushForPrune) {
+		        // Typical Coin structures on disk are around 50 bytes in size.
 		        // Pushing a new one to the database can cause it to be written
 		        // twice (once in the log, and once in the tables). This is already
 		        // an overestimation, as most will delete an existing entry or
 		        // overwrite one. Still, use a conservative safety factor of 2.
-		        if (!CheckDiskSpace(100 * 2 * 2 * pcoinsTip->GetCacheSize()))
+		        if (!CheckDiskSpace(50 * 2 * 2 * pcoinsTip->GetCacheSize()))
 		            return state.Error("out of disk space");
 		        // First make sure all block and undo data is flushed to disk.
 		        FlushBlockFile();
@@ -2334,9 +2880,19 @@ static bool FlushStateToDisk(CValidationState& state, FlushStateMode mode)
 		            setDirtyBlockIndex.erase(it++);
 		        }
 		        pblocktree->Sync();
-		        // Finally flush the chainstate (which may refer to block index entries).
+		        // Then flush the chainstate (which may refer to block index entries).
+		        // With -asyncflush this only queues the coins for the background
+		        // writer, which stores them together with their best block marker.
 		        if (!pcoinsTip->Flush())
 		            return state.Abort("Failed to write to coin database");
+		        // Pruning has to wait for the coins to be on disk too: a crash
+		        // before then would need the deleted blocks to replay the tip.
+		        if ((mode == FLUSH_STATE_ALWAYS || fFlushForPrune) && pcoinsWriter && !pcoinsWriter->Sync())
+		            return state.Abort("Failed to write to coin database");
+		        // Neither the block index nor the chainstate needs them now, so
+		        // pruned files can go.
+		        if (fFlushForPrune)
+		            UnlinkPrunedFiles(setFilesToPrune);
 		        // Update best block in wallet (so we can detect restored wallets).
 		        if (mode != FLUSH_STATE_IF_NEEDED) {
 		            g_signals.SetBestChain(chainActive.GetLocator());
@@ -2366,6 +2922,13 @@ void FlushStateToDisk()
     FlushStateToDisk(state, FLUSH_STATE_ALWAYS);
 }
 
+void PruneAndFlush()
+{
+    CValidationState state;
+    fCheckForPruning = true;
+    FlushStateToDisk(state, FLUSH_STATE_ALWAYS);
+}
+
 /** Update chainActive and related internal data structures. */
 void static UpdateTip(CBlockIndex* pindexNew)
 {
@@ -2376,10 +2939,10 @@ void static UpdateTip(CBlockIndex* pindexNew)
     nTimeBestReceived = GetTime();
     mempool.AddTransactionsUpdated(1);
 
-    LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%u\n",
+    LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%.1fMiB(%utxo)\n",
         chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(), log(chainActive.Tip()->nChainWork.getdouble()) / log(2.0), (unsigned long)chainActive.Tip()->nChainTx,
         DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
-        Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), chainActive.Tip()), (unsigned int)pcoinsTip->GetCacheSize());
+        Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), chainActive.Tip()), pcoinsTip->DynamicMemoryUsage() * (1.0 / (1 << 20)), pcoinsTip->GetCacheSize());
 
     cvBlockChange.notify_all();
 
@@ -2427,14 +2990,25 @@ bool static DisconnectTip(CValidationState& state)
     if (!FlushStateToDisk(state, FLUSH_STATE_ALWAYS))
         return false;
     // Resurrect mempool transactions from the disconnected block.
+    std::vector<uint256> vHashUpdate;
     BOOST_FOREACH (const CTransaction& tx, block.vtx) {
         // ignore validation errors in resurrected transactions
         list<CTransaction> removed;
         CValidationState stateDummy;
-        if (tx.IsCoinBase() || tx.IsCoinStake() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
+        if (tx.IsCoinBase() || tx.IsCoinStake() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL, false, false, true)) {
             mempool.remove(tx, removed, true);
+        } else if (mempool.exists(tx.GetHash())) {
+            vHashUpdate.push_back(tx.GetHash());
+        }
     }
+    // AcceptToMemoryPool/addUnchecked all assume that new mempool entries have
+    // no in-mempool children, which is generally not true when adding
+    // previously-confirmed transactions back to the mempool.
+    // UpdateTransactionsFromBlock finds descendants of any transactions in this
+    // block that were added back and cleans up the mempool state.
+    mempool.UpdateTransactionsFromBlock(vHashUpdate);
     mempool.removeCoinbaseSpends(pcoinsTip, pindexDelete->nHeight);
+    LimitMempoolSize(mempool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
     mempool.check(pcoinsTip);
     // Update chainActive and related variables.
     UpdateTip(pindexDelete->pprev);
@@ -2477,6 +3051,7 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock*
     LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
     {
         CInv inv(MSG_BLOCK, pindexNew->GetBlockHash());
+        PrefetchInputs(*pblock, *pcoinsTip);
         bool rv = ConnectBlock(*pblock, state, pindexNew, view);
         g_signals.BlockChecked(*pblock, state);
         if (!rv) {
@@ -2774,6 +3349,10 @@ bool ActivateBestChain(CValidationState& state, CBlock* pblock)
                 continue;
             }
 
+            // The chain state is being filled from a UTXO snapshot
+            if (pindexTxOutSetLoading)
+                return true;
+
             pindexMostWork = FindMostWorkChain();
 
             // Whether we have anything to do at all.
@@ -2794,11 +3373,30 @@ bool ActivateBestChain(CValidationState& state, CBlock* pblock)
             uint256 hashNewTip = pindexNewTip->GetBlockHash();
             // Relay inventory, but don't relay old inventory during initial block download.
             int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate(chainParams.Checkpoints());
+            // Peers in high-bandwidth compact block mode get the block itself
+            // straight away instead of an inv they would have to answer.
+            CInv invNewTip(MSG_BLOCK, hashNewTip);
+            boost::shared_ptr<CBlockHeaderAndShortTxIDs> pcmpctblock;
+            if (pblock && pblock->GetHash() == hashNewTip)
+                pcmpctblock.reset(new CBlockHeaderAndShortTxIDs(*pblock));
             {
                 LOCK(cs_vNodes);
-                BOOST_FOREACH (CNode* pnode, vNodes)
-                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                        pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                BOOST_FOREACH (CNode* pnode, vNodes) {
+                    if (chainActive.Height() <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                        continue;
+                    if (pcmpctblock && pnode->fPreferHeaderAndIDs) {
+                        bool fKnown;
+                        {
+                            LOCK(pnode->cs_inventory);
+                            fKnown = pnode->setInventoryKnown.count(invNewTip);
+                        }
+                        if (!fKnown) {
+                            pnode->PushMessage("cmpctblock", *pcmpctblock);
+                            pnode->AddInventoryKnown(invNewTip);
+                        }
+                    } else
+                        pnode->PushInventory(invNewTip);
+                }
             }
             // Notify external listeners about the new tip.
             uiInterface.NotifyBlockTip(hashNewTip);
@@ -2884,6 +3482,45 @@ bool ReconsiderBlock(CValidationState& state, CBlockIndex* pindex)
     return true;
 }
 
+namespace
+{
+/**
+ * Storage for every mapBlockIndex entry. Entries live until shutdown, so they
+ * are handed out of chunks of BLOCK_INDEX_ARENA_CHUNK rather than allocated
+ * one at a time, and only ever freed all together by Clear. Protected by
+ * cs_main (or used before other threads start, while loading the index).
+ */
+class CBlockIndexArena
+{
+private:
+    std::vector<CBlockIndex*> vChunks;
+    size_t nUsed;
+
+public:
+    CBlockIndexArena() : nUsed(BLOCK_INDEX_ARENA_CHUNK) {}
+
+    CBlockIndex* Allocate()
+    {
+        if (nUsed == BLOCK_INDEX_ARENA_CHUNK) {
+            vChunks.push_back(new CBlockIndex[BLOCK_INDEX_ARENA_CHUNK]);
+            nUsed = 0;
+        }
+        return &vChunks.back()[nUsed++];
+    }
+
+    /** Free every entry handed out so far. */
+    void Clear()
+    {
+        for (size_t i = 0; i < vChunks.size(); i++)
+            delete[] vChunks[i];
+        vChunks.clear();
+        nUsed = BLOCK_INDEX_ARENA_CHUNK;
+    }
+};
+
+CBlockIndexArena blockIndexArena;
+} // anon namespace
+
 CBlockIndex* AddToBlockIndex(const CBlock& block)
 {
     // Check for duplicate
@@ -2893,8 +3530,8 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
         return it->second;
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(block);
-    assert(pindexNew);
+    CBlockIndex* pindexNew = blockIndexArena.Allocate();
+    *pindexNew = CBlockIndex(block);
 
     // We assign the sequence id to blocks only when the full data is available,
     // to avoid miners withholding blocks but broadcasting headers, to get a
@@ -2958,12 +3595,42 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
 }
 
 /** Mark a block as having its data received and checked (up to BLOCK_VALID_TRANSACTIONS). */
-bool ReceivedBlockTransactions(const CBlock& block, CValidationState& state, CBlockIndex* pindexNew, const CDiskBlockPos& pos)
+/**
+ * Set nChainTx of pindexNew, whose parents are all linked, and of the
+ * descendants in mapBlocksUnlinked that were only waiting for it.
+ */
+static void LinkBlockIndex(CBlockIndex* pindexNew)
 {
-    if (block.IsProofOfStake())
-        pindexNew->SetProofOfStake();
+    deque<CBlockIndex*> queue;
+    queue.push_back(pindexNew);
+
+    // Recursively process any descendant blocks that now may be eligible to be connected.
+    while (!queue.empty()) {
+        CBlockIndex* pindex = queue.front();
+        queue.pop_front();
+        pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
+        {
+            LOCK(cs_nBlockSequenceId);
+            pindex->nSequenceId = nBlockSequenceId++;
+        }
+        if (chainActive.Tip() == NULL || !setBlockIndexCandidates.value_comp()(pindex, chainActive.Tip())) {
+            setBlockIndexCandidates.insert(pindex);
+        }
+        std::pair<std::multimap<CBlockIndex*, CBlockIndex*>::iterator, std::multimap<CBlockIndex*, CBlockIndex*>::iterator> range = mapBlocksUnlinked.equal_range(pindex);
+        while (range.first != range.second) {
+            std::multimap<CBlockIndex*, CBlockIndex*>::iterator it = range.first;
+            queue.push_back(it->second);
+            range.first++;
+            mapBlocksUnlinked.erase(it);
+        }
+    }
+}
+
+bool ReceivedBlockTransactions(const CBlock& block, CValidationState& state, CBlockIndex* pindexNew, const CDiskBlockPos& pos)
+{
+    if (block.IsProofOfStake())
+        pindexNew->SetProofOfStake();
     pindexNew->nTx = block.vtx.size();
-    pindexNew->nChainTx = 0;
     pindexNew->nFile = pos.nFile;
     pindexNew->nDataPos = pos.nPos;
     pindexNew->nUndoPos = 0;
@@ -2971,31 +3638,15 @@ bool ReceivedBlockTransactions(const CBlock& block, CValidationState& state, CBl
     pindexNew->RaiseValidity(BLOCK_VALID_TRANSACTIONS);
     setDirtyBlockIndex.insert(pindexNew);
 
+    if (pindexNew->nStatus & BLOCK_SNAPSHOT) {
+        // Linked when the snapshot was loaded, and may be in setBlockIndexCandidates as the tip
+        return true;
+    }
+
+    pindexNew->nChainTx = 0;
     if (pindexNew->pprev == NULL || pindexNew->pprev->nChainTx) {
         // If pindexNew is the genesis block or all parents are BLOCK_VALID_TRANSACTIONS.
-        deque<CBlockIndex*> queue;
-        queue.push_back(pindexNew);
-
-        // Recursively process any descendant blocks that now may be eligible to be connected.
-        while (!queue.empty()) {
-            CBlockIndex* pindex = queue.front();
-            queue.pop_front();
-            pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
-            {
-                LOCK(cs_nBlockSequenceId);
-                pindex->nSequenceId = nBlockSequenceId++;
-            }
-            if (chainActive.Tip() == NULL || !setBlockIndexCandidates.value_comp()(pindex, chainActive.Tip())) {
-                setBlockIndexCandidates.insert(pindex);
-            }
-            std::pair<std::multimap<CBlockIndex*, CBlockIndex*>::iterator, std::multimap<CBlockIndex*, CBlockIndex*>::iterator> range = mapBlocksUnlinked.equal_range(pindex);
-            while (range.first != range.second) {
-                std::multimap<CBlockIndex*, CBlockIndex*>::iterator it = range.first;
-                queue.push_back(it->second);
-                range.first++;
-                mapBlocksUnlinked.erase(it);
-            }
-        }
+        LinkBlockIndex(pindexNew);
     } else {
         if (pindexNew->pprev && pindexNew->pprev->IsValid(BLOCK_VALID_TREE)) {
             mapBlocksUnlinked.insert(std::make_pair(pindexNew->pprev, pindexNew));
@@ -3038,6 +3689,8 @@ bool FindBlockPos(CValidationState& state, CDiskBlockPos& pos, unsigned int nAdd
         unsigned int nOldChunks = (pos.nPos + BLOCKFILE_CHUNK_SIZE - 1) / BLOCKFILE_CHUNK_SIZE;
         unsigned int nNewChunks = (vinfoBlockFile[nFile].nSize + BLOCKFILE_CHUNK_SIZE - 1) / BLOCKFILE_CHUNK_SIZE;
         if (nNewChunks > nOldChunks) {
+            if (fPruneMode)
+                fCheckForPruning = true;
             if (CheckDiskSpace(nNewChunks * BLOCKFILE_CHUNK_SIZE - pos.nPos)) {
                 FILE* file = OpenBlockFile(pos);
                 if (file) {
@@ -3068,6 +3721,8 @@ bool FindUndoPos(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigne
     unsigned int nOldChunks = (pos.nPos + UNDOFILE_CHUNK_SIZE - 1) / UNDOFILE_CHUNK_SIZE;
     unsigned int nNewChunks = (nNewSize + UNDOFILE_CHUNK_SIZE - 1) / UNDOFILE_CHUNK_SIZE;
     if (nNewChunks > nOldChunks) {
+        if (fPruneMode)
+            fCheckForPruning = true;
         if (CheckDiskSpace(nNewChunks * UNDOFILE_CHUNK_SIZE - pos.nPos)) {
             FILE* file = OpenUndoFile(pos);
             if (file) {
@@ -3093,6 +3748,9 @@ bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool f
 
 bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig)
 {
+    if (block.fChecked)
+        return true;
+
     const char * const s = block.IsProofOfStake() ? "pos" : "pow";
 
     // These are checks that are independent of context.
@@ -3184,10 +3842,13 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
         return state.DoS(100, error("%s: out-of-bounds SigOpCount", __func__),
             REJECT_INVALID, "bad-blk-sigops", true);
 
+    if (fCheckPOW && fCheckMerkleRoot)
+        block.fChecked = true;
+
     return true;
 }
 
-bool CheckWork(const CBlock &block, CBlockIndex* const pindexPrev)
+bool CheckWork(const CBlock &block, CBlockIndex* const pindexPrev, bool fStoreProof)
 {
 #if 0
     const CChainParams& chainParams = Params();
@@ -3224,7 +3885,7 @@ bool CheckWork(const CBlock &block, CBlockIndex* const pindexPrev)
             if (proof != hashProofOfStake)
                 return error("%s: diverged stake %s, %s (block %s)\n", __func__,
                              hashProofOfStake.GetHex(), proof.GetHex(), hash.GetHex());
-        } else {
+        } else if (fStoreProof) {
             stake->SetProof(hash, hashProofOfStake);
         }
     }
@@ -3351,6 +4012,19 @@ bool AcceptBlockHeader(const CBlock& block, CValidationState& state, CBlockIndex
     return true;
 }
 
+/** Add the transactions of block, stored at pos, to the transaction index. */
+static bool WriteBlockTxIndex(const CBlock& block, const CDiskBlockPos& pos)
+{
+    CDiskTxPos txpos(pos, GetSizeOfCompactSize(block.vtx.size()));
+    std::vector<std::pair<uint256, CDiskTxPos> > vPos;
+    vPos.reserve(block.vtx.size());
+    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+        vPos.push_back(std::make_pair(tx.GetHash(), txpos));
+        txpos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+    }
+    return pblocktree->WriteTxIndex(vPos);
+}
+
 bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex, CDiskBlockPos* dbp)
 {
     AssertLockHeld(cs_main);
@@ -3380,6 +4054,10 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
         return true;
     }
 
+    // A block of the active chain that has since been pruned is not stored again
+    if (pindex->nTx != 0 && chainActive.Contains(pindex))
+        return true;
+
     if ((!CheckBlock(block, state)) || !ContextualCheckBlock(block, state, pindex->pprev)) {
         if (state.IsInvalid() && !state.CorruptionPossible()) {
             pindex->nStatus |= BLOCK_FAILED_VALID;
@@ -3402,6 +4080,12 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
             return state.Abort("Failed to write block");
         if (!ReceivedBlockTransactions(block, state, pindex, blockPos))
             return error("%s: ReceivedBlockTransactions failed", __func__);
+        // Blocks below a UTXO snapshot are never connected; the stake checks
+        // of the blocks after them find the staked transactions by the index.
+        bool fBelowSnapshot = (pindex->nStatus & BLOCK_SNAPSHOT) ||
+                              (pindexTxOutSetLoading && pindexTxOutSetLoading->GetAncestor(nHeight) == pindex);
+        if (fTxIndex && fBelowSnapshot && !WriteBlockTxIndex(block, blockPos))
+            return state.Abort("Failed to write transaction index");
     } catch (std::runtime_error& e) {
         return state.Abort(std::string("System error: ") + e.what());
     }
@@ -3471,8 +4155,24 @@ void CBlockIndex::BuildSkip()
         pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
 }
 
+/**
+ * Set the skiplist pointers of the entries in [nBegin, nEnd) of vIndex that
+ * are on chainBest, whose ancestors are a lookup in chainBest away. Nothing
+ * read here is written by another slice, so slices can run in parallel.
+ */
+static void BuildSkipOnChain(const vector<pair<int, CBlockIndex*> >& vIndex, size_t nBegin, size_t nEnd, const CChain& chainBest)
+{
+    for (size_t i = nBegin; i < nEnd; i++) {
+        CBlockIndex* pindex = vIndex[i].second;
+        if (pindex->pprev && chainBest.Contains(pindex))
+            pindex->pskip = chainBest[GetSkipHeight(pindex->nHeight)];
+    }
+}
+
 bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDiskBlockPos* dbp)
 {
+    const uint64_t nPhi1612Start = GetPhi1612EvaluationCount();
+
     // Preliminary checks
     if (!CheckBlock(*pblock, state))
         return error("%s: block not passing checks", __func__);
@@ -3540,6 +4240,14 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
             pwalletMain->AutoCombineDust();
     }
 
+    {
+        LOCK(cs_main);
+        nPhi1612LastBlock = GetPhi1612EvaluationCount() - nPhi1612Start;
+        nPhi1612AcceptedTotal += nPhi1612LastBlock;
+        nPhi1612AcceptedBlocks++;
+        LogPrint("bench", "- PHI1612 evaluations: %u [%.2f/block]\n", (unsigned)nPhi1612LastBlock, (double)nPhi1612AcceptedTotal / nPhi1612AcceptedBlocks);
+    }
+
     auto const &hash = pindex->GetBlockHash();
     const char * const s = pindex->IsProofOfStake() ? "pos" : "pow";
     if (fDebug) {
@@ -3659,9 +4367,7 @@ CBlockIndex* InsertBlockIndex(uint256 hash)
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = blockIndexArena.Allocate();
     mi = mapBlockIndex.emplace(hash, pindexNew).first;
 
     pindexNew->phashBlock = &((*mi).first);
@@ -3672,12 +4378,14 @@ CBlockIndex* InsertBlockIndex(uint256 hash)
 bool static LoadBlockIndexDB()
 {
     const CChainParams& chainparams = Params();
+    int64_t nTimeStart = GetTimeMillis();
     if (!pblocktree->LoadBlockIndexGuts())
         return false;
 
     boost::this_thread::interruption_point();
 
     // Calculate nChainWork
+    int64_t nTimeGuts = GetTimeMillis();
     vector<pair<int, CBlockIndex*> > vSortedByHeight;
     vSortedByHeight.reserve(mapBlockIndex.size());
     for (auto const &item : mapBlockIndex) {
@@ -3688,7 +4396,10 @@ bool static LoadBlockIndexDB()
     for (auto const &item : vSortedByHeight) {
         CBlockIndex* pindex = item.second;
         pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
-        if (pindex->nStatus & BLOCK_HAVE_DATA) {
+        // We can link the chain of blocks for which we've received transactions at some point.
+        // Pruned nodes may have deleted the block, and the blocks below a UTXO snapshot may not
+        // have arrived yet.
+        if (pindex->nTx > 0 || (pindex->nStatus & BLOCK_SNAPSHOT)) {
             if (pindex->pprev) {
                 if (pindex->pprev->nChainTx) {
                     pindex->nChainTx = pindex->pprev->nChainTx + pindex->nTx;
@@ -3700,16 +4411,35 @@ bool static LoadBlockIndexDB()
                 pindex->nChainTx = pindex->nTx;
             }
         }
-        if (pindex->IsValid(BLOCK_VALID_TRANSACTIONS) && (pindex->nChainTx || pindex->pprev == NULL))
+        if ((pindex->IsValid(BLOCK_VALID_TRANSACTIONS) || (pindex->nStatus & BLOCK_SNAPSHOT)) && (pindex->nChainTx || pindex->pprev == NULL))
             setBlockIndexCandidates.insert(pindex);
         if (pindex->nStatus & BLOCK_FAILED_MASK && (!pindexBestInvalid || pindex->nChainWork > pindexBestInvalid->nChainWork))
             pindexBestInvalid = pindex;
-        if (pindex->pprev)
-            pindex->BuildSkip();
         if (pindex->IsValid(BLOCK_VALID_TREE) && (pindexBestHeader == NULL || CBlockIndexWorkComparator()(pindexBestHeader, pindex)))
             pindexBestHeader = pindex;
     }
 
+    // Build the skiplist: the entries on the best header chain in parallel,
+    // then the few off it in height order, as BuildSkip needs their ancestors'.
+    int64_t nTimeChainWork = GetTimeMillis();
+    int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency(), MAX_BLOCK_INDEX_LOAD_THREADS));
+    {
+        CChain chainBest;
+        chainBest.SetTip(pindexBestHeader);
+        boost::thread_group threads;
+        size_t nSlice = (vSortedByHeight.size() + nThreads - 1) / nThreads;
+        for (size_t nBegin = 0; nBegin < vSortedByHeight.size(); nBegin += nSlice)
+            threads.create_thread(boost::bind(&BuildSkipOnChain, boost::cref(vSortedByHeight), nBegin,
+                std::min(nBegin + nSlice, vSortedByHeight.size()), boost::cref(chainBest)));
+        threads.join_all();
+        for (auto const &item : vSortedByHeight) {
+            CBlockIndex* pindex = item.second;
+            if (pindex->pprev && !chainBest.Contains(pindex))
+                pindex->BuildSkip();
+        }
+    }
+    int64_t nTimeSkip = GetTimeMillis();
+
     // Load block file info
     pblocktree->ReadLastBlockFile(nLastBlockFile);
     vinfoBlockFile.resize(nLastBlockFile + 1);
@@ -3727,6 +4457,11 @@ bool static LoadBlockIndexDB()
         }
     }
 
+    // Check whether we have ever pruned block & undo files
+    pblocktree->ReadFlag("prunedblockfiles", fHavePruned);
+    if (fHavePruned)
+        LogPrintf("LoadBlockIndexDB(): Block files have previously been pruned\n");
+
     // Check presence of blk files
     LogPrintf("Checking all blk files are present...\n");
     set<int> setBlkDataFiles;
@@ -3742,6 +4477,9 @@ bool static LoadBlockIndexDB()
             return false;
         }
     }
+    LogPrintf("%s: %u entries in %dms (load %dms, chain work %dms, skiplist %dms on %d threads, block files %dms)\n", __func__,
+        vSortedByHeight.size(), GetTimeMillis() - nTimeStart, nTimeGuts - nTimeStart, nTimeChainWork - nTimeGuts,
+        nTimeSkip - nTimeChainWork, nThreads, GetTimeMillis() - nTimeSkip);
 
     //Check if the shutdown procedure was followed on last client exit
     bool fLastShutdownWasPrepared = true;
@@ -3749,7 +4487,7 @@ bool static LoadBlockIndexDB()
     LogPrintf("%s: Last shutdown was prepared: %s\n", __func__, fLastShutdownWasPrepared);
 
     //Check for inconsistency with block file info and internal state
-    if (!fLastShutdownWasPrepared && !GetBoolArg("-forcestart", false) && !GetBoolArg("-reindex", false) && (vSortedByHeight.size() != vinfoBlockFile[nLastBlockFile].nHeightLast + 1) && (vinfoBlockFile[nLastBlockFile].nHeightLast != 0)) {
+    if (!fLastShutdownWasPrepared && !GetBoolArg("-forcestart", false) && !GetBoolArg("-reindex", false) && !GetBoolArg("-reindex-chainstate", false) && (vSortedByHeight.size() != vinfoBlockFile[nLastBlockFile].nHeightLast + 1) && (vinfoBlockFile[nLastBlockFile].nHeightLast != 0)) {
         //The database is in a state where a block has been accepted and written to disk, but not
         //all of the block has perculated through the code. The block and the index should both be
         //intact (although assertions are added if they are not), and the block will be reprocessed
@@ -3866,6 +4604,60 @@ CVerifyDB::~CVerifyDB()
     uiInterface.ShowProgress("", 100);
 }
 
+namespace
+{
+/** A block checked by VerifyDB, and what the verification threads made of it. */
+struct CVerifyEntry {
+    CBlockIndex* pindex;
+    CBlock block;
+    int nFailedLevel;  //! the check level that failed, -1 if none did
+    int64_t nTimeRead; //! microseconds spent on each level
+    int64_t nTimeCheck;
+    int64_t nTimeUndo;
+
+    explicit CVerifyEntry(CBlockIndex* pindexIn) : pindex(pindexIn), nFailedLevel(-1), nTimeRead(0), nTimeCheck(0), nTimeUndo(0) {}
+};
+
+/**
+ * Run the check levels 0-2, which need no chainstate, on every nStride-th
+ * entry starting at nFirst. Entries are only written by the thread that
+ * owns them; cs_main is held by the caller for the block index reads.
+ */
+void VerifyBlockEntries(std::vector<CVerifyEntry>& vEntries, int nCheckLevel, size_t nFirst, size_t nStride)
+{
+    for (size_t i = nFirst; i < vEntries.size(); i += nStride) {
+        CVerifyEntry& entry = vEntries[i];
+        const CBlockIndex* pindex = entry.pindex;
+        // check level 0: read from disk
+        int64_t nTime0 = GetTimeMicros();
+        if (!ReadBlockFromDisk(entry.block, pindex)) {
+            entry.nFailedLevel = 0;
+            continue;
+        }
+        int64_t nTime1 = GetTimeMicros();
+        entry.nTimeRead = nTime1 - nTime0;
+        // check level 1: verify block validity
+        CValidationState state;
+        if (nCheckLevel >= 1 && !CheckBlock(entry.block, state)) {
+            entry.nFailedLevel = 1;
+            continue;
+        }
+        int64_t nTime2 = GetTimeMicros();
+        entry.nTimeCheck = nTime2 - nTime1;
+        // check level 2: verify undo validity
+        if (nCheckLevel >= 2) {
+            CBlockUndo undo;
+            CDiskBlockPos pos = pindex->GetUndoPos();
+            if (!pos.IsNull() && !undo.ReadFromDisk(pos, pindex->pprev->GetBlockHash())) {
+                entry.nFailedLevel = 2;
+                continue;
+            }
+        }
+        entry.nTimeUndo = GetTimeMicros() - nTime2;
+    }
+}
+} // anon namespace
+
 bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth)
 {
     LOCK(cs_main);
@@ -3884,47 +4676,90 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
     CBlockIndex* pindexFailure = NULL;
     int nGoodTransactions = 0;
     CValidationState state;
-    for (CBlockIndex* pindex = chainActive.Tip(); pindex && pindex->pprev; pindex = pindex->pprev) {
-        boost::this_thread::interruption_point();
-        uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100)))));
-        if (pindex->nHeight < chainActive.Height() - nCheckDepth)
-            break;
-        CBlock block;
-        // check level 0: read from disk
-        if (!ReadBlockFromDisk(block, pindex))
-            return error("VerifyDB() : *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
-        // check level 1: verify block validity
-        if (nCheckLevel >= 1 && !CheckBlock(block, state))
-            return error("VerifyDB() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
-        // check level 2: verify undo validity
-        if (nCheckLevel >= 2 && pindex) {
-            CBlockUndo undo;
-            CDiskBlockPos pos = pindex->GetUndoPos();
-            if (!pos.IsNull()) {
-                if (!undo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
-                    return error("VerifyDB() : *** found bad undo data at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+
+    // Levels 0-2 run on a pool of threads, a batch of blocks down the chain at
+    // a time; their results are then taken in chain order by the level 3
+    // disconnects, which need the chainstate and stay on this thread.
+    int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency(), MAX_VERIFYDB_THREADS));
+    int64_t nTimeRead = 0, nTimeCheck = 0, nTimeUndo = 0;
+    int64_t nTimeParallel = 0, nTimeDisconnect = 0, nTimeReconnect = 0;
+    unsigned int nChecked = 0;
+    std::vector<CVerifyEntry> vEntries;
+    vEntries.reserve(VERIFYDB_BATCH_BLOCKS);
+    CBlockIndex* pindexNext = chainActive.Tip();
+    bool fDone = false;
+    while (!fDone) {
+        vEntries.clear();
+        while (vEntries.size() < VERIFYDB_BATCH_BLOCKS) {
+            if (!pindexNext || !pindexNext->pprev || pindexNext->nHeight < chainActive.Height() - nCheckDepth) {
+                fDone = true;
+                break;
+            }
+            if (!(pindexNext->nStatus & BLOCK_HAVE_DATA) && (fPruneMode || (pindexNext->nStatus & BLOCK_SNAPSHOT))) {
+                // If pruning, or below a UTXO snapshot whose blocks are still
+                // being fetched, only go back as far as we have data.
+                LogPrintf("VerifyDB(): block verification stopping at height %d (no data)\n", pindexNext->nHeight);
+                fDone = true;
+                break;
             }
+            vEntries.push_back(CVerifyEntry(pindexNext));
+            pindexNext = pindexNext->pprev;
         }
-        // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= nCoinCacheSize) {
-            bool fClean = true;
-            if (!DisconnectBlock(block, state, pindex, coins, &fClean))
-                return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
-            pindexState = pindex->pprev;
-            if (!fClean) {
-                nGoodTransactions = 0;
-                pindexFailure = pindex;
-            } else
-                nGoodTransactions += block.vtx.size();
+
+        int64_t nTime0 = GetTimeMicros();
+        {
+            boost::thread_group threads;
+            for (size_t i = 0; i < (size_t)nThreads && i < vEntries.size(); i++)
+                threads.create_thread(boost::bind(&VerifyBlockEntries, boost::ref(vEntries), nCheckLevel, i, (size_t)nThreads));
+            threads.join_all();
         }
-        if (ShutdownRequested())
-            return true;
+        int64_t nTime1 = GetTimeMicros();
+        nTimeParallel += nTime1 - nTime0;
+
+        for (size_t i = 0; i < vEntries.size(); i++) {
+            CVerifyEntry& entry = vEntries[i];
+            CBlockIndex* pindex = entry.pindex;
+            boost::this_thread::interruption_point();
+            uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100)))));
+            if (entry.nFailedLevel == 0)
+                return error("VerifyDB() : *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+            if (entry.nFailedLevel == 1)
+                return error("VerifyDB() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+            if (entry.nFailedLevel == 2)
+                return error("VerifyDB() : *** found bad undo data at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+            nTimeRead += entry.nTimeRead;
+            nTimeCheck += entry.nTimeCheck;
+            nTimeUndo += entry.nTimeUndo;
+            nChecked++;
+            if (nCheckLevel >= 3 && pindex == pindexState && !(pindex->nStatus & BLOCK_HAVE_UNDO)) {
+                // Blocks below a loaded UTXO snapshot were never connected, so cannot be disconnected.
+                LogPrintf("VerifyDB(): block verification stopping at height %d (no undo data)\n", pindex->nHeight);
+                fDone = true;
+                break;
+            }
+            // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
+            if (nCheckLevel >= 3 && pindex == pindexState && (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage()) <= nCoinCacheUsage) {
+                bool fClean = true;
+                if (!DisconnectBlock(entry.block, state, pindex, coins, &fClean))
+                    return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+                pindexState = pindex->pprev;
+                if (!fClean) {
+                    nGoodTransactions = 0;
+                    pindexFailure = pindex;
+                } else
+                    nGoodTransactions += entry.block.vtx.size();
+            }
+            if (ShutdownRequested())
+                return true;
+        }
+        nTimeDisconnect += GetTimeMicros() - nTime1;
     }
     if (pindexFailure)
         return error("VerifyDB() : *** coin database inconsistencies found (last %i blocks, %i good transactions before that)\n", chainActive.Height() - pindexFailure->nHeight + 1, nGoodTransactions);
 
     // check level 4: try reconnecting blocks
     if (nCheckLevel >= 4) {
+        int64_t nTimeStart = GetTimeMicros();
         CBlockIndex* pindex = pindexState;
         while (pindex != chainActive.Tip()) {
             boost::this_thread::interruption_point();
@@ -3936,8 +4771,12 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
             if (!ConnectBlock(block, state, pindex, coins))
                 return error("VerifyDB() : *** found unconnectable block at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
         }
+        nTimeReconnect = GetTimeMicros() - nTimeStart;
     }
 
+    LogPrintf("VerifyDB(): checked %u blocks: levels 0-2 %.2fms on %d threads (read %.2fms, check %.2fms, undo %.2fms summed over threads), level 3 %.2fms, level 4 %.2fms\n",
+        nChecked, nTimeParallel * 0.001, nThreads, nTimeRead * 0.001, nTimeCheck * 0.001, nTimeUndo * 0.001,
+        nTimeDisconnect * 0.001, nTimeReconnect * 0.001);
     LogPrintf("No coin database inconsistencies in last %i blocks (%i transactions)\n", chainActive.Height() - pindexState->nHeight, nGoodTransactions);
 
     return true;
@@ -3972,8 +4811,9 @@ bool InitBlockIndex()
     pblocktree->WriteFlag("txindex", fTxIndex);
     LogPrintf("Initializing databases...\n");
 
-    // Only add the genesis block if not reindexing (in which case we reuse the one already on disk)
-    if (!fReindex) {
+    // Only add the genesis block if not reindexing (in which case we reuse the one already on disk),
+    // nor when only the chain state was wiped and the block index still has it
+    if (!fReindex && !mapBlockIndex.count(Params().HashGenesisBlock())) {
         try {
             CBlock& block = const_cast<CBlock&>(Params().GenesisBlock());
             // Start new block file
@@ -4000,106 +4840,671 @@ bool InitBlockIndex()
 }
 
 
+namespace
+{
+/** A block read from an external block file, and what the decoding threads made of it. */
+struct CImportBlock {
+    unsigned int nPos;     //! Position of the block data in the file
+    std::vector<char> vch; //! Serialized block, released once decoded
+    CBlock block;
+    bool fDecoded;
+
+    CImportBlock() : nPos(0), fDecoded(false) {}
+};
+
+struct CImportBatch {
+    std::vector<CImportBlock> vBlocks;
+    size_t nBytes;
+    bool fDone;
+
+    CImportBatch() : nBytes(0), fDone(false) {}
+};
+
+/**
+ * Pipeline behind LoadExternalBlockFile. One thread scans the file for
+ * message-start markers and reads raw blocks in batches; a pool of threads
+ * deserializes them, computes their header hashes and runs the context-free
+ * CheckBlock (merkle root included), whose result is memoized in the block;
+ * the caller takes the batches back in file order and feeds ProcessNewBlock.
+ */
+class CImportPipeline
+{
+private:
+    typedef boost::shared_ptr<CImportBatch> BatchPtr;
+
+    boost::mutex mutex;
+    boost::condition_variable condRead;   //! the reader waits for room
+    boost::condition_variable condDecode; //! decoders wait for work
+    boost::condition_variable condDone;   //! the consumer waits for the next batch
+    std::deque<BatchPtr> queueOrdered;    //! all batches in flight, in file order
+    std::deque<BatchPtr> queueDecode;     //! batches waiting for a decoder
+    size_t nBytesInFlight;
+    bool fReadDone;
+    bool fStop;
+    uint64_t nBlocksRead;
+    uint64_t nBytesRead;
+    boost::thread_group threads;
+
+    void Push(const BatchPtr& batch)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!fStop && !queueOrdered.empty() && nBytesInFlight + batch->nBytes > MAX_IMPORT_READ_AHEAD)
+            condRead.wait(lock);
+        nBytesInFlight += batch->nBytes;
+        nBlocksRead += batch->vBlocks.size();
+        nBytesRead += batch->nBytes;
+        queueOrdered.push_back(batch);
+        queueDecode.push_back(batch);
+        condDecode.notify_one();
+    }
+
+    bool Stopping()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return fStop;
+    }
+
+    void ThreadRead(FILE* fileIn)
+    {
+        RenameThread("lux-importread");
+        try {
+            // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
+            CBufferedFile blkdat(fileIn, 2 * MAX_BLOCK_SIZE, MAX_BLOCK_SIZE + 8, SER_DISK, CLIENT_VERSION);
+            uint64_t nRewind = blkdat.GetPos();
+            BatchPtr batch(new CImportBatch());
+            while (!blkdat.eof() && !Stopping()) {
+                blkdat.SetPos(nRewind);
+                nRewind++;         // start one byte further next time, in case of failure
+                blkdat.SetLimit(); // remove former limit
+                unsigned int nSize = 0;
+                try {
+                    // locate a header
+                    unsigned char buf[MESSAGE_START_SIZE];
+                    blkdat.FindByte(Params().MessageStart()[0]);
+                    nRewind = blkdat.GetPos() + 1;
+                    blkdat >> FLATDATA(buf);
+                    if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
+                        continue;
+                    // read size
+                    blkdat >> nSize;
+                    if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+                        continue;
+                } catch (const std::exception&) {
+                    // no valid block header found; don't complain
+                    break;
+                }
+                try {
+                    // read block
+                    uint64_t nBlockPos = blkdat.GetPos();
+                    blkdat.SetLimit(nBlockPos + nSize);
+                    blkdat.SetPos(nBlockPos);
+                    std::vector<char> vch(nSize);
+                    blkdat.read(&vch[0], nSize);
+                    nRewind = blkdat.GetPos();
+                    batch->vBlocks.push_back(CImportBlock());
+                    batch->vBlocks.back().nPos = nBlockPos;
+                    batch->vBlocks.back().vch.swap(vch);
+                    batch->nBytes += nSize;
+                } catch (std::exception& e) {
+                    LogPrintf("%s : Deserialize or I/O error - %s", "LoadExternalBlockFile", e.what());
+                }
+                if (batch->vBlocks.size() >= IMPORT_BATCH_BLOCKS || batch->nBytes >= MAX_BLOCK_SIZE) {
+                    Push(batch);
+                    batch.reset(new CImportBatch());
+                }
+            }
+            if (!batch->vBlocks.empty())
+                Push(batch);
+        } catch (std::runtime_error& e) {
+            AbortNode(std::string("System error: ") + e.what());
+        }
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fReadDone = true;
+        condDecode.notify_all();
+        condDone.notify_all();
+    }
+
+    static void DecodeBatch(CImportBatch& batch)
+    {
+        std::vector<const CBlockHeader*> vpHeaders;
+        vpHeaders.reserve(batch.vBlocks.size());
+        BOOST_FOREACH (CImportBlock& entry, batch.vBlocks) {
+            try {
+                CBufferReader blkdat(&entry.vch[0], &entry.vch[0] + entry.vch.size(), SER_DISK, CLIENT_VERSION);
+                blkdat >> entry.block;
+                entry.fDecoded = true;
+                vpHeaders.push_back(&entry.block);
+            } catch (std::exception& e) {
+                LogPrintf("%s : Deserialize or I/O error - %s", "LoadExternalBlockFile", e.what());
+            }
+            std::vector<char>().swap(entry.vch);
+        }
+
+        // Seeds the memoized header hashes, several headers per pass
+        std::vector<uint256> vHashes(vpHeaders.size());
+        if (!vpHeaders.empty())
+            Phi1612Batch(&vpHeaders[0], vpHeaders.size(), &vHashes[0]);
+
+        // Failures are not acted on here: ProcessNewBlock runs CheckBlock
+        // again for blocks that did not pass and rejects them as usual.
+        BOOST_FOREACH (CImportBlock& entry, batch.vBlocks) {
+            if (entry.fDecoded) {
+                CValidationState state;
+                CheckBlock(entry.block, state);
+            }
+        }
+    }
+
+    void ThreadDecode()
+    {
+        RenameThread("lux-importdec");
+        while (true) {
+            BatchPtr batch;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fStop && !fReadDone && queueDecode.empty())
+                    condDecode.wait(lock);
+                if (fStop || queueDecode.empty())
+                    return;
+                batch = queueDecode.front();
+                queueDecode.pop_front();
+            }
+            DecodeBatch(*batch);
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                batch->fDone = true;
+            }
+            condDone.notify_all();
+        }
+    }
+
+public:
+    CImportPipeline(FILE* fileIn, int nDecodeThreads) : nBytesInFlight(0), fReadDone(false), fStop(false), nBlocksRead(0), nBytesRead(0)
+    {
+        threads.create_thread(boost::bind(&CImportPipeline::ThreadRead, this, fileIn));
+        for (int i = 0; i < nDecodeThreads; i++)
+            threads.create_thread(boost::bind(&CImportPipeline::ThreadDecode, this));
+    }
+
+    ~CImportPipeline()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+        }
+        condRead.notify_all();
+        condDecode.notify_all();
+        condDone.notify_all();
+        threads.join_all();
+    }
+
+    /** The next batch in file order, once decoded; NULL after the last one. */
+    BatchPtr Next()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (true) {
+            if (!queueOrdered.empty() && queueOrdered.front()->fDone) {
+                BatchPtr batch = queueOrdered.front();
+                queueOrdered.pop_front();
+                nBytesInFlight -= batch->nBytes;
+                condRead.notify_one();
+                return batch;
+            }
+            if (queueOrdered.empty() && fReadDone)
+                return BatchPtr();
+            condDone.wait(lock);
+        }
+    }
+
+    void GetReadStats(uint64_t& nBlocks, uint64_t& nBytes)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nBlocks = nBlocksRead;
+        nBytes = nBytesRead;
+    }
+};
+} // anon namespace
+
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
 {
     // Map of disk positions for blocks with unknown parent (only used for reindex)
     static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
     int64_t nStart = GetTimeMillis();
+    int64_t nLastProgress = nStart;
 
     int nLoaded = 0;
+    uint64_t nProcessed = 0;
+    uint64_t nBlocksRead = 0, nBytesRead = 0;
     try {
-        // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
-        CBufferedFile blkdat(fileIn, 2 * MAX_BLOCK_SIZE, MAX_BLOCK_SIZE + 8, SER_DISK, CLIENT_VERSION);
-        uint64_t nRewind = blkdat.GetPos();
-        while (!blkdat.eof()) {
+        int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency(), MAX_IMPORT_THREADS));
+        CImportPipeline pipeline(fileIn, nThreads);
+        bool fEnd = false;
+        while (!fEnd) {
             boost::this_thread::interruption_point();
 
-            blkdat.SetPos(nRewind);
-            nRewind++;         // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
-            try {
-                // locate a header
-                unsigned char buf[MESSAGE_START_SIZE];
-                blkdat.FindByte(Params().MessageStart()[0]);
-                nRewind = blkdat.GetPos() + 1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
-                    continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
-                    continue;
-            } catch (const std::exception&) {
-                // no valid block header found; don't complain
+            boost::shared_ptr<CImportBatch> batch = pipeline.Next();
+            if (!batch)
                 break;
-            }
-            try {
-                // read block
-                uint64_t nBlockPos = blkdat.GetPos();
-                if (dbp)
-                    dbp->nPos = nBlockPos;
-                blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                CBlock block;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
-
-                // detect out of order blocks, and store them for later
-                uint256 hash = block.GetHash();
-                if (hash != Params().HashGenesisBlock() && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
-                    LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
-                        block.hashPrevBlock.ToString());
-                    if (dbp)
-                        mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
+
+            for (size_t i = 0; i < batch->vBlocks.size() && !fEnd; i++) {
+                CImportBlock& entry = batch->vBlocks[i];
+                if (!entry.fDecoded)
                     continue;
-                }
+                nProcessed++;
+                try {
+                    CBlock& block = entry.block;
+                    if (dbp)
+                        dbp->nPos = entry.nPos;
+
+                    // detect out of order blocks, and store them for later
+                    uint256 hash = block.GetHash();
+                    if (hash != Params().HashGenesisBlock() && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
+                        LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
+                            block.hashPrevBlock.ToString());
+                        if (dbp)
+                            mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
+                        continue;
+                    }
 
-                // process in case the block isn't known yet
-                if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
-                    CValidationState state;
-                    if (ProcessNewBlock(state, NULL, &block, dbp))
-                        nLoaded++;
-                    if (state.IsError())
-                        break;
-                } else if (hash != Params().HashGenesisBlock() && mapBlockIndex[hash]->nHeight % 1000 == 0) {
-                    LogPrintf("Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
-                }
+                    // process in case the block isn't known yet
+                    if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
+                        CValidationState state;
+                        if (ProcessNewBlock(state, NULL, &block, dbp))
+                            nLoaded++;
+                        if (state.IsError()) {
+                            fEnd = true;
+                            break;
+                        }
+                    } else if (hash != Params().HashGenesisBlock() && mapBlockIndex[hash]->nHeight % 1000 == 0) {
+                        LogPrintf("Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
+                    }
 
-                // Recursively process earlier encountered successors of this block
-                deque<uint256> queue;
-                queue.push_back(hash);
-                while (!queue.empty()) {
-                    uint256 head = queue.front();
-                    queue.pop_front();
-                    std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
-                    while (range.first != range.second) {
-                        std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
-                        if (ReadBlockFromDisk(block, it->second)) {
-                            LogPrintf("%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(),
-                                head.ToString());
-                            CValidationState dummy;
-                            if (ProcessNewBlock(dummy, NULL, &block, &it->second)) {
-                                nLoaded++;
-                                queue.push_back(block.GetHash());
+                    // Recursively process earlier encountered successors of this block
+                    deque<uint256> queue;
+                    queue.push_back(hash);
+                    while (!queue.empty()) {
+                        uint256 head = queue.front();
+                        queue.pop_front();
+                        std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
+                        while (range.first != range.second) {
+                            std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
+                            if (ReadBlockFromDisk(block, it->second)) {
+                                LogPrintf("%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(),
+                                    head.ToString());
+                                CValidationState dummy;
+                                if (ProcessNewBlock(dummy, NULL, &block, &it->second)) {
+                                    nLoaded++;
+                                    queue.push_back(block.GetHash());
+                                }
                             }
+                            range.first++;
+                            mapBlocksUnknownParent.erase(it);
                         }
-                        range.first++;
-                        mapBlocksUnknownParent.erase(it);
                     }
+                } catch (std::exception& e) {
+                    LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
                 }
-            } catch (std::exception& e) {
-                LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
+            }
+
+            int64_t nNow = GetTimeMillis();
+            if (nNow - nLastProgress >= IMPORT_PROGRESS_INTERVAL * 1000) {
+                pipeline.GetReadStats(nBlocksRead, nBytesRead);
+                double dSeconds = (nNow - nStart) * 0.001;
+                LogPrintf("Block Import: %u blocks processed, %u read (%.1fMiB), %.1f blocks/s, %.1fMiB/s\n",
+                    nProcessed, nBlocksRead, nBytesRead / 1048576.0, nProcessed / dSeconds, nBytesRead / 1048576.0 / dSeconds);
+                nLastProgress = nNow;
             }
         }
+        pipeline.GetReadStats(nBlocksRead, nBytesRead);
     } catch (std::runtime_error& e) {
         AbortNode(std::string("System error: ") + e.what());
     }
-    if (nLoaded > 0)
-        LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
+    if (nLoaded > 0) {
+        int64_t nTime = std::max(GetTimeMillis() - nStart, (int64_t)1);
+        LogPrintf("Loaded %i blocks from external file in %dms (%.1fMiB, %.1f blocks/s)\n", nLoaded, nTime,
+            nBytesRead / 1048576.0, nProcessed * 1000.0 / nTime);
+    }
     return nLoaded > 0;
 }
 
+namespace
+{
+/** Version of the UTXO snapshot file format */
+const int TXOUTSET_SNAPSHOT_VERSION = 2;
+
+/**
+ * Fixed-size start of a UTXO snapshot file. It is followed by nCoins
+ * (COutPoint, Coin) records, in chain state database order.
+ */
+struct CTxOutSetSnapshotHeader {
+    unsigned char pchMessageStart[MESSAGE_START_SIZE];
+    int nVersion;
+    uint256 hashBlock;
+    uint64_t nCoins;
+    uint256 hashSnapshot;
+
+    CTxOutSetSnapshotHeader() : nVersion(TXOUTSET_SNAPSHOT_VERSION), hashBlock(0), nCoins(0), hashSnapshot(0)
+    {
+        memcpy(pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE);
+    }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(FLATDATA(pchMessageStart));
+        READWRITE(this->nVersion);
+        READWRITE(hashBlock);
+        READWRITE(nCoins);
+        READWRITE(hashSnapshot);
+    }
+};
+
+/** Streams the coins of a view to a snapshot file and hashes them on the way. */
+class CTxOutSetWriter : public CCoinsVisitor
+{
+public:
+    CAutoFile& file;
+    CHashWriter hasher;
+    uint64_t nCoins;
+
+    CTxOutSetWriter(CAutoFile& fileIn, const uint256& hashBlock) : file(fileIn), hasher(SER_GETHASH, PROTOCOL_VERSION), nCoins(0)
+    {
+        hasher << hashBlock;
+    }
+
+    bool Visit(const COutPoint& outpoint, const Coin& coin)
+    {
+        file << outpoint << coin;
+        hasher << outpoint << coin;
+        nCoins++;
+        return true;
+    }
+};
+
+/** Adds snapshot coins to a cache, flushing it whenever it outgrows -dbcache. */
+class CTxOutSetLoader : public CCoinsVisitor
+{
+public:
+    CCoinsViewCache& view;
+
+    CTxOutSetLoader(CCoinsViewCache& viewIn) : view(viewIn) {}
+
+    bool Visit(const COutPoint& outpoint, const Coin& coin)
+    {
+        view.AddCoin(outpoint, coin, true);
+        if (CCoinsRunningStats* pstats = view.RunningStats())
+            pstats->AddCoin(outpoint, coin);
+        if (view.DynamicMemoryUsage() > nCoinCacheUsage)
+            return view.Flush();
+        return true;
+    }
+};
+
+/**
+ * Read the records following header, check that each is an unspent output
+ * created at or below nMaxHeight, pass them to visitor if there is one and
+ * return their hash in hash. Throws on I/O errors.
+ */
+bool ReadTxOutSetRecords(CAutoFile& file, const CTxOutSetSnapshotHeader& header, int nMaxHeight, uint256& hash, CCoinsVisitor* visitor)
+{
+    CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
+    hasher << header.hashBlock;
+    for (uint64_t i = 0; i < header.nCoins; i++) {
+        COutPoint outpoint;
+        Coin coin;
+        file >> outpoint >> coin;
+        if (coin.IsSpent() || (int)coin.nHeight > nMaxHeight)
+            return error("%s : invalid coin %s in snapshot", __func__, outpoint.ToString());
+        hasher << outpoint << coin;
+        if (visitor && !visitor->Visit(outpoint, coin))
+            return false;
+    }
+    if (fgetc(file.Get()) != EOF)
+        return error("%s : trailing data after %u coins", __func__, header.nCoins);
+    hash = hasher.GetHash();
+    return true;
+}
+} // anon namespace
+
+bool DumpTxOutSet(const boost::filesystem::path& path, CTxOutSetSnapshotInfo& info, std::string& strError)
+{
+    LOCK(cs_main);
+
+    // The snapshot is taken from the database, so everything must be on disk first
+    CValidationState state;
+    if (!FlushStateToDisk(state, FLUSH_STATE_ALWAYS)) {
+        strError = "Failed to flush the chain state";
+        return false;
+    }
+    CBlockIndex* pindex = chainActive.Tip();
+    if (pindex == NULL || pcoinsTip->GetBestBlock() != pindex->GetBlockHash()) {
+        strError = "The chain state is not at the tip";
+        return false;
+    }
+    if (boost::filesystem::exists(path)) {
+        strError = strprintf("%s already exists", path.string());
+        return false;
+    }
+
+    int64_t nStart = GetTimeMillis();
+    boost::filesystem::path pathTmp = path.string() + ".incomplete";
+    CAutoFile file(fopen(pathTmp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        strError = strprintf("Cannot open %s for writing", pathTmp.string());
+        return false;
+    }
+
+    CTxOutSetSnapshotHeader header;
+    header.hashBlock = pindex->GetBlockHash();
+    try {
+        file << header;
+        CTxOutSetWriter writer(file, header.hashBlock);
+        if (!pcoinsTip->ForEachCoin(writer))
+            throw std::runtime_error("failed to read the chain state");
+        // Fill in the count and hash now that they are known
+        header.nCoins = writer.nCoins;
+        header.hashSnapshot = writer.hasher.GetHash();
+        if (fseek(file.Get(), 0, SEEK_SET) != 0)
+            throw std::runtime_error("fseek failed");
+        file << header;
+        FileCommit(file.Get());
+    } catch (const std::exception& e) {
+        file.fclose();
+        boost::filesystem::remove(pathTmp);
+        strError = strprintf("Failed to write %s: %s", pathTmp.string(), e.what());
+        return false;
+    }
+    file.fclose();
+    if (!RenameOver(pathTmp, path)) {
+        strError = strprintf("Failed to rename %s to %s", pathTmp.string(), path.string());
+        return false;
+    }
+
+    info.hashBlock = header.hashBlock;
+    info.nHeight = pindex->nHeight;
+    info.nCoins = header.nCoins;
+    info.hashSnapshot = header.hashSnapshot;
+    LogPrintf("Wrote UTXO snapshot of %u coins at height %d (%s) to %s in %dms, hash %s\n", info.nCoins, info.nHeight,
+        info.hashBlock.ToString(), path.string(), GetTimeMillis() - nStart, info.hashSnapshot.ToString());
+    return true;
+}
+
+bool LoadTxOutSet(const boost::filesystem::path& path, const uint256& hashExpected, CTxOutSetSnapshotInfo& info, std::string& strError)
+{
+    CAutoFile file(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        strError = strprintf("Cannot open %s", path.string());
+        return false;
+    }
+    CTxOutSetSnapshotHeader header;
+    try {
+        file >> header;
+    } catch (const std::exception& e) {
+        strError = strprintf("%s is not a UTXO snapshot", path.string());
+        return false;
+    }
+    if (memcmp(header.pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE) != 0) {
+        strError = "The snapshot is for a different network";
+        return false;
+    }
+    if (header.nVersion != TXOUTSET_SNAPSHOT_VERSION) {
+        strError = strprintf("Unsupported snapshot version %d", header.nVersion);
+        return false;
+    }
+    if (header.hashSnapshot != hashExpected) {
+        strError = strprintf("Snapshot hash %s does not match the expected %s", header.hashSnapshot.ToString(), hashExpected.ToString());
+        return false;
+    }
+
+    CBlockIndex* pindexBase = NULL;
+    std::vector<CDiskBlockPos> vStoredBlocks;
+    {
+        LOCK(cs_main);
+        // The proof-of-stake checks of the blocks below the snapshot find
+        // the staked transactions through the transaction index, as their
+        // outputs may be spent by the time the blocks arrive.
+        if (!fTxIndex) {
+            strError = "Loading a UTXO snapshot requires -txindex";
+            return false;
+        }
+        BlockMap::iterator mi = mapBlockIndex.find(header.hashBlock);
+        if (mi == mapBlockIndex.end()) {
+            strError = strprintf("Snapshot base block %s is not known", header.hashBlock.ToString());
+            return false;
+        }
+        pindexBase = mi->second;
+        // Only the header chain up to the base is needed; blocks not stored yet
+        // are fetched once the snapshot is loaded.
+        if (!pindexBase->IsValid(BLOCK_VALID_TREE)) {
+            strError = strprintf("Snapshot base block %s is invalid", header.hashBlock.ToString());
+            return false;
+        }
+        if (chainActive.Height() > 0 || pindexTxOutSetLoading) {
+            strError = "The chain state is not empty";
+            return false;
+        }
+        // The chain state is incomplete until the flag is cleared again; if we
+        // stop before that, startup asks for -reindex-chainstate.
+        if (!pblocktree->WriteFlag("txoutsetloading", true) || !pblocktree->Sync()) {
+            strError = "Failed to write to block index";
+            return false;
+        }
+        // Keep ActivateBestChain from connecting blocks meanwhile; AcceptBlock
+        // indexes the blocks below the base that arrive from now on.
+        pindexTxOutSetLoading = pindexBase;
+        for (CBlockIndex* pindex = pindexBase; pindex->pprev; pindex = pindex->pprev) {
+            if ((pindex->nStatus & BLOCK_HAVE_DATA) && !(pindex->nStatus & BLOCK_HAVE_UNDO))
+                vStoredBlocks.push_back(pindex->GetBlockPos());
+        }
+    }
+
+    // The file is read and written to the chain state database without
+    // cs_main; blocks are not connected until the snapshot is installed.
+    int64_t nStart = GetTimeMillis();
+    uint256 hash;
+    try {
+        if (!ReadTxOutSetRecords(file, header, pindexBase->nHeight, hash, NULL) || hash != header.hashSnapshot) {
+            LOCK(cs_main);
+            pindexTxOutSetLoading = NULL;
+            pblocktree->WriteFlag("txoutsetloading", false);
+            strError = "The snapshot data does not match its hash";
+            return false;
+        }
+    } catch (const std::exception& e) {
+        LOCK(cs_main);
+        pindexTxOutSetLoading = NULL;
+        pblocktree->WriteFlag("txoutsetloading", false);
+        strError = strprintf("Failed to read %s: %s", path.string(), e.what());
+        return false;
+    }
+    LogPrintf("Verified UTXO snapshot %s: %u coins at height %d (%s) in %dms\n", hash.ToString(), header.nCoins,
+        pindexBase->nHeight, header.hashBlock.ToString(), GetTimeMillis() - nStart);
+
+    // Blocks below the base stored before the load were never connected, so
+    // they are not in the transaction index yet
+    BOOST_FOREACH (const CDiskBlockPos& pos, vStoredBlocks) {
+        CBlock block;
+        if (!ReadBlockFromDisk(block, pos) || !WriteBlockTxIndex(block, pos)) {
+            strError = "Failed to write the transaction index";
+            return AbortNode(strError);
+        }
+    }
+
+    // Flushes of this cache only write coins: it never fetches the best
+    // block, so the chain state keeps pointing at the genesis block.
+    CCoinsViewCache viewLoad(pcoinsWriter);
+    try {
+        CTxOutSetLoader loader(viewLoad);
+        if (fseek(file.Get(), ::GetSerializeSize(header, SER_DISK, CLIENT_VERSION), SEEK_SET) != 0 ||
+            !ReadTxOutSetRecords(file, header, pindexBase->nHeight, hash, &loader) || hash != header.hashSnapshot ||
+            !viewLoad.Flush()) {
+            strError = "Failed to load the snapshot into the chain state";
+            return AbortNode(strError);
+        }
+    } catch (const std::exception& e) {
+        strError = strprintf("Failed to load %s: %s", path.string(), e.what());
+        return AbortNode(strError);
+    }
+
+    LOCK(cs_main);
+    pindexTxOutSetLoading = NULL;
+
+    // The snapshot stands in for connecting every block up to its base. They
+    // are flagged rather than marked valid, as they have no undo data, and
+    // linked so that the chain can grow from the base before they all arrive.
+    pcoinsTip->SetBestBlock(header.hashBlock);
+    CCoinsRunningStats* pstats = pcoinsTip->RunningStats();
+    CCoinsRunningStats* pstatsLoaded = viewLoad.RunningStats();
+    if (pstats && pstatsLoaded)
+        *pstats = *pstatsLoaded;
+    std::vector<CBlockIndex*> vSnapshotChain;
+    for (CBlockIndex* pindex = pindexBase; pindex->pprev; pindex = pindex->pprev)
+        vSnapshotChain.push_back(pindex);
+    for (std::vector<CBlockIndex*>::reverse_iterator it = vSnapshotChain.rbegin(); it != vSnapshotChain.rend(); ++it) {
+        CBlockIndex* pindex = *it;
+        if (!(pindex->nStatus & BLOCK_HAVE_UNDO)) {
+            pindex->nStatus |= BLOCK_SNAPSHOT;
+            setDirtyBlockIndex.insert(pindex);
+        }
+        if (pindex->nChainTx == 0) {
+            // Not in mapBlocksUnlinked under its parent any more once linked
+            std::pair<std::multimap<CBlockIndex*, CBlockIndex*>::iterator, std::multimap<CBlockIndex*, CBlockIndex*>::iterator> range = mapBlocksUnlinked.equal_range(pindex->pprev);
+            while (range.first != range.second) {
+                std::multimap<CBlockIndex*, CBlockIndex*>::iterator itUnlinked = range.first;
+                range.first++;
+                if (itUnlinked->second == pindex)
+                    mapBlocksUnlinked.erase(itUnlinked);
+            }
+            LinkBlockIndex(pindex);
+        }
+    }
+    UpdateTip(pindexBase);
+    setBlockIndexCandidates.insert(pindexBase);
+    PruneBlockIndexCandidates();
+    nSnapshotFetchHeight = 1;
+    CValidationState state;
+    if (!FlushStateToDisk(state, FLUSH_STATE_ALWAYS)) {
+        strError = "Failed to flush the chain state";
+        return false;
+    }
+    if (!pblocktree->WriteFlag("txoutsetloading", false) || !pblocktree->Sync()) {
+        strError = "Failed to write to block index";
+        return AbortNode(strError);
+    }
+    uiInterface.NotifyBlockTip(header.hashBlock);
+
+    info.hashBlock = header.hashBlock;
+    info.nHeight = pindexBase->nHeight;
+    info.nCoins = header.nCoins;
+    info.hashSnapshot = header.hashSnapshot;
+    LogPrintf("Loaded UTXO snapshot of %u coins at height %d (%s) in %dms\n", info.nCoins, info.nHeight,
+        info.hashBlock.ToString(), GetTimeMillis() - nStart);
+    return true;
+}
+
 static void CheckBlockIndex()
 {
     if (!fCheckBlockIndex) return;
@@ -4134,16 +5539,20 @@ static void CheckBlockIndex()
     int nHeight = 0;
     CBlockIndex* pindexFirstInvalid = NULL;         // Oldest ancestor of pindex which is invalid.
     CBlockIndex* pindexFirstMissing = NULL;         // Oldest ancestor of pindex which does not have BLOCK_HAVE_DATA.
+    CBlockIndex* pindexFirstNeverProcessed = NULL;  // Oldest ancestor of pindex for which nTx == 0.
     CBlockIndex* pindexFirstNotTreeValid = NULL;    // Oldest ancestor of pindex which does not have BLOCK_VALID_TREE (regardless of being valid or not).
     CBlockIndex* pindexFirstNotChainValid = NULL;   // Oldest ancestor of pindex which does not have BLOCK_VALID_CHAIN (regardless of being valid or not).
     CBlockIndex* pindexFirstNotScriptsValid = NULL; // Oldest ancestor of pindex which does not have BLOCK_VALID_SCRIPTS (regardless of being valid or not).
     while (pindex != NULL) {
         nNodes++;
         if (pindexFirstInvalid == NULL && pindex->nStatus & BLOCK_FAILED_VALID) pindexFirstInvalid = pindex;
-        if (pindexFirstMissing == NULL && !(pindex->nStatus & BLOCK_HAVE_DATA)) pindexFirstMissing = pindex;
+        // Blocks below a UTXO snapshot count as linked and connected, whether or not their data is there.
+        bool fSnapshot = pindex->nStatus & BLOCK_SNAPSHOT;
+        if (pindexFirstMissing == NULL && !(pindex->nStatus & BLOCK_HAVE_DATA) && !fSnapshot) pindexFirstMissing = pindex;
+        if (pindexFirstNeverProcessed == NULL && pindex->nTx == 0 && !fSnapshot) pindexFirstNeverProcessed = pindex;
         if (pindex->pprev != NULL && pindexFirstNotTreeValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_TREE) pindexFirstNotTreeValid = pindex;
-        if (pindex->pprev != NULL && pindexFirstNotChainValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_CHAIN) pindexFirstNotChainValid = pindex;
-        if (pindex->pprev != NULL && pindexFirstNotScriptsValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_SCRIPTS) pindexFirstNotScriptsValid = pindex;
+        if (pindex->pprev != NULL && pindexFirstNotChainValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_CHAIN && !fSnapshot) pindexFirstNotChainValid = pindex;
+        if (pindex->pprev != NULL && pindexFirstNotScriptsValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_SCRIPTS && !fSnapshot) pindexFirstNotScriptsValid = pindex;
 
         // Begin: actual consistency checks.
         if (pindex->pprev == NULL) {
@@ -4152,12 +5561,20 @@ static void CheckBlockIndex()
             assert(pindex == chainActive.Genesis());                       // The current active chain's genesis block must be this block.
         }
 
-        // HAVE_DATA is equivalent to VALID_TRANSACTIONS and equivalent to nTx > 0 (we stored the number of transactions in the block)
-        assert(!(pindex->nStatus & BLOCK_HAVE_DATA) == (pindex->nTx == 0));
+        // VALID_TRANSACTIONS is equivalent to nTx > 0 for all nodes (whether or not pruning has occurred).
+        // HAVE_DATA is only equivalent to nTx > 0 (or VALID_TRANSACTIONS) if no pruning has occurred.
+        if (!fHavePruned) {
+            // If we've never pruned, then HAVE_DATA should be equivalent to nTx > 0
+            assert(!(pindex->nStatus & BLOCK_HAVE_DATA) == (pindex->nTx == 0));
+            assert(pindexFirstMissing == pindexFirstNeverProcessed);
+        } else {
+            // If we have pruned, then we can only say that HAVE_DATA implies nTx > 0
+            if (pindex->nStatus & BLOCK_HAVE_DATA) assert(pindex->nTx > 0);
+        }
         assert(((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS) == (pindex->nTx > 0));
         if (pindex->nChainTx == 0) assert(pindex->nSequenceId == 0); // nSequenceId can't be set for blocks that aren't linked
-        // All parents having data is equivalent to all parents being VALID_TRANSACTIONS, which is equivalent to nChainTx being set.
-        assert((pindexFirstMissing != NULL) == (pindex->nChainTx == 0));                                             // nChainTx == 0 is used to signal that all parent block's transaction data is available.
+        // All parents having had data (at some point) is equivalent to all parents being VALID_TRANSACTIONS, which is equivalent to nChainTx being set.
+        assert((pindexFirstNeverProcessed != NULL) == (pindex->nChainTx == 0));                                      // nChainTx != 0 is used to signal that all parent blocks have been processed (but may have been pruned).
         assert(pindex->nHeight == nHeight);                                                                          // nHeight must be consistent.
         assert(pindex->pprev == NULL || pindex->nChainWork >= pindex->pprev->nChainWork);                            // For every block except the genesis block, the chainwork must be larger than the parent's.
         assert(nHeight < 2 || (pindex->pskip && (pindex->pskip->nHeight < nHeight)));                                // The pskip pointer must point back for all but the first 2 blocks.
@@ -4169,11 +5586,20 @@ static void CheckBlockIndex()
             // Checks for not-invalid blocks.
             assert((pindex->nStatus & BLOCK_FAILED_MASK) == 0); // The failed mask cannot be set for blocks without invalid parents.
         }
-        if (!CBlockIndexWorkComparator()(pindex, chainActive.Tip()) && pindexFirstMissing == NULL) {
-            if (pindexFirstInvalid == NULL) { // If this block sorts at least as good as the current tip and is valid, it must be in setBlockIndexCandidates.
-                assert(setBlockIndexCandidates.count(pindex));
+        if (!CBlockIndexWorkComparator()(pindex, chainActive.Tip()) && pindexFirstNeverProcessed == NULL) {
+            if (pindexFirstInvalid == NULL) {
+                // If this block sorts at least as good as the current tip and
+                // is valid and we have all data for its parents, it must be in
+                // setBlockIndexCandidates. chainActive.Tip() must also be there
+                // even if some data has been pruned.
+                if (pindexFirstMissing == NULL || pindex == chainActive.Tip()) {
+                    assert(setBlockIndexCandidates.count(pindex));
+                }
+                // If some parent is missing, then it could be that this block was in
+                // setBlockIndexCandidates but had to be removed because of the missing data.
+                // In this case it must be in mapBlocksUnlinked -- see test below.
             }
-        } else { // If this block sorts worse than the current tip, it cannot be in setBlockIndexCandidates.
+        } else { // If this block sorts worse than the current tip or some ancestor's block has never been seen, it cannot be in setBlockIndexCandidates.
             assert(setBlockIndexCandidates.count(pindex) == 0);
         }
         // Check whether this block is in mapBlocksUnlinked.
@@ -4187,12 +5613,25 @@ static void CheckBlockIndex()
             }
             rangeUnlinked.first++;
         }
-        if (pindex->pprev && pindex->nStatus & BLOCK_HAVE_DATA && pindexFirstMissing != NULL) {
-            if (pindexFirstInvalid == NULL) { // If this block has block data available, some parent doesn't, and has no invalid parents, it must be in mapBlocksUnlinked.
-                assert(foundInUnlinked);
+        if (pindex->pprev && (pindex->nStatus & BLOCK_HAVE_DATA) && pindexFirstNeverProcessed != NULL && pindexFirstInvalid == NULL) {
+            // If this block has block data available, some parent was never received, and has no invalid parents, it must be in mapBlocksUnlinked.
+            assert(foundInUnlinked);
+        }
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA)) assert(!foundInUnlinked); // Can't be in mapBlocksUnlinked if we don't HAVE_DATA
+        if (pindexFirstMissing == NULL) assert(!foundInUnlinked);            // We aren't missing data for any parent -- cannot be in mapBlocksUnlinked.
+        if (pindex->pprev && (pindex->nStatus & BLOCK_HAVE_DATA) && pindexFirstNeverProcessed == NULL && pindexFirstMissing != NULL) {
+            // We HAVE_DATA for this block, have received data for all parents at some point, but we're currently missing data for some parent.
+            assert(fHavePruned); // We must have pruned.
+            // This block may have entered mapBlocksUnlinked if we tried switching
+            // to a better descendant but were missing data for some block between
+            // chainActive and it. So if this block is itself better than
+            // chainActive.Tip() and it wasn't in setBlockIndexCandidates, then it
+            // must be in mapBlocksUnlinked.
+            if (!CBlockIndexWorkComparator()(pindex, chainActive.Tip()) && setBlockIndexCandidates.count(pindex) == 0) {
+                if (pindexFirstInvalid == NULL) {
+                    assert(foundInUnlinked);
+                }
             }
-        } else { // If this block does not have block data available, or all parents do, it cannot be in mapBlocksUnlinked.
-            assert(!foundInUnlinked);
         }
         // assert(pindex->GetBlockHash() == pindex->GetBlockHeader().GetHash()); // Perhaps too slow
         // End: actual consistency checks.
@@ -4212,6 +5651,7 @@ static void CheckBlockIndex()
             // If pindex was the first with a certain property, unset the corresponding variable.
             if (pindex == pindexFirstInvalid) pindexFirstInvalid = NULL;
             if (pindex == pindexFirstMissing) pindexFirstMissing = NULL;
+            if (pindex == pindexFirstNeverProcessed) pindexFirstNeverProcessed = NULL;
             if (pindex == pindexFirstNotTreeValid) pindexFirstNotTreeValid = NULL;
             if (pindex == pindexFirstNotChainValid) pindexFirstNotChainValid = NULL;
             if (pindex == pindexFirstNotScriptsValid) pindexFirstNotScriptsValid = NULL;
@@ -4306,8 +5746,11 @@ bool static AlreadyHave(const CInv& inv)
     case MSG_TX: {
         bool txInMap = false;
         txInMap = mempool.exists(inv.hash);
+        // Only the first two outputs are probed: this is a cheap cache-only
+        // check for recently confirmed transactions, not an exhaustive one.
         return txInMap || mapOrphanTransactions.count(inv.hash) ||
-               pcoinsTip->HaveCoins(inv.hash);
+               pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 0)) ||
+               pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 1));
     }
     case MSG_BLOCK:
         return mapBlockIndex.count(inv.hash);
@@ -4326,14 +5769,58 @@ bool static AlreadyHave(const CInv& inv)
 }
 
 
+/**
+ * Serialized blocks recently sent to peers, least recently used evicted
+ * first once their total size exceeds RAW_BLOCK_CACHE_SIZE. New peers
+ * syncing from us tend to request the same recent blocks.
+ */
+class CRawBlockCache
+{
+private:
+    typedef std::pair<uint256, boost::shared_ptr<const CDataStream> > Entry;
+
+    CCriticalSection cs;
+    std::list<Entry> listBlocks;
+    std::map<uint256, std::list<Entry>::iterator> mapBlocks;
+    size_t nSize;
+
+public:
+    CRawBlockCache() : nSize(0) {}
+
+    boost::shared_ptr<const CDataStream> Get(const uint256& hash)
+    {
+        LOCK(cs);
+        std::map<uint256, std::list<Entry>::iterator>::iterator it = mapBlocks.find(hash);
+        if (it == mapBlocks.end())
+            return boost::shared_ptr<const CDataStream>();
+        listBlocks.splice(listBlocks.begin(), listBlocks, it->second);
+        return it->second->second;
+    }
+
+    void Insert(const uint256& hash, const boost::shared_ptr<const CDataStream>& block)
+    {
+        LOCK(cs);
+        if (mapBlocks.count(hash) || block->size() > RAW_BLOCK_CACHE_SIZE)
+            return;
+        listBlocks.push_front(Entry(hash, block));
+        mapBlocks[hash] = listBlocks.begin();
+        nSize += block->size();
+        while (nSize > RAW_BLOCK_CACHE_SIZE) {
+            nSize -= listBlocks.back().second->size();
+            mapBlocks.erase(listBlocks.back().first);
+            listBlocks.pop_back();
+        }
+    }
+};
+
+static CRawBlockCache rawBlockCache;
+
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
 
     vector<CInv> vNotFound;
 
-    LOCK(cs_main);
-
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->nSendSize >= SendBufferSize())
@@ -4344,32 +5831,67 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK) {
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK) {
                 bool send = false;
-                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end()) {
-                    if (chainActive.Contains(mi->second)) {
-                        send = true;
-                    } else {
-                        // To prevent fingerprinting attacks, only send blocks outside of the active
-                        // chain if they are valid, and no more than a max reorg depth than the best header
-                        // chain we know about.
-                        send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
-                               (chainActive.Height() - mi->second->nHeight < Params().MaxReorganizationDepth());
-                        if (!send) {
-                            LogPrintf("ProcessGetData(): ignoring request from peer=%i for old block that isn't in the main chain\n", pfrom->GetId());
+                bool fCompact = false;
+                CDiskBlockPos pos;
+                uint256 hashTip;
+                {
+                    LOCK(cs_main);
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end()) {
+                        if (chainActive.Contains(mi->second)) {
+                            send = true;
+                        } else {
+                            // To prevent fingerprinting attacks, only send blocks outside of the active
+                            // chain if they are valid, and no more than a max reorg depth than the best header
+                            // chain we know about.
+                            send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
+                                   (chainActive.Height() - mi->second->nHeight < Params().MaxReorganizationDepth());
+                            if (!send) {
+                                LogPrintf("ProcessGetData(): ignoring request from peer=%i for old block that isn't in the main chain\n", pfrom->GetId());
+                            }
                         }
+                        send = send && (mi->second->nStatus & BLOCK_HAVE_DATA);
+                        pos = mi->second->GetBlockPos();
+                        // Older blocks are not worth reconstructing from a
+                        // mempool that no longer has their transactions.
+                        fCompact = inv.type == MSG_CMPCT_BLOCK && mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH;
                     }
+                    hashTip = chainActive.Tip()->GetBlockHash();
                 }
-                if (send) {
-                    // Send block from disk
+                // Block data is never modified once written, so the disk read
+                // does not need cs_main.
+                if (send && (inv.type == MSG_BLOCK || (inv.type == MSG_CMPCT_BLOCK && !fCompact))) {
+                    // Send the serialized block as stored, without a CBlock round trip
+                    boost::shared_ptr<const CDataStream> block = rawBlockCache.Get(inv.hash);
+                    if (!block) {
+                        boost::shared_ptr<CDataStream> blockRead(new CDataStream(SER_NETWORK, PROTOCOL_VERSION));
+                        if (ReadRawBlockFromDisk(*blockRead, pos)) {
+                            block = blockRead;
+                            rawBlockCache.Insert(inv.hash, block);
+                        } else {
+                            LogPrintf("ProcessGetData(): cannot load block %s from disk\n", inv.hash.ToString());
+                        }
+                    }
+                    if (block)
+                        pfrom->PushMessage("block", *block);
+                    else
+                        send = false;
+                } else if (send && fCompact) {
                     CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
-                    else // MSG_FILTERED_BLOCK)
-                    {
+                    if (!ReadBlockFromDisk(block, pos) || block.GetHash() != inv.hash) {
+                        LogPrintf("ProcessGetData(): cannot load block %s from disk\n", inv.hash.ToString());
+                        send = false;
+                    } else {
+                        pfrom->PushMessage("cmpctblock", CBlockHeaderAndShortTxIDs(block));
+                    }
+                } else if (send) {
+                    CBlock block;
+                    if (!ReadBlockFromDisk(block, pos) || block.GetHash() != inv.hash) {
+                        LogPrintf("ProcessGetData(): cannot load block %s from disk\n", inv.hash.ToString());
+                        send = false;
+                    } else {
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter) {
                             CMerkleBlock merkleBlock(block, *pfrom->pfilter);
@@ -4388,19 +5910,19 @@ void static ProcessGetData(CNode* pfrom)
                         // else
                         // no response
                     }
-
-                    // Trigger them to send a getblocks request for the next batch of inventory
-                    if (inv.hash == pfrom->hashContinue) {
-                        // Bypass PushInventory, this must send even if redundant,
-                        // and we want it right after the last block so they don't
-                        // wait for other stuff first.
-                        vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
-                        pfrom->PushMessage("inv", vInv);
-                        pfrom->hashContinue = 0;
-                    }
+                }
+                // Trigger them to send a getblocks request for the next batch of inventory
+                if (send && inv.hash == pfrom->hashContinue) {
+                    // Bypass PushInventory, this must send even if redundant,
+                    // and we want it right after the last block so they don't
+                    // wait for other stuff first.
+                    vector<CInv> vInv;
+                    vInv.push_back(CInv(MSG_BLOCK, hashTip));
+                    pfrom->PushMessage("inv", vInv);
+                    pfrom->hashContinue = 0;
                 }
             } else if (inv.IsKnownType()) {
+                LOCK(cs_main);
                 // Send stream from relay memory
                 bool pushed = false;
                 {
@@ -4468,7 +5990,7 @@ void static ProcessGetData(CNode* pfrom)
             // Track requests for our stuff.
             g_signals.Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -4487,6 +6009,33 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+/**
+ * Validate a block received from a peer, whether sent in full or rebuilt
+ * from a cmpctblock. A peer that gives us a new tip is asked to push its
+ * next blocks as cmpctblock.
+ */
+void static ProcessBlockFromPeer(CNode* pfrom, CBlock& block)
+{
+    CInv inv(MSG_BLOCK, block.GetHash());
+    pfrom->AddInventoryKnown(inv);
+
+    CValidationState state;
+    ProcessNewBlock(state, pfrom, &block);
+    int nDoS;
+    if (state.IsInvalid(nDoS)) {
+        pfrom->PushMessage("reject", string("block"), state.GetRejectCode(),
+            state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
+        if (nDoS > 0) {
+            TRY_LOCK(cs_main, lockMain);
+            if (lockMain) Misbehaving(pfrom->GetId(), nDoS);
+        }
+    } else {
+        LOCK(cs_main);
+        if (!IsInitialBlockDownload() && chainActive.Tip()->GetBlockHash() == inv.hash)
+            MaybeSetPeerAsAnnouncingHeaderAndIDs(pfrom);
+    }
+}
+
 static bool ProcessMessage(CNode* pfrom, const string &strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     RandAddSeedPerfmon();
@@ -4623,6 +6172,25 @@ static bool ProcessMessage(CNode* pfrom, const string &strCommand, CDataStream&
             LOCK(cs_main);
             State(pfrom->GetId())->fCurrentlyConnected = true;
         }
+
+        if (pfrom->nVersion >= SHORT_IDS_BLOCKS_VERSION) {
+            // Tell the peer we understand cmpctblock, but don't want new
+            // blocks pushed unasked until it has given us one.
+            bool fAnnounceUsingCMPCTBLOCK = false;
+            uint64_t nCMPCTBLOCKVersion = 1;
+            pfrom->PushMessage("sendcmpct", fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+        }
+    }
+
+
+    else if (strCommand == "sendcmpct") {
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 0;
+        vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+        if (nCMPCTBLOCKVersion == 1) {
+            pfrom->fProvidesHeaderAndIDs = true;
+            pfrom->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
+        }
     }
 
 
@@ -4731,6 +6299,11 @@ static bool ProcessMessage(CNode* pfrom, const string &strCommand, CDataStream&
             }
         }
 
+        // A lone new block near the tip is fetched as a cmpctblock; batches
+        // are answers to getblocks and are better downloaded in full.
+        if (vToFetch.size() == 1 && pfrom->fProvidesHeaderAndIDs && !IsInitialBlockDownload())
+            vToFetch[0].type = MSG_CMPCT_BLOCK;
+
         if (!vToFetch.empty())
             pfrom->PushMessage("getdata", vToFetch);
     }
@@ -4860,7 +6433,7 @@ static bool ProcessMessage(CNode* pfrom, const string &strCommand, CDataStream&
             LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s : accepted %s (poolsz %u)\n",
                 pfrom->id, pfrom->cleanSubVer,
                 tx.GetHash().ToString(),
-                mempool.mapTx.size());
+                mempool.size());
 
             // Recursively process any orphan transactions that depended on this one
             set<NodeId> setMisbehaving;
@@ -4950,6 +6523,14 @@ static bool ProcessMessage(CNode* pfrom, const string &strCommand, CDataStream&
             ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
         }
 
+        // Hash the whole message at once, before taking cs_main.
+        std::vector<const CBlockHeader*> vpHeaders(nCount);
+        std::vector<uint256> vHashes(nCount);
+        for (unsigned int n = 0; n < nCount; n++)
+            vpHeaders[n] = &headers[n];
+        if (nCount > 0)
+            Phi1612Batch(&vpHeaders[0], nCount, &vHashes[0]);
+
         LOCK(cs_main);
 
         if (nCount == 0) {
@@ -4957,13 +6538,21 @@ static bool ProcessMessage(CNode* pfrom, const string &strCommand, CDataStream&
             return true;
         }
         CBlockIndex* pindexLast = NULL;
-        BOOST_FOREACH (const CBlockHeader& header, headers) {
+        for (unsigned int n = 0; n < nCount; n++) {
+            const CBlockHeader& header = headers[n];
             CValidationState state;
             if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
                 Misbehaving(pfrom->GetId(), 20);
                 return error("non-continuous headers sequence");
             }
 
+            // Already known: this is all AcceptBlockHeader would do for it.
+            BlockMap::iterator mi = mapBlockIndex.find(vHashes[n]);
+            if (mi != mapBlockIndex.end()) {
+                pindexLast = mi->second;
+                continue;
+            }
+
             /*TODO: this has a CBlock cast on it so that it will compile. There should be a solution for this
              * before headers are reimplemented on mainnet
              */
@@ -4972,7 +6561,7 @@ static bool ProcessMessage(CNode* pfrom, const string &strCommand, CDataStream&
                 if (state.IsInvalid(nDoS)) {
                     if (nDoS > 0)
                         Misbehaving(pfrom->GetId(), nDoS);
-                    std::string strError = "invalid header received " + header.GetHash().ToString();
+                    std::string strError = "invalid header received " + vHashes[n].ToString();
                     return error(strError.c_str());
                 }
             }
@@ -5012,21 +6601,169 @@ static bool ProcessMessage(CNode* pfrom, const string &strCommand, CDataStream&
                 pfrom->vBlockRequested.push_back(hashBlock);
             }
         } else {
-            pfrom->AddInventoryKnown(inv);
+            ProcessBlockFromPeer(pfrom, block);
+        }
+
+    }
+
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+        uint256 hashBlock = cmpctblock.header.GetHash();
+        LogPrint("net", "received cmpctblock %s peer=%d\n", hashBlock.ToString(), pfrom->id);
+
+        CBlock block;
+        bool fBlockReconstructed = false;
+        {
+            LOCK(cs_main);
+            pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hashBlock));
+            UpdateBlockAvailability(pfrom->GetId(), hashBlock);
+
+            BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+            if (mi != mapBlockIndex.end() && (mi->second->nStatus & BLOCK_HAVE_DATA))
+                return true;
 
+            if (!mapBlockIndex.count(cmpctblock.header.hashPrevBlock)) {
+                // We are missing blocks before this one; sync up as for a full block
+                pfrom->PushMessage("getblocks", chainActive.GetLocator(), hashBlock);
+                return true;
+            }
+
+            // Check the header before spending any work on the rest, so a
+            // peer cannot make us scan the mempool for made-up blocks.
+            CBlock blockHeader = cmpctblock.GetHeaderBlock();
             CValidationState state;
-            ProcessNewBlock(state, pfrom, &block);
-            int nDoS;
-            if (state.IsInvalid(nDoS)) {
-                pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                    state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-                if (nDoS > 0) {
-                    TRY_LOCK(cs_main, lockMain);
-                    if (lockMain) Misbehaving(pfrom->GetId(), nDoS);
-                }
+            CBlockIndex* pindex = NULL;
+            if (!AcceptBlockHeader(blockHeader, state, &pindex)) {
+                int nDoS;
+                if (state.IsInvalid(nDoS) && nDoS > 0)
+                    Misbehaving(pfrom->GetId(), nDoS);
+                return error("Peer %d sent us a compact block with an invalid header %s", pfrom->id, hashBlock.ToString());
+            }
+
+            vector<CInv> vGetData(1, CInv(MSG_BLOCK, hashBlock));
+            if (cmpctblock.header.hashPrevBlock != chainActive.Tip()->GetBlockHash()) {
+                // Only blocks on our tip are likely to be in our mempool
+                pfrom->PushMessage("getdata", vGetData);
+                return true;
+            }
+
+            // On our tip the coinstake's inputs are known, so the proof of
+            // stake can be checked as well as the difficulty and signature.
+            // The prefilled coinstake is not yet committed to by the merkle
+            // root, so the proof is not cached and a failure only means we
+            // fetch the full block instead.
+            if (!CheckWork(blockHeader, chainActive.Tip(), false) || !blockHeader.CheckBlockSignature()) {
+                LogPrint("net", "Peer %d sent us a compact block with unverifiable proof %s\n", pfrom->id, hashBlock.ToString());
+                pfrom->PushMessage("getdata", vGetData);
+                return true;
+            }
+
+            CNodeState* nodestate = State(pfrom->GetId());
+            boost::shared_ptr<PartiallyDownloadedBlock> partialBlock(new PartiallyDownloadedBlock(&mempool));
+            ReadStatus status = partialBlock->InitData(cmpctblock);
+            if (status == READ_STATUS_INVALID) {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("Peer %d sent us invalid compact block\n", pfrom->id);
+            } else if (status == READ_STATUS_FAILED) {
+                pfrom->PushMessage("getdata", vGetData);
+                return true;
+            }
+
+            BlockTransactionsRequest req;
+            for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+                if (!partialBlock->IsTxAvailable(i))
+                    req.indexes.push_back(i);
+            }
+            if (req.indexes.empty()) {
+                status = partialBlock->FillBlock(block, vector<CTransaction>());
+                if (status == READ_STATUS_OK)
+                    fBlockReconstructed = true;
+                else
+                    pfrom->PushMessage("getdata", vGetData);
+            } else {
+                req.blockhash = hashBlock;
+                nodestate->partialBlock = partialBlock;
+                nodestate->hashPartialBlock = hashBlock;
+                pfrom->PushMessage("getblocktxn", req);
             }
         }
 
+        if (fBlockReconstructed)
+            ProcessBlockFromPeer(pfrom, block);
+    }
+
+
+    else if (strCommand == "getblocktxn") {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        CDiskBlockPos pos;
+        {
+            LOCK(cs_main);
+            BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+            if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA)) {
+                LogPrint("net", "Peer %d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+                return true;
+            }
+
+            if (mi->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+                // Too old to be worth reconstructing; answer with the full block
+                pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+                return true;
+            }
+            pos = mi->second->GetBlockPos();
+        }
+
+        CBlock block;
+        if (!ReadBlockFromDisk(block, pos) || block.GetHash() != req.blockhash)
+            return error("cannot load block %s from disk", req.blockhash.ToString());
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
+                LOCK(cs_main);
+                Misbehaving(pfrom->GetId(), 100);
+                return error("Peer %d sent us a getblocktxn with out-of-bounds tx indices", pfrom->id);
+            }
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        CBlock block;
+        bool fBlockRead = false;
+        {
+            LOCK(cs_main);
+            CNodeState* nodestate = State(pfrom->GetId());
+            if (!nodestate->partialBlock || nodestate->hashPartialBlock != resp.blockhash) {
+                LogPrint("net", "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->id);
+                return true;
+            }
+
+            ReadStatus status = nodestate->partialBlock->FillBlock(block, resp.txn);
+            nodestate->partialBlock.reset();
+            nodestate->hashPartialBlock = uint256(0);
+            if (status == READ_STATUS_INVALID) {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("Peer %d sent us invalid compact block/non-matching block transactions", pfrom->id);
+            } else if (status == READ_STATUS_FAILED) {
+                // Might have collided, fall back to getdata now
+                vector<CInv> vGetData(1, CInv(MSG_BLOCK, resp.blockhash));
+                pfrom->PushMessage("getdata", vGetData);
+            } else {
+                fBlockRead = true;
+            }
+        }
+
+        if (fBlockRead)
+            ProcessBlockFromPeer(pfrom, block);
     }
 
 
@@ -5639,6 +7376,30 @@ bool CBlockUndo::WriteToDisk(CDiskBlockPos& pos, const uint256& hashBlock)
 
 bool CBlockUndo::ReadFromDisk(const CDiskBlockPos& pos, const uint256& hashBlock)
 {
+    boost::shared_ptr<const CMappedFile> mapped;
+    const char *pbegin, *pend;
+    if (GetMappedRecord(pos, "rev", sizeof(uint256), mapped, pbegin, pend)) {
+        uint256 hashChecksum;
+        try {
+            CBufferReader filein(pbegin, pend + sizeof(uint256), SER_DISK, CLIENT_VERSION);
+            filein >> *this;
+            if (filein.tell() != (size_t)(pend - pbegin))
+                return error("CBlockUndo::ReadFromDisk : Size mismatch");
+            filein >> hashChecksum;
+        } catch (std::exception& e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+
+        // The checksum covers the serialized undo data, which is exactly
+        // what is on disk, so hash that rather than serializing again.
+        CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
+        hasher << hashBlock;
+        hasher.write(pbegin, pend - pbegin);
+        if (hashChecksum != hasher.GetHash())
+            return error("CBlockUndo::ReadFromDisk : Checksum mismatch");
+        return true;
+    }
+
     // Open history file to read
     CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
     if (filein.IsNull())
@@ -5676,10 +7437,8 @@ public:
     ~CMainCleanup()
     {
         // block headers
-        BlockMap::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
         mapBlockIndex.clear();
+        blockIndexArena.Clear();
 
         // orphan transactions
         mapOrphanTransactions.clear();
@@ -16,6 +16,7 @@
 #include "primitives/block.h"
 #include "primitives/transaction.h"
 #include "timedata.h"
+#include "txmempool.h"
 #include "util.h"
 #include "utilmoneystr.h"
 #include "masternode.h"
@@ -23,8 +24,13 @@
 #include "wallet.h"
 #endif
 
+#include <algorithm>
+#include <limits>
+
+#include <boost/multi_index/identity.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+#include <boost/multi_index_container.hpp>
 #include <boost/thread.hpp>
-#include <boost/tuple/tuple.hpp>
 
 using namespace std;
 
@@ -43,52 +49,146 @@ extern unsigned int nMinerSleep;
 //
 
 //
-// Unconfirmed transactions in the memory pool often depend on other
-// transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
-// The COrphan class keeps track of these 'temporary orphans' while
-// CreateBlock is figuring out which transactions to include.
+// Transactions are taken from the memory pool as packages: a transaction
+// together with its in-mempool ancestors, ranked by the fee rate of the whole
+// package. The mempool maintains its ancestor_score index as entries are
+// added and removed, so selection walks that index from the top and stops
+// once the block is full, instead of rebuilding a priority queue over the
+// whole pool. When a package is added to the block, the ancestor state of
+// its in-mempool descendants changes; those descendants are tracked with
+// adjusted totals in mapModifiedTx and compete with the unmodified entries.
 //
-class COrphan
-{
-public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    CFeeRate feeRate;
-    double dPriority;
+// Before that, the first -blockprioritysize bytes of the block are given to
+// the transactions of highest coin age priority, down to the AllowFree
+// threshold.
+//
+struct CTxMemPoolModifiedEntry {
+    CTxMemPoolModifiedEntry(CTxMemPool::txiter entry)
+    {
+        iter = entry;
+        nSizeWithAncestors = entry->GetSizeWithAncestors();
+        nModFeesWithAncestors = entry->GetModFeesWithAncestors();
+    }
 
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
+    CTxMemPool::txiter iter;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+};
+
+/** Comparator for CTxMemPool::txiter objects, by address of the entry. */
+struct CompareCTxMemPoolIter {
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
     {
+        return &(*a) < &(*b);
     }
 };
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
-int64_t nLastCoinStakeSearchInterval = 0;
+struct modifiedentry_iter {
+    typedef CTxMemPool::txiter result_type;
+    result_type operator()(const CTxMemPoolModifiedEntry& entry) const
+    {
+        return entry.iter;
+    }
+};
 
-// We want to sort transactions by priority and fee rate, so:
-typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
-class TxPriorityCompare
-{
-    bool byFee;
+/** Same ordering as CompareTxMemPoolEntryByAncestorFee, on the adjusted totals. */
+struct CompareModifiedEntry {
+    bool operator()(const CTxMemPoolModifiedEntry& a, const CTxMemPoolModifiedEntry& b) const
+    {
+        double f1 = (double)a.nModFeesWithAncestors * b.nSizeWithAncestors;
+        double f2 = (double)b.nModFeesWithAncestors * a.nSizeWithAncestors;
+        if (f1 == f2)
+            return CTxMemPool::CompareIteratorByHash()(a.iter, b.iter);
+        return f1 > f2;
+    }
+};
+
+/** Orders a package so that parents come before their children. */
+struct CompareTxIterByAncestorCount {
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
+    {
+        if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        return CTxMemPool::CompareIteratorByHash()(a, b);
+    }
+};
+
+typedef boost::multi_index_container<
+    CTxMemPoolModifiedEntry,
+    boost::multi_index::indexed_by<
+        boost::multi_index::ordered_unique<
+            modifiedentry_iter,
+            CompareCTxMemPoolIter>,
+        // sorted by modified ancestor fee rate
+        boost::multi_index::ordered_non_unique<
+            // Reuse same tag from CTxMemPool's similar index
+            boost::multi_index::tag<ancestor_score>,
+            boost::multi_index::identity<CTxMemPoolModifiedEntry>,
+            CompareModifiedEntry> > >
+    indexed_modified_transaction_set;
+
+/** A mempool entry with its coin age priority, for the priority area. */
+typedef std::pair<double, CTxMemPool::txiter> TxCoinAgePriority;
+
+/** Max-heap order on priority, ties broken by txid. */
+struct TxCoinAgePriorityCompare {
+    bool operator()(const TxCoinAgePriority& a, const TxCoinAgePriority& b) const
+    {
+        if (a.first == b.first)
+            return CTxMemPool::CompareIteratorByHash()(b.second, a.second);
+        return a.first < b.first;
+    }
+};
 
-public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) {}
+typedef indexed_modified_transaction_set::nth_index<0>::type::iterator modtxiter;
+typedef indexed_modified_transaction_set::index<ancestor_score>::type::iterator modtxscoreiter;
 
-    bool operator()(const TxPriority& a, const TxPriority& b)
+struct update_for_parent_inclusion {
+    update_for_parent_inclusion(CTxMemPool::txiter it) : iter(it) {}
+
+    void operator()(CTxMemPoolModifiedEntry& e)
     {
-        if (byFee) {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
-        } else {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
-        }
+        e.nModFeesWithAncestors -= iter->GetModifiedFee();
+        e.nSizeWithAncestors -= iter->GetTxSize();
     }
+
+    CTxMemPool::txiter iter;
+};
+
+/**
+ * Transactions chosen for the last template. It is reused by the next call
+ * with the same tip, mempool (GetTransactionsUpdated), size, priority area
+ * and fee limits and kind of block, for at most MAX_TEMPLATE_SELECTION_AGE seconds, and as
+ * long as its transactions are still final. Protected by cs_main.
+ */
+struct CTemplateSelection {
+    bool fValid;
+    uint256 hashPrevBlock;
+    unsigned int nTransactionsUpdated;
+    unsigned int nBlockMaxSize;
+    unsigned int nBlockMinSize;
+    unsigned int nBlockPrioritySize;
+    CAmount nMinTxFee;
+    CAmount nMaxTxFee;
+    bool fProofOfStake;
+    int64_t nTime;
+    std::vector<CTransaction> vtx;
+    std::vector<CAmount> vTxFees;
+    std::vector<int64_t> vTxSigOps;
+    uint64_t nBlockSize;
+    int nBlockSigOps;
+    CAmount nFees;
+
+    CTemplateSelection() : fValid(false), nTransactionsUpdated(0), nBlockMaxSize(0), nBlockMinSize(0), nBlockPrioritySize(0), nMinTxFee(0), nMaxTxFee(0),
+                           fProofOfStake(false), nTime(0), nBlockSize(0), nBlockSigOps(0), nFees(0) {}
 };
+static CTemplateSelection templateSelection;
+/** Transactions whose lock time passes are only picked up by a new selection */
+static const int64_t MAX_TEMPLATE_SELECTION_AGE = 30;
+
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+int64_t nLastCoinStakeSearchInterval = 0;
 
 void UpdateTime(CBlockHeader* pblock, const CBlockIndex* pindexPrev)
 {
@@ -103,6 +203,316 @@ void UpdateTime(CBlockHeader* pblock, const CBlockIndex* pindexPrev)
         pblock->nBits = GetNextWorkRequired(pindexPrev, pblock);
 }
 
+/**
+ * Add descendants of the given transactions to mapModifiedTx with ancestor
+ * state updated assuming the given transactions are in the block.
+ */
+static void UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set& mapModifiedTx)
+{
+    BOOST_FOREACH (const CTxMemPool::txiter it, alreadyAdded) {
+        CTxMemPool::setEntries descendants;
+        mempool.CalculateDescendants(it, descendants);
+        // Insert all descendants (not yet in block) into the modified set
+        BOOST_FOREACH (CTxMemPool::txiter desc, descendants) {
+            if (alreadyAdded.count(desc))
+                continue;
+            modtxiter mit = mapModifiedTx.find(desc);
+            if (mit == mapModifiedTx.end()) {
+                CTxMemPoolModifiedEntry modEntry(desc);
+                modEntry.nSizeWithAncestors -= it->GetTxSize();
+                modEntry.nModFeesWithAncestors -= it->GetModifiedFee();
+                mapModifiedTx.insert(modEntry);
+            } else {
+                mapModifiedTx.modify(mit, update_for_parent_inclusion(it));
+            }
+        }
+    }
+}
+
+/**
+ * Skip entries in mapTx that are already in the block, have been evaluated
+ * and failed, or are present in mapModifiedTx (which holds their current
+ * ancestor state).
+ */
+static bool SkipMapTxEntry(CTxMemPool::txiter it, const indexed_modified_transaction_set& mapModifiedTx, const CTxMemPool::setEntries& inBlock, const CTxMemPool::setEntries& failedTx)
+{
+    return mapModifiedTx.count(it) || inBlock.count(it) || failedTx.count(it);
+}
+
+/**
+ * Connect the transactions of a package, parents first, to viewPackage and
+ * check that each is valid in the next block and within the fee and sigop
+ * limits given what is already selected.
+ */
+static bool TestPackage(const std::vector<CTxMemPool::txiter>& vPackage, CCoinsViewCache& viewPackage, const CTemplateSelection& selection, int nHeight, CAmount nMinTxFee, CAmount nMaxTxFee, std::vector<CAmount>& vTxFees, std::vector<int64_t>& vTxSigOps)
+{
+    CAmount nFees = selection.nFees;
+    int nBlockSigOps = selection.nBlockSigOps;
+    BOOST_FOREACH (CTxMemPool::txiter it, vPackage) {
+        const CTransaction& tx = it->GetTx();
+        if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
+            return false;
+
+        // Legacy limits on sigOps:
+        unsigned int nTxSigOps = GetLegacySigOpCount(tx);
+        if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            return false;
+
+        if (!viewPackage.HaveInputs(tx))
+            return false;
+
+        CAmount nTxFees = viewPackage.GetValueIn(tx) - tx.GetValueOut();
+        if (nTxFees < nMinTxFee || nMaxTxFee <= nTxFees || MAX_BK_FEE < (nFees + nTxFees)) {
+            LogPrint("debug", "%s: bad tx fee (%d, %d, [%d, %d])\n", __func__, nFees, nTxFees, nMinTxFee, nMaxTxFee);
+            return false;
+        }
+
+        nTxSigOps += GetP2SHSigOpCount(tx, viewPackage);
+        if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            return false;
+
+        // Note that flags: we don't want to set mempool/IsStandard()
+        // policy here, but we still have to ensure that the block we
+        // create only contains transactions that are valid in new blocks.
+        CValidationState state;
+        if (!CheckInputs(tx, state, viewPackage, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
+            return false;
+
+        CTxUndo txundo;
+        UpdateCoins(tx, state, viewPackage, txundo, nHeight);
+        if (!state.IsValid()) {
+            LogPrint("debug", "%s: update coins failed (nHeight=%d, reason: %s)", __func__, nHeight, state.GetRejectReason());
+            return false;
+        } else if (!CheckTransaction(tx, state)) {
+            LogPrint("debug", "%s: invalid coins (nHeight=%d, reason: %s)", __func__, nHeight, state.GetRejectReason());
+            return false;
+        }
+
+        vTxFees.push_back(nTxFees);
+        vTxSigOps.push_back(nTxSigOps);
+        nFees += nTxFees;
+        nBlockSigOps += nTxSigOps;
+    }
+    return true;
+}
+
+/** Append a package that passed TestPackage to the selection. */
+static void AddPackage(CTemplateSelection& selection, const std::vector<CTxMemPool::txiter>& vPackage, const std::vector<CAmount>& vTxFees, const std::vector<int64_t>& vTxSigOps, CTxMemPool::setEntries& inBlock)
+{
+    for (size_t i = 0; i < vPackage.size(); i++) {
+        selection.vtx.push_back(vPackage[i]->GetTx());
+        selection.vTxFees.push_back(vTxFees[i]);
+        selection.vTxSigOps.push_back(vTxSigOps[i]);
+        selection.nBlockSize += vPackage[i]->GetTxSize();
+        selection.nBlockSigOps += vTxSigOps[i];
+        selection.nFees += vTxFees[i];
+        inBlock.insert(vPackage[i]);
+    }
+}
+
+/** Coin age priority of a mempool entry in the next block, with any prioritisetransaction delta. */
+static double GetEntryPriority(CTxMemPool::txiter it, int nHeight)
+{
+    double dPriority = it->GetPriority(nHeight);
+    CAmount nFeeDelta = 0;
+    mempool.ApplyDeltas(it->GetTx().GetHash(), dPriority, nFeeDelta);
+    return dPriority;
+}
+
+/**
+ * Fill the first nBlockPrioritySize bytes of the block with the transactions
+ * of highest coin age priority above AllowFreeThreshold(). A transaction becomes
+ * a candidate once its in-mempool parents are all in the block. This looks at
+ * every mempool entry, so it is skipped when the area is 0.
+ */
+static void AddPriorityTxs(CTemplateSelection& selection, CCoinsViewCache& view, int nHeight, unsigned int nBlockPrioritySize, CAmount nMinTxFee, CAmount nMaxTxFee, CTxMemPool::setEntries& inBlock)
+{
+    AssertLockHeld(mempool.cs);
+
+    if (nBlockPrioritySize == 0)
+        return;
+    bool fPrintPriority = GetBoolArg("-printpriority", false);
+
+    std::vector<TxCoinAgePriority> vecPriority;
+    vecPriority.reserve(mempool.mapTx.size());
+    for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi) {
+        if (mempool.GetMemPoolParents(mi).empty())
+            vecPriority.push_back(TxCoinAgePriority(GetEntryPriority(mi, nHeight), mi));
+    }
+    TxCoinAgePriorityCompare comparer;
+    std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+
+    while (!vecPriority.empty()) {
+        std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
+        double dPriority = vecPriority.back().first;
+        CTxMemPool::txiter iter = vecPriority.back().second;
+        vecPriority.pop_back();
+
+        // Everything else has a lower priority
+        if (selection.nBlockSize + iter->GetTxSize() >= nBlockPrioritySize || !AllowFree(dPriority))
+            return;
+
+        std::vector<CTxMemPool::txiter> vPackage(1, iter);
+        CCoinsViewCache viewPackage(&view);
+        std::vector<CAmount> vTxFees;
+        std::vector<int64_t> vTxSigOps;
+        if (!TestPackage(vPackage, viewPackage, selection, nHeight, nMinTxFee, nMaxTxFee, vTxFees, vTxSigOps))
+            continue;
+        viewPackage.Flush();
+        AddPackage(selection, vPackage, vTxFees, vTxSigOps, inBlock);
+
+        if (fPrintPriority) {
+            LogPrintf("priority %.1f fee %s txid %s\n", dPriority, CFeeRate(iter->GetModifiedFee(), iter->GetTxSize()).ToString(), iter->GetTx().GetHash().ToString());
+        }
+
+        BOOST_FOREACH (CTxMemPool::txiter child, mempool.GetMemPoolChildren(iter)) {
+            bool fParentsInBlock = true;
+            BOOST_FOREACH (CTxMemPool::txiter parent, mempool.GetMemPoolParents(child)) {
+                if (!inBlock.count(parent)) {
+                    fParentsInBlock = false;
+                    break;
+                }
+            }
+            if (fParentsInBlock) {
+                vecPriority.push_back(TxCoinAgePriority(GetEntryPriority(child, nHeight), child));
+                std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
+            }
+        }
+    }
+}
+
+/**
+ * Fill selection with mempool packages in ancestor fee rate order until the
+ * block is full, after the priority area. Past the priority area, the work
+ * done is proportional to the number of packages looked at, not to the size
+ * of the mempool.
+ */
+static void SelectTransactions(CTemplateSelection& selection, CCoinsViewCache& view, int nHeight, unsigned int nBlockMaxSize, unsigned int nBlockMinSize, unsigned int nBlockPrioritySize, CAmount nMinTxFee, CAmount nMaxTxFee)
+{
+    AssertLockHeld(mempool.cs);
+
+    // Limit the number of attempts to add transactions to the block when it
+    // is close to full; this is just a simple heuristic to finish quickly if
+    // the mempool has a lot of entries.
+    const int64_t MAX_CONSECUTIVE_FAILURES = 1000;
+    int64_t nConsecutiveFailed = 0;
+    bool fPrintPriority = GetBoolArg("-printpriority", false);
+
+    indexed_modified_transaction_set mapModifiedTx;
+    // Keep track of entries that failed inclusion, to avoid duplicate work
+    CTxMemPool::setEntries failedTx;
+    CTxMemPool::setEntries inBlock;
+
+    AddPriorityTxs(selection, view, nHeight, nBlockPrioritySize, nMinTxFee, nMaxTxFee, inBlock);
+    // Descendants of the priority area compete with adjusted ancestor state
+    UpdatePackagesForAdded(inBlock, mapModifiedTx);
+
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = mempool.mapTx.get<ancestor_score>().begin();
+    CTxMemPool::txiter iter;
+    while (mi != mempool.mapTx.get<ancestor_score>().end() || !mapModifiedTx.empty()) {
+        // First try to find a new transaction in mapTx to evaluate.
+        if (mi != mempool.mapTx.get<ancestor_score>().end() &&
+            SkipMapTxEntry(mempool.mapTx.project<0>(mi), mapModifiedTx, inBlock, failedTx)) {
+            ++mi;
+            continue;
+        }
+
+        // Now that mi is not stale, determine which transaction to evaluate:
+        // the next entry from mapTx, or the best from mapModifiedTx?
+        bool fUsingModified = false;
+
+        modtxscoreiter modit = mapModifiedTx.get<ancestor_score>().begin();
+        if (mi == mempool.mapTx.get<ancestor_score>().end()) {
+            // We're out of entries in mapTx; use the entry from mapModifiedTx
+            iter = modit->iter;
+            fUsingModified = true;
+        } else {
+            // Try to compare the mapTx entry to the mapModifiedTx entry
+            iter = mempool.mapTx.project<0>(mi);
+            if (modit != mapModifiedTx.get<ancestor_score>().end() &&
+                CompareModifiedEntry()(*modit, CTxMemPoolModifiedEntry(iter))) {
+                // The best entry in mapModifiedTx has higher score
+                // than the one from mapTx.
+                // Switch which transaction (package) to consider
+                iter = modit->iter;
+                fUsingModified = true;
+            } else {
+                // Either no entry in mapModifiedTx, or it's worse than mapTx.
+                // Increment mi for the next loop iteration.
+                ++mi;
+            }
+        }
+
+        // We skip mapTx entries that are inBlock, and mapModifiedTx shouldn't
+        // contain anything that is inBlock.
+        assert(!inBlock.count(iter));
+
+        uint64_t packageSize = iter->GetSizeWithAncestors();
+        CAmount packageFees = iter->GetModFeesWithAncestors();
+        if (fUsingModified) {
+            packageSize = modit->nSizeWithAncestors;
+            packageFees = modit->nModFeesWithAncestors;
+        }
+
+        // Everything else we might consider has a lower fee rate
+        if (packageFees < ::minRelayTxFee.GetFee(packageSize) && selection.nBlockSize + packageSize >= nBlockMinSize)
+            return;
+
+        bool fAdded = false;
+        if (selection.nBlockSize + packageSize < nBlockMaxSize) {
+            CTxMemPool::setEntries ancestors;
+            uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+            std::string dummy;
+            mempool.CalculateMemPoolAncestors(*iter, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+            // Ancestors already in the block are no longer part of the package
+            for (CTxMemPool::setEntries::iterator ait = ancestors.begin(); ait != ancestors.end();) {
+                if (inBlock.count(*ait))
+                    ancestors.erase(ait++);
+                else
+                    ++ait;
+            }
+            ancestors.insert(iter);
+
+            std::vector<CTxMemPool::txiter> vPackage(ancestors.begin(), ancestors.end());
+            std::sort(vPackage.begin(), vPackage.end(), CompareTxIterByAncestorCount());
+
+            CCoinsViewCache viewPackage(&view);
+            std::vector<CAmount> vTxFees;
+            std::vector<int64_t> vTxSigOps;
+            if (TestPackage(vPackage, viewPackage, selection, nHeight, nMinTxFee, nMaxTxFee, vTxFees, vTxSigOps)) {
+                viewPackage.Flush();
+                AddPackage(selection, vPackage, vTxFees, vTxSigOps, inBlock);
+                if (fPrintPriority) {
+                    BOOST_FOREACH (CTxMemPool::txiter it, vPackage)
+                        LogPrintf("fee %s txid %s\n", CFeeRate(it->GetModifiedFee(), it->GetTxSize()).ToString(), it->GetTx().GetHash().ToString());
+                }
+                // Update transactions that depend on each of these
+                UpdatePackagesForAdded(ancestors, mapModifiedTx);
+                fAdded = true;
+            }
+        }
+
+        if (!fAdded) {
+            if (fUsingModified) {
+                // Since we always look at the best entry in mapModifiedTx,
+                // we must erase failed entries so that we can consider the
+                // next best entry on the next loop iteration
+                mapModifiedTx.get<ancestor_score>().erase(modit);
+                failedTx.insert(iter);
+            }
+
+            ++nConsecutiveFailed;
+            if (nConsecutiveFailed > MAX_CONSECUTIVE_FAILURES && selection.nBlockSize > nBlockMaxSize - 4000) {
+                // Give up if we're close to full and haven't succeeded in a while
+                return;
+            }
+            continue;
+        }
+
+        nConsecutiveFailed = 0;
+    }
+}
+
 CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet, bool fProofOfStake)
 {
     CReserveKey reservekey(pwallet);
@@ -149,16 +559,16 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
     // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
     nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE - 1000), nBlockMaxSize));
 
+    // Minimum block size you want to create; block will be filled with transactions
+    // below the relay fee until there are no more or the block reaches this size:
+    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
+    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+
     // How much of the block should be dedicated to high-priority transactions,
-    // included regardless of the fees they pay
+    // ordered by coin age priority rather than fee rate
     unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
     nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
 
-    // Minimum block size you want to create; block will be filled with free transactions
-    // until there are no more or the block reaches this size:
-    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
-    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
-
     // Fee-per-kilobyte amount considered the same as "free"
     // Be careful setting this: if you set it to zero then
     // a transaction spammer can cheaply fill blocks using
@@ -178,7 +588,6 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
 
     pblock->nBits = GetNextWorkRequired(chainActive.Tip(), pblock, fProofOfStake);
 
-    // Collect memory pool transactions into the block
     CAmount nFees = 0;
 
     {
@@ -186,180 +595,58 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
 
         CBlockIndex* pindexPrev = chainActive.Tip();
         const int nHeight = pindexPrev->nHeight + 1;
-        CCoinsViewCache view(pcoinsTip);
-
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority", false);
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi) {
-            const CTransaction& tx = mi->second.GetTx();
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
-                continue;
 
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH (const CTxIn& txin, tx.vin) {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash)) {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash)) {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan) {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
-                    continue;
+        bool fReuse = templateSelection.fValid &&
+                      templateSelection.hashPrevBlock == pindexPrev->GetBlockHash() &&
+                      templateSelection.nTransactionsUpdated == mempool.GetTransactionsUpdated() &&
+                      templateSelection.nBlockMaxSize == nBlockMaxSize &&
+                      templateSelection.nBlockMinSize == nBlockMinSize &&
+                      templateSelection.nBlockPrioritySize == nBlockPrioritySize &&
+                      templateSelection.nMinTxFee == nMinTxFee &&
+                      templateSelection.nMaxTxFee == nMaxTxFee &&
+                      templateSelection.fProofOfStake == fProofOfStake &&
+                      GetTime() - templateSelection.nTime < MAX_TEMPLATE_SELECTION_AGE;
+        // Lock times were checked against the time of the selection
+        if (fReuse) {
+            BOOST_FOREACH (const CTransaction& tx, templateSelection.vtx) {
+                if (!IsFinalTx(tx, nHeight)) {
+                    fReuse = false;
+                    break;
                 }
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
-
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = nHeight - coins->nHeight;
-
-                dPriority += (double)nValueIn * nConf;
             }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
-
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
-
-            CFeeRate feeRate(nTotalIn - tx.GetValueOut(), nTxSize);
-
-            if (porphan) {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
-            } else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->second.GetTx()));
         }
-
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty()) {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritise by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee && ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority))) {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            if (!view.HaveInputs(tx))
-                continue;
-
-            CAmount nTxFees = view.GetValueIn(tx) - tx.GetValueOut();
-            if (nTxFees < nMinTxFee || nMaxTxFee <= nTxFees || MAX_BK_FEE < (nFees+nTxFees)) {
-                LogPrint("debug", "%s: bad tx fee (%d, %d, [%d, %d])\n", __func__, nFees, nTxFees, nMinTxFee, nMaxTxFee);
-                continue;
-            }
-            
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            CValidationState state;
-            if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
-                continue;
-
-            CTxUndo txundo;
-            UpdateCoins(tx, state, view, txundo, nHeight);
-            if (!state.IsValid()) {
-                LogPrint("debug", "%s: update coins failed (nHeight=%d, reason: %s)", __func__, nHeight, state.GetRejectReason());
-                continue;
-            } else if (!CheckTransaction(tx, state)) {
-                LogPrint("debug", "%s: invalid coins (nHeight=%d, reason: %s)", __func__, nHeight, state.GetRejectReason());
-                continue;
-            }
-
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            if (fPrintPriority) {
-                LogPrintf("priority %.1f fee %s txid %s\n", dPriority, feeRate.ToString(), tx.GetHash().ToString());
-            }
-
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash)) {
-                BOOST_FOREACH (COrphan* porphan, mapDependers[hash]) {
-                    if (!porphan->setDependsOn.empty()) {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty()) {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
+        if (!fReuse) {
+            int64_t nTimeStart = GetTimeMicros();
+            CTemplateSelection selection;
+            selection.hashPrevBlock = pindexPrev->GetBlockHash();
+            selection.nTransactionsUpdated = mempool.GetTransactionsUpdated();
+            selection.nBlockMaxSize = nBlockMaxSize;
+            selection.nBlockMinSize = nBlockMinSize;
+            selection.nBlockPrioritySize = nBlockPrioritySize;
+            selection.nMinTxFee = nMinTxFee;
+            selection.nMaxTxFee = nMaxTxFee;
+            selection.fProofOfStake = fProofOfStake;
+            selection.nTime = GetTime();
+            selection.nBlockSize = 1000;
+            selection.nBlockSigOps = 100;
+
+            CCoinsViewCache view(pcoinsTip);
+            SelectTransactions(selection, view, nHeight, nBlockMaxSize, nBlockMinSize, nBlockPrioritySize, nMinTxFee, nMaxTxFee);
+            selection.fValid = true;
+            templateSelection = selection;
+            LogPrint("bench", "%s: selected %u of %u mempool txs in %.2fms\n", __func__,
+                selection.vtx.size(), mempool.size(), 0.001 * (GetTimeMicros() - nTimeStart));
         }
 
+        // Collect memory pool transactions into the block
+        const CTemplateSelection& selection = templateSelection;
+        pblock->vtx.insert(pblock->vtx.end(), selection.vtx.begin(), selection.vtx.end());
+        pblocktemplate->vTxFees.insert(pblocktemplate->vTxFees.end(), selection.vTxFees.begin(), selection.vTxFees.end());
+        pblocktemplate->vTxSigOps.insert(pblocktemplate->vTxSigOps.end(), selection.vTxSigOps.begin(), selection.vTxSigOps.end());
+        uint64_t nBlockSize = selection.nBlockSize;
+        uint64_t nBlockTx = selection.vtx.size();
+        nFees = selection.nFees;
+
         if (nBlockSize < nBlockMinSize || nBlockMaxSize < nBlockSize) {
             LogPrintf("%s: bad block size (nBlockSize=%d, [%d, %d])", __func__, nBlockSize, nBlockMinSize, nBlockMaxSize);
             return nullptr;
@@ -403,6 +690,8 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
 
         CValidationState state;
         if (!TestBlockValidity(state, *pblock, pindexPrev, false, false)) {
+            // Do not hand the same selection to the next caller
+            templateSelection.fValid = false;
             if (!fProofOfStake) LogPrintf("%s: TestBlockValidity failed (%s)\n", __func__, ct);
             return nullptr;
         }
@@ -28,6 +28,10 @@
 #include <fcntl.h>
 #endif
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniupnpc.h>
 #include <miniupnpc/miniwget.h>
@@ -62,6 +66,7 @@ using namespace std;
 namespace
 {
 const int MAX_OUTBOUND_CONNECTIONS = 16;
+const int MAX_SOCKET_EVENTS = 256;
 
 struct ListenSocket {
     SOCKET socket;
@@ -114,6 +119,55 @@ boost::condition_variable messageHandlerCondition;
 static CNodeSignals g_signals;
 CNodeSignals& GetNodeSignals() { return g_signals; }
 
+#ifdef HAVE_SYS_EPOLL_H
+// epoll instance watching the listening and peer sockets, -1 if select() is used
+static int hEpollSocket = -1;
+#endif
+
+bool InitSocketEvents()
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (hEpollSocket == -1)
+        hEpollSocket = epoll_create1(EPOLL_CLOEXEC);
+    return hEpollSocket != -1;
+#else
+    return false;
+#endif
+}
+
+static bool UseSocketEvents()
+{
+#ifdef HAVE_SYS_EPOLL_H
+    return hEpollSocket != -1;
+#else
+    return false;
+#endif
+}
+
+// select() can only watch descriptors below FD_SETSIZE
+static bool IsUsableSocket(SOCKET hSocket)
+{
+    return UseSocketEvents() || IsSelectableSocket(hSocket);
+}
+
+// Register a new peer socket with epoll. Readiness is edge-triggered and
+// tracked in the CNode until a recv or send would block.
+static bool AddSocketEvents(CNode* pnode)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (hEpollSocket == -1)
+        return true;
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = pnode;
+    if (epoll_ctl(hEpollSocket, EPOLL_CTL_ADD, pnode->hSocket, &event) == SOCKET_ERROR) {
+        LogPrintf("socket epoll_ctl error %s\n", NetworkErrorString(WSAGetLastError()));
+        return false;
+    }
+#endif
+    return true;
+}
+
 void AddOneShot(string strDest)
 {
     LOCK(cs_vOneShots);
@@ -414,7 +468,7 @@ CNode* ConnectNode(CAddress addrConnect, const char* pszDest, bool darkSendMaste
     bool proxyConnectionFailed = false;
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
                   ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed)) {
-        if (!IsSelectableSocket(hSocket)) {
+        if (!IsUsableSocket(hSocket)) {
             LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
             CloseSocket(hSocket);
             return NULL;
@@ -425,6 +479,8 @@ CNode* ConnectNode(CAddress addrConnect, const char* pszDest, bool darkSendMaste
         // Add node
         CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
         pnode->AddRef();
+        if (!AddSocketEvents(pnode))
+            pnode->CloseSocketDisconnect();
 
         {
             LOCK(cs_vNodes);
@@ -701,6 +757,18 @@ static list<CNode*> vNodesDisconnected;
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+#ifdef HAVE_SYS_EPOLL_H
+    if (hEpollSocket != -1) {
+        // Listening sockets are level-triggered and tagged with a NULL node
+        BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.ptr = NULL;
+            if (epoll_ctl(hEpollSocket, EPOLL_CTL_ADD, hListenSocket.socket, &event) == SOCKET_ERROR)
+                LogPrintf("socket epoll_ctl error %s\n", NetworkErrorString(WSAGetLastError()));
+        }
+    }
+#endif
     while (true) {
         //
         // Disconnect nodes
@@ -783,20 +851,31 @@ void ThreadSocketHandler()
         SOCKET hSocketMax = 0;
         bool have_fds = false;
 
-        BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
+        // With epoll, sockets are registered once and readiness is kept in
+        // the CNode, so only the wanted direction is decided here.
+        const bool fSocketEvents = UseSocketEvents();
+        bool fSocketsPending = false;
+
+        if (!fSocketEvents) {
+            BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
+                FD_SET(hListenSocket.socket, &fdsetRecv);
+                hSocketMax = max(hSocketMax, hListenSocket.socket);
+                have_fds = true;
+            }
         }
 
         {
             LOCK(cs_vNodes);
             BOOST_FOREACH (CNode* pnode, vNodes) {
+                pnode->fSocketWantRecv = false;
+                pnode->fSocketWantSend = false;
                 if (pnode->hSocket == INVALID_SOCKET)
                     continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
+                if (!fSocketEvents) {
+                    FD_SET(pnode->hSocket, &fdsetError);
+                    hSocketMax = max(hSocketMax, pnode->hSocket);
+                    have_fds = true;
+                }
 
                 // Implement the following logic:
                 // * If there is data to send, select() for sending data. As this only
@@ -815,41 +894,87 @@ void ThreadSocketHandler()
                 // * We process a message in the buffer (message handler thread).
                 {
                     TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
+                    if (lockSend && !pnode->vSendMsg.empty())
+                        pnode->fSocketWantSend = true;
                 }
-                {
+                if (!pnode->fSocketWantSend) {
                     TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                     if (lockRecv && (pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
                                         pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
+                        pnode->fSocketWantRecv = true;
+                }
+
+                if (fSocketEvents) {
+                    // Still ready from an earlier edge: don't wait for a new one
+                    if ((pnode->fSocketWantSend && pnode->fSocketWritable) ||
+                        (pnode->fSocketWantRecv && pnode->fSocketReadable) || pnode->fSocketError)
+                        fSocketsPending = true;
+                } else if (pnode->fSocketWantSend) {
+                    FD_SET(pnode->hSocket, &fdsetSend);
+                } else if (pnode->fSocketWantRecv) {
+                    FD_SET(pnode->hSocket, &fdsetRecv);
                 }
             }
         }
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-            &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
+        bool fAcceptPending = false;
+        if (fSocketEvents) {
+#ifdef HAVE_SYS_EPOLL_H
+            struct epoll_event events[MAX_SOCKET_EVENTS];
+            int nEvents = epoll_wait(hEpollSocket, events, MAX_SOCKET_EVENTS, fSocketsPending ? 0 : timeout.tv_usec / 1000);
+            boost::this_thread::interruption_point();
 
-        if (nSelect == SOCKET_ERROR) {
-            if (have_fds) {
+            if (nEvents == SOCKET_ERROR) {
                 int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
+                if (nErr != WSAEINTR) {
+                    LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(nErr));
+                    MilliSleep(timeout.tv_usec / 1000);
+                }
+                nEvents = 0;
+            }
+            // Nodes are only deleted by this thread, after their socket has
+            // been closed, so every pointer returned here is still valid.
+            for (int i = 0; i < nEvents; i++) {
+                CNode* pnode = (CNode*)events[i].data.ptr;
+                if (pnode == NULL) {
+                    fAcceptPending = true;
+                    continue;
+                }
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP))
+                    pnode->fSocketReadable = true;
+                if (events[i].events & EPOLLOUT)
+                    pnode->fSocketWritable = true;
+                if (events[i].events & (EPOLLERR | EPOLLHUP))
+                    pnode->fSocketError = true;
+            }
+#endif
+        } else {
+            int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+            boost::this_thread::interruption_point();
+
+            if (nSelect == SOCKET_ERROR) {
+                if (have_fds) {
+                    int nErr = WSAGetLastError();
+                    LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+                    for (unsigned int i = 0; i <= hSocketMax; i++)
+                        FD_SET(i, &fdsetRecv);
+                }
+                FD_ZERO(&fdsetSend);
+                FD_ZERO(&fdsetError);
+                MilliSleep(timeout.tv_usec / 1000);
             }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec / 1000);
         }
 
         //
         // Accept new connections
         //
         BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv)) {
+            if (hListenSocket.socket == INVALID_SOCKET)
+                continue;
+            // epoll reports that some listening socket is ready; accept()
+            // on the others fails with WSAEWOULDBLOCK
+            if (fSocketEvents ? fAcceptPending : FD_ISSET(hListenSocket.socket, &fdsetRecv)) {
                 struct sockaddr_storage sockaddr;
                 socklen_t len = sizeof(sockaddr);
                 SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
@@ -872,7 +997,7 @@ void ThreadSocketHandler()
                     int nErr = WSAGetLastError();
                     if (nErr != WSAEWOULDBLOCK)
                         LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
-                } else if (!IsSelectableSocket(hSocket)) {
+                } else if (!IsUsableSocket(hSocket)) {
                     LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
                     CloseSocket(hSocket);
                 } else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS) {
@@ -885,6 +1010,8 @@ void ThreadSocketHandler()
                     CNode* pnode = new CNode(hSocket, addr, "", true);
                     pnode->AddRef();
                     pnode->fWhitelisted = whitelisted;
+                    if (!AddSocketEvents(pnode))
+                        pnode->CloseSocketDisconnect();
 
                     {
                         LOCK(cs_vNodes);
@@ -912,9 +1039,18 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError)) {
+            bool fRecvReady, fSendReady;
+            if (fSocketEvents) {
+                fRecvReady = (pnode->fSocketWantRecv && pnode->fSocketReadable) || pnode->fSocketError;
+                fSendReady = pnode->fSocketWantSend && pnode->fSocketWritable;
+            } else {
+                fRecvReady = FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError);
+                fSendReady = FD_ISSET(pnode->hSocket, &fdsetSend);
+            }
+            if (fRecvReady) {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv) {
+                    pnode->fSocketError = false;
                     {
                         // typical socket buffer is 8K-64K
                         char pchBuf[0x10000];
@@ -933,6 +1069,8 @@ void ThreadSocketHandler()
                         } else if (nBytes < 0) {
                             // error
                             int nErr = WSAGetLastError();
+                            if (nErr == WSAEWOULDBLOCK)
+                                pnode->fSocketReadable = false;
                             if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
                                 //if (!pnode->fDisconnect)
                                   //  LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
@@ -948,10 +1086,14 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend)) {
+            if (fSendReady) {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
+                if (lockSend) {
                     SocketSendData(pnode);
+                    // Anything left means the send buffer is full
+                    if (!pnode->vSendMsg.empty())
+                        pnode->fSocketWritable = false;
+                }
             }
 
             //
@@ -1670,6 +1812,11 @@ public:
         vNodes.clear();
         vNodesDisconnected.clear();
         vhListenSocket.clear();
+#ifdef HAVE_SYS_EPOLL_H
+        if (hEpollSocket != -1)
+            close(hEpollSocket);
+        hEpollSocket = -1;
+#endif
         delete semOutbound;
         semOutbound = NULL;
         delete pnodeLocalHost;
@@ -2001,10 +2148,17 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
+    fSocketWantRecv = false;
+    fSocketWantSend = false;
+    fSocketReadable = false;
+    fSocketWritable = false;
+    fSocketError = false;
     hashContinue = 0;
     nStartingHeight = -1;
     fGetAddr = false;
     fRelayTxes = false;
+    fProvidesHeaderAndIDs = false;
+    fPreferHeaderAndIDs = false;
     setInventoryKnown.max_size(SendBufferSize() / 1000);
     pfilter = new CBloomFilter();
     nPingNonceSent = 0;
@@ -80,6 +80,12 @@ unsigned short GetListenPort();
 bool BindListenPort(const CService& bindAddr, std::string& strError, bool fWhitelisted = false);
 void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
+/**
+ * Set up the epoll socket event backend where available. Returns false if
+ * ThreadSocketHandler will use select(), which limits descriptors to
+ * FD_SETSIZE.
+ */
+bool InitSocketEvents();
 void SocketSendData(CNode* pnode);
 
 typedef int NodeId;
@@ -229,6 +235,15 @@ public:
     std::deque<CSerializeData> vSendMsg;
     CCriticalSection cs_vSend;
 
+    // Readiness state used by ThreadSocketHandler only. With epoll the
+    // socket is registered edge-triggered, so readable/writable stay set
+    // until a recv or send would block.
+    bool fSocketWantRecv;
+    bool fSocketWantSend;
+    bool fSocketReadable;
+    bool fSocketWritable;
+    bool fSocketError;
+
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
@@ -259,6 +274,10 @@ public:
     // b) the peer may tell us in their version message that we should not relay tx invs
     //    until they have initialized their bloom filter.
     bool fRelayTxes;
+    // Set by the peer's sendcmpct: whether it understands cmpctblock (BIP 152),
+    // and whether it wants new blocks pushed to it as cmpctblock right away.
+    bool fProvidesHeaderAndIDs;
+    bool fPreferHeaderAndIDs;
     // Should be 'true' only if we connected to this node to actually mix funds.
     // In this case node will be released automatically via CMasternodeMan::ProcessMasternodeConnections().
     // Connecting to verify connectability/status or connecting for sending/relaying single message
@@ -5,6 +5,7 @@
 
 #include "primitives/block.h"
 
+#include "crypto/phi1612.h"
 #include "hash.h"
 #include "script/standard.h"
 #include "script/sign.h"
@@ -12,8 +13,133 @@
 #include "utilstrencodings.h"
 #include "util.h"
 
-uint256 CBlockHeader::GetHash() const{
-    return Phi1612(BEGIN(nVersion), END(nNonce));
+#include <atomic>
+#include <string.h>
+
+static std::atomic<uint64_t> nPhi1612Evaluations(0);
+
+uint64_t GetPhi1612EvaluationCount()
+{
+    return nPhi1612Evaluations.load(std::memory_order_relaxed);
+}
+
+CHeaderHashCache::CHeaderHashCache(const CHeaderHashCache& other) : fValid(false)
+{
+    lock.clear();
+    *this = other;
+}
+
+CHeaderHashCache& CHeaderHashCache::operator=(const CHeaderHashCache& other)
+{
+    if (this == &other)
+        return *this;
+    // Copy out under the source's lock first, so the two are never held together
+    unsigned char vchHeaderCopy[sizeof(vchHeader)];
+    uint256 hashCopy;
+    other.Lock();
+    bool fValidCopy = other.fValid;
+    if (fValidCopy) {
+        memcpy(vchHeaderCopy, other.vchHeader, sizeof(vchHeader));
+        hashCopy = other.hash;
+    }
+    other.Unlock();
+    if (fValidCopy)
+        Set(vchHeaderCopy, hashCopy);
+    else
+        Clear();
+    return *this;
+}
+
+bool CHeaderHashCache::Get(const unsigned char* header, uint256& hashOut) const
+{
+    Lock();
+    bool fHit = fValid && memcmp(vchHeader, header, sizeof(vchHeader)) == 0;
+    if (fHit)
+        hashOut = hash;
+    Unlock();
+    return fHit;
+}
+
+void CHeaderHashCache::Set(const unsigned char* header, const uint256& hashIn)
+{
+    static_assert(sizeof(vchHeader) == PHI1612_HEADER_SIZE, "header hash key size mismatch");
+    Lock();
+    memcpy(vchHeader, header, sizeof(vchHeader));
+    hash = hashIn;
+    fValid = true;
+    Unlock();
+}
+
+void CHeaderHashCache::Clear()
+{
+    Lock();
+    fValid = false;
+    Unlock();
+}
+
+uint256 CBlockHeader::GetHash() const
+{
+    uint256 hash;
+    if (hashCache.Get((const unsigned char*)BEGIN(nVersion), hash))
+        return hash;
+    nPhi1612Evaluations.fetch_add(1, std::memory_order_relaxed);
+    hash = Phi1612(BEGIN(nVersion), END(nNonce));
+    hashCache.Set((const unsigned char*)BEGIN(nVersion), hash);
+    return hash;
+}
+
+void CBlockHeader::SetCachedHash(const uint256& hash) const
+{
+    hashCache.Set((const unsigned char*)BEGIN(nVersion), hash);
+}
+
+void Phi1612Batch(const CBlockHeader* const headers[], size_t n, uint256 out[])
+{
+    if (n == 0)
+        return;
+    std::vector<const unsigned char*> vIn(n);
+    for (size_t i = 0; i < n; i++)
+        vIn[i] = (const unsigned char*)BEGIN(headers[i]->nVersion);
+    Phi1612Batch(&vIn[0], n, (unsigned char*)&out[0]);
+    nPhi1612Evaluations.fetch_add(n, std::memory_order_relaxed);
+    for (size_t i = 0; i < n; i++)
+        headers[i]->SetCachedHash(out[i]);
+}
+
+uint256 MerkleHash(const uint256& left, const uint256& right)
+{
+    unsigned char in[64];
+    memcpy(in, left.begin(), 32);
+    memcpy(in + 32, right.begin(), 32);
+    uint256 hash;
+    SHA256D64(hash.begin(), in, 1);
+    return hash;
+}
+
+uint256 ComputeMerkleTreeLevels(std::vector<uint256>& vTree, bool* fMutated)
+{
+    static_assert(sizeof(uint256) == 32, "merkle levels are hashed as packed 64-byte pairs");
+    vTree.reserve(vTree.size() * 2 + 16); // Safe upper bound for the number of total nodes.
+    size_t j = 0;
+    bool mutated = false;
+    for (size_t nSize = vTree.size(); nSize > 1; nSize = (nSize + 1) / 2) {
+        if (nSize % 2 == 0 && vTree[j + nSize - 2] == vTree[j + nSize - 1]) {
+            // Two identical hashes at the end of the list at a particular level.
+            mutated = true;
+        }
+        // The pairs of this level are adjacent in vTree, so they are hashed
+        // straight into the next level; an odd last node is paired with itself.
+        size_t nNext = vTree.size();
+        vTree.resize(nNext + (nSize + 1) / 2);
+        SHA256D64(vTree[nNext].begin(), vTree[j].begin(), nSize / 2);
+        if (nSize % 2)
+            vTree.back() = MerkleHash(vTree[j + nSize - 1], vTree[j + nSize - 1]);
+        j += nSize;
+    }
+    if (fMutated) {
+        *fMutated = mutated;
+    }
+    return (vTree.empty() ? 0 : vTree.back());
 }
 
 uint256 CBlock::BuildMerkleTree(bool* fMutated) const
@@ -57,26 +183,7 @@ uint256 CBlock::BuildMerkleTree(bool* fMutated) const
     vMerkleTree.reserve(vtx.size() * 2 + 16); // Safe upper bound for the number of total nodes.
     for (std::vector<CTransaction>::const_iterator it(vtx.begin()); it != vtx.end(); ++it)
         vMerkleTree.push_back(it->GetHash());
-    int j = 0;
-    bool mutated = false;
-    for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
-    {
-        for (int i = 0; i < nSize; i += 2)
-        {
-            int i2 = std::min(i+1, nSize-1);
-            if (i2 == i + 1 && i2 + 1 == nSize && vMerkleTree[j+i] == vMerkleTree[j+i2]) {
-                // Two identical hashes at the end of the list at a particular level.
-                mutated = true;
-            }
-            vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                       BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
-        }
-        j += nSize;
-    }
-    if (fMutated) {
-        *fMutated = mutated;
-    }
-    return (vMerkleTree.empty() ? 0 : vMerkleTree.back());
+    return ComputeMerkleTreeLevels(vMerkleTree, fMutated);
 }
 
 std::vector<uint256> CBlock::GetMerkleBranch(int nIndex) const
@@ -102,9 +209,9 @@ uint256 CBlock::CheckMerkleBranch(uint256 hash, const std::vector<uint256>& vMer
     for (std::vector<uint256>::const_iterator it(vMerkleBranch.begin()); it != vMerkleBranch.end(); ++it)
     {
         if (nIndex & 1)
-            hash = Hash(BEGIN(*it), END(*it), BEGIN(hash), END(hash));
+            hash = MerkleHash(*it, hash);
         else
-            hash = Hash(BEGIN(hash), END(hash), BEGIN(*it), END(*it));
+            hash = MerkleHash(hash, *it);
         nIndex >>= 1;
     }
     return hash;
@@ -11,9 +11,43 @@
 #include "serialize.h"
 #include "uint256.h"
 
+#include <atomic>
+
 /** The maximum allowed size for a serialized block, in bytes (network rule) */
 static const unsigned int MAX_BLOCK_SIZE = 6000000;
 
+/**
+ * Memoized header hash, keyed by the header bytes it was computed from.
+ * The same block is hashed from several threads at once (import, script
+ * checks, block relay), so the entry is guarded by a spinlock that is held
+ * only while it is copied, never while hashing.
+ */
+class CHeaderHashCache
+{
+public:
+    CHeaderHashCache() : fValid(false) { lock.clear(); }
+    CHeaderHashCache(const CHeaderHashCache& other);
+    CHeaderHashCache& operator=(const CHeaderHashCache& other);
+
+    /** Whether header is the cached one; if so hash is set to its hash. */
+    bool Get(const unsigned char* header, uint256& hash) const;
+    void Set(const unsigned char* header, const uint256& hash);
+    void Clear();
+
+private:
+    mutable std::atomic_flag lock;
+    unsigned char vchHeader[80];
+    uint256 hash;
+    bool fValid;
+
+    void Lock() const
+    {
+        while (lock.test_and_set(std::memory_order_acquire)) {
+        }
+    }
+    void Unlock() const { lock.clear(std::memory_order_release); }
+};
+
 /** Nodes collect new transactions into a block, hash them into a hash tree,
  * and scan through nonce values to make the block's hash satisfy proof-of-work
  * requirements.  When they solve the proof-of-work, they broadcast the block
@@ -60,6 +94,7 @@ public:
         nTime = 0;
         nBits = 0;
         nNonce = 0;
+        hashCache.Clear();
     }
 
     bool IsNull() const
@@ -67,14 +102,55 @@ public:
         return (nBits == 0);
     }
 
+    /**
+     * PHI1612 hash of the header. The result is memoized together with the
+     * header bytes it was computed from; any change to a header field
+     * (including direct assignment, as the miner does with nNonce and nTime)
+     * makes the next call recompute. Safe to call concurrently on the same
+     * object, as long as no thread modifies the header meanwhile.
+     */
     uint256 GetHash() const;
 
+    /** Seed the memoized hash; hash must be the PHI1612 of the current fields. */
+    void SetCachedHash(const uint256& hash) const;
+
     int64_t GetBlockTime() const
     {
         return (int64_t)nTime;
     }
+
+private:
+    mutable CHeaderHashCache hashCache;
 };
 
+/**
+ * Compute the hashes of n headers at once; out[i] == headers[i]->GetHash().
+ * Uses the multi-buffer PHI1612 backends, so callers that have many headers
+ * in hand (header sync, reindex, block index loading) should prefer this over
+ * calling GetHash() in a loop.
+ */
+void Phi1612Batch(const CBlockHeader* const headers[], size_t n, uint256 out[]);
+
+/**
+ * Number of PHI1612 header hashes actually computed (memoization misses and
+ * batch entries) by all threads of the process. Differences across a code path
+ * give the cost of that path, e.g. per block accepted in ProcessNewBlock,
+ * including hashes done for it on helper threads (and any done concurrently
+ * for other work).
+ */
+uint64_t GetPhi1612EvaluationCount();
+
+/** The merkle tree node above left and right: the double SHA256 of the pair. */
+uint256 MerkleHash(const uint256& left, const uint256& right);
+
+/**
+ * Extend vTree, which holds the leaves of a merkle tree, with every level
+ * above them up to the root, in the layout of CBlock::vMerkleTree. The pairs
+ * of each level are hashed in one SHA256D64 batch. Returns the root, or 0
+ * without leaves; *fMutated is set as in CBlock::BuildMerkleTree.
+ */
+uint256 ComputeMerkleTreeLevels(std::vector<uint256>& vTree, bool* fMutated = NULL);
+
 
 class CBlock : public CBlockHeader
 {
@@ -88,6 +164,9 @@ public:
     // memory only
     mutable CScript payee;
     mutable std::vector<uint256> vMerkleTree;
+    // Set once CheckBlock has passed with all checks enabled, so later calls
+    // on the same (unmodified) block can skip the merkle tree and tx checks.
+    mutable bool fChecked;
 
     CBlock()
     {
@@ -127,18 +206,13 @@ public:
         vMerkleTree.clear();
         payee = CScript();
         vchBlockSig.clear();
+        fChecked = false;
     }
 
     CBlockHeader GetBlockHeader() const
     {
-        CBlockHeader block;
-        block.nVersion       = nVersion;
-        block.hashPrevBlock  = hashPrevBlock;
-        block.hashMerkleRoot = hashMerkleRoot;
-        block.nTime          = nTime;
-        block.nBits          = nBits;
-        block.nNonce         = nNonce;
-        return block;
+        // Copy the base subobject so the memoized hash travels with it.
+        return *this;
     }
 
     // ppcoin: two types of block: proof-of-work or proof-of-stake
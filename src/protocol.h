@@ -71,6 +71,9 @@ enum {
     // Bitcoin Core nodes used to support this by default, without advertising this bit,
     // but no longer do as of protocol version 70011 (= NO_BLOOM_VERSION)
     NODE_BLOOM = (1 << 2),
+    // NODE_NETWORK_LIMITED means the same as NODE_NETWORK with the limitation of only
+    // serving the last 288 blocks (BIP 159); set by pruned nodes.
+    NODE_NETWORK_LIMITED = (1 << 10),
 
     // Bits 24-31 are reserved for temporary experiments. Just pick a bit that
     // isn't getting used, or one not being used much, and notify the
@@ -156,6 +159,10 @@ enum {
     MSG_TXLOCK_VOTE,
     MSG_SPORK,
     MSG_MASTERNODE_WINNER,
+    // 8 to 16 are the masternode and budget types named in protocol.cpp.
+    // MSG_CMPCT_BLOCK is only used in getdata, asking for a cmpctblock
+    // (BIP 152) instead of the block itself.
+    MSG_CMPCT_BLOCK = 17,
 };
 
 #endif // BITCOIN_PROTOCOL_H
@@ -90,6 +90,7 @@ static const CRPCConvertParam vRPCConvertParams[] =
         {"lockunspent", 1},
         {"importprivkey", 2},
         {"importaddress", 2},
+        {"gettxoutsetinfo", 0},
         {"verifychain", 0},
         {"verifychain", 1},
         {"keypoolrefill", 0},
@@ -8,6 +8,7 @@
 #include "primitives/transaction.h"
 #include "script/script_error.h"
 #include "script/script.h"
+#include "crypto/common.h"
 #include "crypto/ripemd160.h"
 #include "crypto/sha1.h"
 #include "crypto/sha256.h"
@@ -15,6 +16,7 @@
 #include "pubkey.h"
 #include "main.h"
 #include "script/script.h"
+#include "streams.h"
 #include "uint256.h"
 #include <iostream>
 
@@ -1036,9 +1038,58 @@ public:
     }
 };
 
+/** Stream that feeds a SHA256 midstate, to serialize the rest of a signature hash into. */
+class CSHA256Writer {
+private:
+    CSHA256& sha;
+
+public:
+    explicit CSHA256Writer(CSHA256& shaIn) : sha(shaIn) {}
+
+    CSHA256Writer& write(const char* pch, size_t size)
+    {
+        sha.Write((const unsigned char*)pch, size);
+        return *this;
+    }
+};
+
+/** Serialized size of a COutPoint: the txid and the output index */
+const size_t PREVOUT_SIZE = 36;
+
 } // anon namespace
 
-uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+PrecomputedTransactionData::PrecomputedTransactionData(const CTransaction& txTo) : nOutputsPos(0)
+{
+    // A single input has nothing to share with the others
+    if (txTo.vin.size() < 2)
+        return;
+
+    // Laid out as CTransactionSignatureSerializer writes SIGHASH_ALL, with
+    // an empty script at every input
+    CDataStream ss(SER_GETHASH, 0);
+    ss << txTo.nVersion << txTo.nTime;
+    WriteCompactSize(ss, txTo.vin.size());
+    vInputPos.reserve(txTo.vin.size());
+    for (unsigned int i = 0; i < txTo.vin.size(); i++) {
+        vInputPos.push_back(ss.size());
+        ss << txTo.vin[i].prevout << CScript() << txTo.vin[i].nSequence;
+    }
+    nOutputsPos = ss.size();
+    ss << txTo.vout << txTo.nLockTime;
+    vchBlank.assign(ss.begin(), ss.end());
+
+    vMidstate.reserve(txTo.vin.size());
+    CSHA256 sha;
+    size_t nPos = 0;
+    for (unsigned int i = 0; i < txTo.vin.size(); i++) {
+        size_t nScript = vInputPos[i] + PREVOUT_SIZE;
+        sha.Write(&vchBlank[nPos], nScript - nPos);
+        nPos = nScript;
+        vMidstate.push_back(sha);
+    }
+}
+
+uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const PrecomputedTransactionData* txdata)
 {
     if (nIn >= txTo.vin.size()) {
         //  nIn out of range
@@ -1056,6 +1107,35 @@ uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsig
     // Wrapper to serialize only the necessary parts of the transaction being signed
     CTransactionSignatureSerializer txTmp(txTo, scriptCode, nIn, nHashType);
 
+    bool fHashAll = (nHashType & 0x1f) != SIGHASH_SINGLE && (nHashType & 0x1f) != SIGHASH_NONE;
+    if (txdata && fHashAll && txdata->vInputPos.size() == txTo.vin.size()) {
+        // Everything but the signed input's script comes from the blanked
+        // serialization; the hash is the same as serializing txTmp below.
+        const std::vector<unsigned char>& vchBlank = txdata->vchBlank;
+        size_t nScript = txdata->vInputPos[nIn] + PREVOUT_SIZE;
+        CSHA256 sha;
+        CSHA256Writer s(sha);
+        if (nHashType & SIGHASH_ANYONECANPAY) {
+            ::Serialize(s, txTo.nVersion, SER_GETHASH, 0);
+            ::Serialize(s, txTo.nTime, SER_GETHASH, 0);
+            WriteCompactSize(s, 1);
+            sha.Write(&vchBlank[txdata->vInputPos[nIn]], PREVOUT_SIZE);
+            txTmp.SerializeScriptCode(s, SER_GETHASH, 0);
+            sha.Write(&vchBlank[nScript + 1], 4);
+            sha.Write(&vchBlank[txdata->nOutputsPos], vchBlank.size() - txdata->nOutputsPos);
+        } else {
+            sha = txdata->vMidstate[nIn];
+            txTmp.SerializeScriptCode(s, SER_GETHASH, 0);
+            sha.Write(&vchBlank[nScript + 1], vchBlank.size() - nScript - 1);
+        }
+        unsigned char buf[CSHA256::OUTPUT_SIZE];
+        WriteLE32(buf, nHashType);
+        sha.Write(buf, 4).Finalize(buf);
+        uint256 hash;
+        CSHA256().Write(buf, sizeof(buf)).Finalize(hash.begin());
+        return hash;
+    }
+
     // Serialize and hash
     CHashWriter ss(SER_GETHASH, 0);
     ss << txTmp << nHashType;
@@ -1080,7 +1160,7 @@ bool TransactionSignatureChecker::CheckSig(const vector<unsigned char>& vchSigIn
     int nHashType = vchSig.back();
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, *txTo, nIn, nHashType);
+    uint256 sighash = SignatureHash(scriptCode, *txTo, nIn, nHashType, txdata);
 
     if (!VerifySignature(vchSig, pubkey, sighash))
         return false;
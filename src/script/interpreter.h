@@ -7,6 +7,7 @@
 #define BITCOIN_SCRIPT_INTERPRETER_H
 
 #include "script_error.h"
+#include "crypto/sha256.h"
 #include "primitives/transaction.h"
 
 #include <vector>
@@ -72,7 +73,31 @@ enum
 
 };
 
-uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+/**
+ * The parts of the signature hashes of a transaction that do not depend on the
+ * input being signed, computed once and shared by the checks of all its
+ * inputs. For SIGHASH_ALL, SignatureHash() resumes from the midstate before
+ * the signed input's script and appends the serialized rest of the
+ * transaction, instead of serializing and hashing all of it again for every
+ * input; SIGHASH_ALL|SIGHASH_ANYONECANPAY reuses the serialized outputs.
+ * Other hash types are computed as before.
+ */
+struct PrecomputedTransactionData
+{
+    //! txTo serialized for SIGHASH_ALL with every input script blanked; empty for fewer than two inputs
+    std::vector<unsigned char> vchBlank;
+    //! offset of each input in vchBlank
+    std::vector<uint32_t> vInputPos;
+    //! offset of the outputs in vchBlank
+    uint32_t nOutputsPos;
+    //! SHA256 of vchBlank up to the script of each input
+    std::vector<CSHA256> vMidstate;
+
+    PrecomputedTransactionData() : nOutputsPos(0) {}
+    explicit PrecomputedTransactionData(const CTransaction& txTo);
+};
+
+uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const PrecomputedTransactionData* txdata = NULL);
 
 class BaseSignatureChecker
 {
@@ -90,12 +115,13 @@ class TransactionSignatureChecker : public BaseSignatureChecker
 private:
     const CTransaction* txTo;
     unsigned int nIn;
+    const PrecomputedTransactionData* txdata;
 
 protected:
     virtual bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 
 public:
-    TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn) : txTo(txToIn), nIn(nInIn) {}
+    TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, const PrecomputedTransactionData* txdataIn = NULL) : txTo(txToIn), nIn(nInIn), txdata(txdataIn) {}
     bool CheckSig(const std::vector<unsigned char>& scriptSig, const std::vector<unsigned char>& vchPubKey, const CScript& scriptCode) const;
 };
 
@@ -10,17 +10,37 @@
 
 #include <vector>
 
+// DoS prevention: limit the signature cache to 32 MiB of 32-byte entries
+// (1048576 entries). The cuckoo cache keeps two bits of flags per entry on
+// top of that.
+static const unsigned int DEFAULT_MAX_SIG_CACHE_SIZE = 32;
+// Maximum sig cache size allowed, in MiB. Larger -maxsigcachesize values are
+// read as an entry count, as older versions did, and held to the same bound.
+static const int64_t MAX_MAX_SIG_CACHE_SIZE = 1024;
+
 class CPubKey;
 
+/** Lookups since startup and capacity of the signature cache */
+struct SignatureCacheStats {
+    uint64_t nHits;
+    uint64_t nMisses;
+    size_t nElements;
+    size_t nBytes;
+};
+
 class CachingTransactionSignatureChecker : public TransactionSignatureChecker
 {
 private:
     bool store;
 
 public:
-    CachingTransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, bool storeIn=true) : TransactionSignatureChecker(txToIn, nInIn), store(storeIn) {}
+    CachingTransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, bool storeIn = true, const PrecomputedTransactionData* txdataIn = NULL) : TransactionSignatureChecker(txToIn, nInIn, txdataIn), store(storeIn) {}
 
     bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 };
 
+/** Size the signature cache from -maxsigcachesize (in MiB). Must be called before use. */
+void InitSignatureCache();
+void GetSignatureCacheStats(SignatureCacheStats& stats);
+
 #endif // BITCOIN_SCRIPT_SIGCACHE_H
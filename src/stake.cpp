@@ -361,11 +361,16 @@ bool MultiplyStakeTarget(uint256 &bnTarget, int nModifierHeight, int64_t nModifi
 
 //instead of looping outside and reinitializing variables many times, we will give a nTimeTx and also search interval so that we can do all the hashing here
 bool Stake::CheckHash(const CBlockIndex* pindexPrev, unsigned int nBits, const CBlock &blockFrom, const CTransaction &txPrev, const COutPoint &prevout, unsigned int& nTimeTx, uint256& hashProofOfStake)
+{
+    return CheckHash(pindexPrev, nBits, blockFrom, txPrev.nTime, txPrev.vout[prevout.n].nValue, prevout, nTimeTx, hashProofOfStake);
+}
+
+bool Stake::CheckHash(const CBlockIndex* pindexPrev, unsigned int nBits, const CBlock &blockFrom, unsigned int nTimeTxPrev, CAmount nValueIn, const COutPoint &prevout, unsigned int& nTimeTx, uint256& hashProofOfStake)
 {
     unsigned int nTimeBlockFrom = blockFrom.GetBlockTime();
 
-    if (nTimeTx < txPrev.nTime) {  // Transaction timestamp violation
-        return false; //error("%s: nTime violation (nTime=%d, nTimeTx=%d)", __func__, txPrev.nTime, nTimeTx);
+    if (nTimeTx < nTimeTxPrev) {  // Transaction timestamp violation
+        return false; //error("%s: nTime violation (nTime=%d, nTimeTx=%d)", __func__, nTimeTxPrev, nTimeTx);
     }
 
     if (GetStakeAge(nTimeBlockFrom) > nTimeTx) // Min age requirement
@@ -386,7 +391,6 @@ bool Stake::CheckHash(const CBlockIndex* pindexPrev, unsigned int nBits, const C
     bnTarget.SetCompact(nBits);
 
     // Weighted target
-    int64_t nValueIn = txPrev.vout[prevout.n].nValue;
     uint256 bnWeight = uint256(nValueIn);
     bnTarget *= bnWeight;
 
@@ -396,7 +400,7 @@ bool Stake::CheckHash(const CBlockIndex* pindexPrev, unsigned int nBits, const C
 
     // Calculate hash
     CDataStream ss(SER_GETHASH, 0);
-    ss << nStakeModifier << nTimeBlockFrom << txPrev.nTime << prevout.hash << prevout.n << nTimeTx ;
+    ss << nStakeModifier << nTimeBlockFrom << nTimeTxPrev << prevout.hash << prevout.n << nTimeTx ;
     if (ENABLE_ADVANCED_STAKING && (mapArgs.count("-regtest") || nStakeModifierHeight >= ADVANCED_STAKING_HEIGHT)) {
         ss << nHashInterval << nSelectionPeriod << nStakeMinAge << nStakeSplitThreshold
            << bnWeight << nStakeModifierTime ;
@@ -411,7 +415,7 @@ bool Stake::CheckHash(const CBlockIndex* pindexPrev, unsigned int nBits, const C
                   DateTimeStrFormat("%Y-%m-%d %H:%M:%S", blockFrom.GetBlockTime()).c_str());
         LogPrintf("%s: check modifier=0x%016x nTimeBlockFrom=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n", __func__,
                   nStakeModifier,
-                  blockFrom.GetBlockTime(), txPrev.nTime, prevout.n, nTimeTx,
+                  blockFrom.GetBlockTime(), nTimeTxPrev, prevout.n, nTimeTx,
                   hashProofOfStake.ToString());
 #       endif
         DEBUG_DUMP_STAKING_INFO_CheckHash();
@@ -445,37 +449,53 @@ bool Stake::CheckProof(CBlockIndex* const pindexPrev, const CBlock &block, uint2
     // Kernel (input 0) must match the stake hash target per coin age (nBits)
     const CTxIn& txin = tx.vin[0];
 
-    // First try finding the previous transaction in database
-    uint256 prevBlockHash;
-    CTransaction txPrev;
-    if (!GetTransaction(txin.prevout.hash, txPrev, prevBlockHash, true))
-        return error("%s: read txPrev failed");
+    // The staked output and the time of its transaction are kept in the
+    // chain state, so block files (which prune mode deletes) are only read
+    // for outputs already spent on the active chain.
+    CTxOut txoutPrev;
+    unsigned int nTimeTxPrev = 0;
+    CBlockIndex* pindex = NULL;
+    Coin coin;
+    {
+        LOCK(cs_main);
+        if (pcoinsTip->GetCoin(txin.prevout, coin)) {
+            txoutPrev = coin.out;
+            nTimeTxPrev = coin.nTime;
+            pindex = chainActive[coin.nHeight];
+        }
+    }
+    if (!pindex) {
+        uint256 prevBlockHash;
+        CTransaction txPrev;
+        if (!GetTransaction(txin.prevout.hash, txPrev, prevBlockHash, true) || txin.prevout.n >= txPrev.vout.size())
+            return error("%s: read txPrev failed", __func__);
+        txoutPrev = txPrev.vout[txin.prevout.n];
+        nTimeTxPrev = txPrev.nTime;
+
+        LOCK(cs_main);
+        BlockMap::iterator it = mapBlockIndex.find(prevBlockHash);
+        if (it != mapBlockIndex.end())
+            pindex = it->second;
+        else
+            return error("%s: read block failed", __func__);
+    }
 
     //verify signature and script
-    if (!VerifyScript(txin.scriptSig, txPrev.vout[txin.prevout.n].scriptPubKey, STANDARD_SCRIPT_VERIFY_FLAGS, TransactionSignatureChecker(&tx, 0)))
+    if (!VerifyScript(txin.scriptSig, txoutPrev.scriptPubKey, STANDARD_SCRIPT_VERIFY_FLAGS, TransactionSignatureChecker(&tx, 0)))
         return error("%s: VerifySignature failed on coinstake %s", __func__, tx.GetHash().ToString().c_str());
 
-    CBlockIndex* pindex = NULL;
-    BlockMap::iterator it = mapBlockIndex.find(prevBlockHash);
-    if (it != mapBlockIndex.end())
-        pindex = it->second;
-    else
-        return error("%s: read block failed", __func__);
-
-    // Read block header
-    CBlock prevBlock;
-    if (!ReadBlockFromDisk(prevBlock, pindex->GetBlockPos()))
-        return error("%s: failed to find block", __func__);
+    // Only the header is needed, which the block index has (and keeps when the block file is pruned)
+    CBlock prevBlock(pindex->GetBlockHeader());
 
     unsigned int nTime = block.nTime;
 #   if 0
-    if (!CheckHash(pindexPrev, block.nBits, prevBlock, txPrev, txin.prevout, nTime, hashProofOfStake))
+    if (!CheckHash(pindexPrev, block.nBits, prevBlock, nTimeTxPrev, txoutPrev.nValue, txin.prevout, nTime, hashProofOfStake))
         // may occur during initial download or if behind on block chain sync
         return error("%s: invalid coinstake %s, hashProof=%s", __func__, 
                      tx.GetHash().ToString(), hashProofOfStake.ToString());
     return true;
 #   else
-    return CheckHash(pindexPrev, block.nBits, prevBlock, txPrev, txin.prevout, nTime, hashProofOfStake);
+    return CheckHash(pindexPrev, block.nBits, prevBlock, nTimeTxPrev, txoutPrev.nValue, txin.prevout, nTime, hashProofOfStake);
 #   endif
 }
 
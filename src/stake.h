@@ -81,6 +81,8 @@ public:
     //!<DuzyDoc>: Stake::CheckHash - check whether stake kernel meets hash target
     //!<DuzyDoc>:       Sets hashProofOfStake on success return
     bool CheckHash(const CBlockIndex* pindexPrev, unsigned int nBits, const CBlock &blockFrom, const CTransaction &txPrev, const COutPoint &prevout, unsigned int& nTimeTx, uint256& hashProofOfStake);
+    //!<DuzyDoc>:       From the staked output's value and the time of its transaction
+    bool CheckHash(const CBlockIndex* pindexPrev, unsigned int nBits, const CBlock &blockFrom, unsigned int nTimeTxPrev, CAmount nValueIn, const COutPoint &prevout, unsigned int& nTimeTx, uint256& hashProofOfStake);
 
     //!<DuzyDoc>: Stake::CheckProof - check kernel hash target and coinstake signature
     //!<DuzyDoc>:       Sets hashProofOfStake on success return
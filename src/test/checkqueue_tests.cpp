@@ -0,0 +1,256 @@
+// Copyright (c) 2015-2017 The LUX developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "checkqueue.h"
+#include "random.h"
+#include "tinyformat.h"
+#include "utiltime.h"
+
+#include <atomic>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+namespace
+{
+/** Counts its runs, fails if asked to, and burns nWork rounds of arithmetic. */
+class CTestCheck
+{
+public:
+    std::atomic<unsigned int>* pnRuns;
+    bool fOk;
+    unsigned int nWork;
+
+    CTestCheck() : pnRuns(NULL), fOk(true), nWork(0) {}
+    CTestCheck(std::atomic<unsigned int>* pnRunsIn, bool fOkIn, unsigned int nWorkIn) : pnRuns(pnRunsIn), fOk(fOkIn), nWork(nWorkIn) {}
+
+    bool operator()()
+    {
+        volatile uint64_t x = nWork;
+        for (unsigned int i = 0; i < nWork; i++)
+            x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        if (pnRuns)
+            ++*pnRuns;
+        return fOk;
+    }
+
+    void swap(CTestCheck& check)
+    {
+        std::swap(pnRuns, check.pnRuns);
+        std::swap(fOk, check.fOk);
+        std::swap(nWork, check.nWork);
+    }
+};
+
+/**
+ * The previous CCheckQueue: one mutex-guarded stack that every thread takes
+ * batches from. Kept here as the baseline for checkqueue_bench.
+ */
+template <typename T>
+class CMutexCheckQueue
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable condWorker;
+    boost::condition_variable condMaster;
+    std::vector<T> queue;
+    int nIdle;
+    int nTotal;
+    bool fAllOk;
+    unsigned int nTodo;
+    unsigned int nBatchSize;
+
+    bool Loop(bool fMaster = false)
+    {
+        boost::condition_variable& cond = fMaster ? condMaster : condWorker;
+        std::vector<T> vChecks;
+        vChecks.reserve(nBatchSize);
+        unsigned int nNow = 0;
+        bool fOk = true;
+        do {
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                if (nNow) {
+                    fAllOk &= fOk;
+                    nTodo -= nNow;
+                    if (nTodo == 0 && !fMaster)
+                        condMaster.notify_one();
+                } else {
+                    nTotal++;
+                }
+                while (queue.empty()) {
+                    if (fMaster && nTodo == 0) {
+                        nTotal--;
+                        bool fRet = fAllOk;
+                        fAllOk = true;
+                        return fRet;
+                    }
+                    nIdle++;
+                    cond.wait(lock);
+                    nIdle--;
+                }
+                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
+                vChecks.resize(nNow);
+                for (unsigned int i = 0; i < nNow; i++) {
+                    vChecks[i].swap(queue.back());
+                    queue.pop_back();
+                }
+                fOk = fAllOk;
+            }
+            for (unsigned int i = 0; i < vChecks.size(); i++)
+                if (fOk)
+                    fOk = vChecks[i]();
+            vChecks.clear();
+        } while (true);
+    }
+
+public:
+    CMutexCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), nBatchSize(nBatchSizeIn) {}
+
+    void Thread() { Loop(); }
+
+    bool Wait() { return Loop(true); }
+
+    void Add(std::vector<T>& vChecks)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        for (unsigned int i = 0; i < vChecks.size(); i++) {
+            queue.push_back(T());
+            vChecks[i].swap(queue.back());
+        }
+        nTodo += vChecks.size();
+        if (vChecks.size() == 1)
+            condWorker.notify_one();
+        else if (vChecks.size() > 1)
+            condWorker.notify_all();
+    }
+};
+
+/** Add nChecks checks in batches of nPerAdd, as ConnectBlock adds a transaction's inputs. */
+template <typename Queue>
+bool RunRound(Queue& queue, std::atomic<unsigned int>& nRuns, unsigned int nChecks, unsigned int nPerAdd, unsigned int nWork, unsigned int nFailAt)
+{
+    std::vector<CTestCheck> vChecks;
+    for (unsigned int i = 0; i < nChecks; i++) {
+        vChecks.push_back(CTestCheck(&nRuns, i != nFailAt, nWork));
+        if (vChecks.size() == nPerAdd || i + 1 == nChecks) {
+            queue.Add(vChecks);
+            vChecks.clear();
+        }
+    }
+    return queue.Wait();
+}
+
+/** Microseconds per round of a synthetic load, with nThreads workers besides the master. */
+template <typename Queue>
+double BenchQueue(int nThreads, unsigned int nChecks, unsigned int nPerAdd, unsigned int nWork, int nRounds)
+{
+    Queue queue(128);
+    boost::thread_group threads;
+    for (int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(&Queue::Thread, &queue));
+    std::atomic<unsigned int> nRuns(0);
+    RunRound(queue, nRuns, nChecks, nPerAdd, nWork, nChecks); // warm up
+    int64_t nStart = GetTimeMicros();
+    for (int i = 0; i < nRounds; i++)
+        RunRound(queue, nRuns, nChecks, nPerAdd, nWork, nChecks);
+    int64_t nTime = GetTimeMicros() - nStart;
+    threads.interrupt_all();
+    threads.join_all();
+    return (double)nTime / nRounds;
+}
+} // anon namespace
+
+BOOST_AUTO_TEST_SUITE(checkqueue_tests)
+
+BOOST_AUTO_TEST_CASE(checkqueue_all_run)
+{
+    for (int nThreads = 0; nThreads <= 4; nThreads += 2) {
+        CCheckQueue<CTestCheck> queue(16);
+        boost::thread_group threads;
+        for (int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&CCheckQueue<CTestCheck>::Thread, &queue));
+
+        const unsigned int nCounts[] = {0, 1, 2, 3, 17, 100, 1000, 40000};
+        const unsigned int nPerAdds[] = {1, 3, 1000};
+        for (unsigned int c = 0; c < sizeof(nCounts) / sizeof(nCounts[0]); c++) {
+            for (unsigned int a = 0; a < sizeof(nPerAdds) / sizeof(nPerAdds[0]); a++) {
+                std::atomic<unsigned int> nRuns(0);
+                BOOST_CHECK(RunRound(queue, nRuns, nCounts[c], nPerAdds[a], 0, nCounts[c]));
+                BOOST_CHECK_EQUAL(nRuns, nCounts[c]);
+                BOOST_CHECK(queue.IsIdle());
+            }
+        }
+        threads.interrupt_all();
+        threads.join_all();
+    }
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_failure)
+{
+    CCheckQueue<CTestCheck> queue(16);
+    boost::thread_group threads;
+    for (int i = 0; i < 3; i++)
+        threads.create_thread(boost::bind(&CCheckQueue<CTestCheck>::Thread, &queue));
+
+    for (int i = 0; i < 50; i++) {
+        unsigned int nChecks = 1 + insecure_rand() % 2000;
+        std::atomic<unsigned int> nRuns(0);
+        // a failure anywhere fails the round; checks after it may be skipped
+        BOOST_CHECK(!RunRound(queue, nRuns, nChecks, 1 + insecure_rand() % 10, 10, insecure_rand() % nChecks));
+        BOOST_CHECK(nRuns <= nChecks);
+        BOOST_CHECK(queue.IsIdle());
+        // and the next round starts clean
+        nRuns = 0;
+        BOOST_CHECK(RunRound(queue, nRuns, nChecks, 5, 0, nChecks));
+        BOOST_CHECK_EQUAL(nRuns, nChecks);
+    }
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_control)
+{
+    CCheckQueue<CTestCheck> queue(16);
+    boost::thread_group threads;
+    threads.create_thread(boost::bind(&CCheckQueue<CTestCheck>::Thread, &queue));
+
+    std::atomic<unsigned int> nRuns(0);
+    {
+        // the destructor waits for the checks
+        CCheckQueueControl<CTestCheck> control(&queue);
+        std::vector<CTestCheck> vChecks(100, CTestCheck(&nRuns, true, 100));
+        control.Add(vChecks);
+    }
+    BOOST_CHECK_EQUAL(nRuns, 100U);
+    BOOST_CHECK(queue.IsIdle());
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_bench)
+{
+    // Not a pass/fail test: compares the work-stealing queue with the mutex
+    // one it replaced under synthetic loads; run with --log_level=message.
+    int nThreads = std::max(1, (int)boost::thread::hardware_concurrency() - 1);
+    struct {
+        const char* strName;
+        unsigned int nChecks, nPerAdd, nWork;
+        int nRounds;
+    } loads[] = {
+        {"tiny checks", 20000, 2, 0, 5},
+        {"signature-sized checks", 2000, 2, 20000, 3},
+        {"one large batch", 20000, 20000, 200, 5},
+    };
+    for (unsigned int i = 0; i < sizeof(loads) / sizeof(loads[0]); i++) {
+        double nStealing = BenchQueue<CCheckQueue<CTestCheck> >(nThreads, loads[i].nChecks, loads[i].nPerAdd, loads[i].nWork, loads[i].nRounds);
+        double nMutex = BenchQueue<CMutexCheckQueue<CTestCheck> >(nThreads, loads[i].nChecks, loads[i].nPerAdd, loads[i].nWork, loads[i].nRounds);
+        BOOST_TEST_MESSAGE(strprintf("checkqueue %s, %d workers: work-stealing %.0fus, mutex %.0fus per round",
+            loads[i].strName, nThreads, nStealing, nMutex));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -2,13 +2,20 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "clientversion.h"
 #include "coins.h"
 #include "random.h"
+#include "script/standard.h"
+#include "streams.h"
+#include "txdb.h"
 #include "uint256.h"
+#include "undo.h"
+#include "utilstrencodings.h"
 
 #include <vector>
 #include <map>
 
+#include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
 
 namespace
@@ -16,38 +23,41 @@ namespace
 class CCoinsViewTest : public CCoinsView
 {
     uint256 hashBestBlock_;
-    std::map<uint256, CCoins> map_;
+    std::map<COutPoint, Coin> map_;
 
 public:
-    bool GetCoins(const uint256& txid, CCoins& coins) const
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const
     {
-        std::map<uint256, CCoins>::const_iterator it = map_.find(txid);
+        std::map<COutPoint, Coin>::const_iterator it = map_.find(outpoint);
         if (it == map_.end()) {
             return false;
         }
-        coins = it->second;
-        if (coins.IsPruned() && insecure_rand() % 2 == 0) {
+        coin = it->second;
+        if (coin.IsSpent() && insecure_rand() % 2 == 0) {
             // Randomly return false in case of an empty entry.
             return false;
         }
         return true;
     }
 
-    bool HaveCoins(const uint256& txid) const
+    bool HaveCoin(const COutPoint& outpoint) const
     {
-        CCoins coins;
-        return GetCoins(txid, coins);
+        Coin coin;
+        return GetCoin(outpoint, coin);
     }
 
     uint256 GetBestBlock() const { return hashBestBlock_; }
 
-    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, const CCoinsRunningStats* pstats)
     {
         for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ) {
-            map_[it->first] = it->second.coins;
-            if (it->second.coins.IsPruned() && insecure_rand() % 3 == 0) {
-                // Randomly delete empty entries on write.
-                map_.erase(it->first);
+            if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+                // Same optimization used in CCoinsViewDB is to only write dirty entries.
+                map_[it->first] = it->second.coin;
+                if (it->second.coin.IsSpent() && insecure_rand() % 3 == 0) {
+                    // Randomly delete empty entries on write.
+                    map_.erase(it->first);
+                }
             }
             mapCoins.erase(it++);
         }
@@ -58,6 +68,34 @@ public:
 
     bool GetStats(CCoinsStats& stats) const { return false; }
 };
+
+class CCoinsViewCacheTest : public CCoinsViewCache
+{
+public:
+    CCoinsViewCacheTest(CCoinsView* base) : CCoinsViewCache(base) {}
+
+    void SelfTest() const
+    {
+        // Manually recompute the dynamic usage of the whole data, and compare it.
+        size_t ret = memusage::DynamicUsage(cacheCoins);
+        for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
+            ret += it->second.coin.DynamicMemoryUsage();
+        }
+        BOOST_CHECK_EQUAL(DynamicMemoryUsage(), ret);
+    }
+};
+
+bool operator==(const Coin& a, const Coin& b)
+{
+    // Empty Coin objects are always equal.
+    if (a.IsSpent() && b.IsSpent())
+        return true;
+    return a.fCoinBase == b.fCoinBase &&
+           a.fCoinStake == b.fCoinStake &&
+           a.nHeight == b.nHeight &&
+           a.nTime == b.nTime &&
+           a.out == b.out;
+}
 }
 
 BOOST_AUTO_TEST_SUITE(coins_tests)
@@ -67,8 +105,8 @@ static const unsigned int NUM_SIMULATION_ITERATIONS = 40000;
 // This is a large randomized insert/remove simulation test on a variable-size
 // stack of caches on top of CCoinsViewTest.
 //
-// It will randomly create/update/delete CCoins entries to a tip of caches, with
-// txids picked from a limited list of random 256-bit hashes. Occasionally, a
+// It will randomly create/update/delete Coin entries to a tip of caches, with
+// outpoints picked from a limited list of random 256-bit hashes. Occasionally, a
 // new tip is added to the stack of caches, or the tip is flushed and removed.
 //
 // During the process, booleans are kept to make sure that the randomized
@@ -83,14 +121,15 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     bool updated_an_entry = false;
     bool found_an_entry = false;
     bool missed_an_entry = false;
+    bool uncached_an_entry = false;
 
     // A simple map to track what we expect the cache stack to represent.
-    std::map<uint256, CCoins> result;
+    std::map<COutPoint, Coin> result;
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
-    std::vector<CCoinsViewCache*> stack; // A stack of CCoinsViewCaches on top.
-    stack.push_back(new CCoinsViewCache(&base)); // Start with one cache.
+    std::vector<CCoinsViewCacheTest*> stack; // A stack of CCoinsViewCaches on top.
+    stack.push_back(new CCoinsViewCacheTest(&base)); // Start with one cache.
 
     // Use a limited set of random transaction ids, so we do test overwriting entries.
     std::vector<uint256> txids;
@@ -102,56 +141,81 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     for (unsigned int i = 0; i < NUM_SIMULATION_ITERATIONS; i++) {
         // Do a random modification.
         {
-            uint256 txid = txids[insecure_rand() % txids.size()]; // txid we're going to modify in this iteration.
-            CCoins& coins = result[txid];
-            CCoinsModifier entry = stack.back()->ModifyCoins(txid);
-            BOOST_CHECK(coins == *entry);
-            if (insecure_rand() % 5 == 0 || coins.IsPruned()) {
-                if (coins.IsPruned()) {
+            COutPoint outpoint(txids[insecure_rand() % txids.size()], insecure_rand() % 2); // outpoint we're going to modify in this iteration.
+            Coin& coin = result[outpoint];
+            const Coin& entry = stack.back()->AccessCoin(outpoint);
+            BOOST_CHECK(coin == entry);
+
+            if (insecure_rand() % 5 == 0 || coin.IsSpent()) {
+                Coin newcoin;
+                newcoin.out.nValue = insecure_rand();
+                newcoin.out.scriptPubKey.assign(insecure_rand() & 0x3F, 0); // random script size
+                newcoin.nHeight = 1;
+                newcoin.nTime = insecure_rand();
+                if (coin.IsSpent()) {
                     added_an_entry = true;
                 } else {
                     updated_an_entry = true;
                 }
-                coins.nVersion = insecure_rand();
-                coins.vout.resize(1);
-                coins.vout[0].nValue = insecure_rand();
-                *entry = coins;
+                stack.back()->AddCoin(outpoint, newcoin, !coin.IsSpent() || insecure_rand() & 1);
+                coin = newcoin;
             } else {
-                coins.Clear();
-                entry->Clear();
                 removed_an_entry = true;
+                coin.Clear();
+                stack.back()->SpendCoin(outpoint);
             }
         }
 
+        // One every 10 iterations, remove a random entry from the cache
+        if (insecure_rand() % 10 == 0) {
+            COutPoint outpoint(txids[insecure_rand() % txids.size()], 0);
+            int cacheid = insecure_rand() % stack.size();
+            stack[cacheid]->Uncache(outpoint);
+            uncached_an_entry |= !stack[cacheid]->HaveCoinInCache(outpoint);
+        }
+
         // Once every 1000 iterations and at the end, verify the full cache.
         if (insecure_rand() % 1000 == 1 || i == NUM_SIMULATION_ITERATIONS - 1) {
-            for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
-                const CCoins* coins = stack.back()->AccessCoins(it->first);
-                if (coins) {
-                    BOOST_CHECK(*coins == it->second);
-                    found_an_entry = true;
-                } else {
-                    BOOST_CHECK(it->second.IsPruned());
+            for (std::map<COutPoint, Coin>::iterator it = result.begin(); it != result.end(); it++) {
+                bool have = stack.back()->HaveCoin(it->first);
+                const Coin& coin = stack.back()->AccessCoin(it->first);
+                BOOST_CHECK(have == !coin.IsSpent());
+                BOOST_CHECK(coin == it->second);
+                if (coin.IsSpent()) {
                     missed_an_entry = true;
+                } else {
+                    BOOST_CHECK(stack.back()->HaveCoinInCache(it->first));
+                    found_an_entry = true;
                 }
             }
+            for (unsigned int c = 0; c < stack.size(); c++)
+                stack[c]->SelfTest();
         }
 
+        if (insecure_rand() % 100 == 0) {
+            // Every 100 iterations, flush an intermediate cache
+            if (stack.size() > 1 && insecure_rand() % 2 == 0) {
+                unsigned int flushIndex = insecure_rand() % (stack.size() - 1);
+                stack[flushIndex]->Flush();
+            }
+        }
         if (insecure_rand() % 100 == 0) {
             // Every 100 iterations, change the cache stack.
             if (stack.size() > 0 && insecure_rand() % 2 == 0) {
+                //Remove the top cache
                 stack.back()->Flush();
                 delete stack.back();
                 stack.pop_back();
             }
             if (stack.size() == 0 || (stack.size() < 4 && insecure_rand() % 2)) {
+                //Add a new cache
                 CCoinsView* tip = &base;
                 if (stack.size() > 0) {
                     tip = stack.back();
                 } else {
                     removed_all_caches = true;
                 }
-                stack.push_back(new CCoinsViewCache(tip));
+                stack.push_back(new CCoinsViewCacheTest(tip));
                 if (stack.size() == 4) {
                     reached_4_caches = true;
                 }
@@ -173,6 +237,187 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(updated_an_entry);
     BOOST_CHECK(found_an_entry);
     BOOST_CHECK(missed_an_entry);
+    BOOST_CHECK(uncached_an_entry);
+}
+
+BOOST_AUTO_TEST_CASE(coin_serialization)
+{
+    // Coinstake output at height 203998.
+    CDataStream ss1(ParseHex("b0e579001c2f5a00816115944e077fe7c803cfa57f29b36bf87c1d35"), SER_DISK, CLIENT_VERSION);
+    Coin c1;
+    ss1 >> c1;
+    BOOST_CHECK_EQUAL(c1.IsCoinBase(), false);
+    BOOST_CHECK_EQUAL(c1.IsCoinStake(), true);
+    BOOST_CHECK_EQUAL(c1.nHeight, 203998U);
+    BOOST_CHECK_EQUAL(c1.nTime, 1513036800U);
+    BOOST_CHECK_EQUAL(c1.out.nValue, 0);
+    BOOST_CHECK(c1.out.scriptPubKey == GetScriptForDestination(CKeyID(uint160(ParseHex("816115944e077fe7c803cfa57f29b36bf87c1d35")))));
+
+    CDataStream ss2(SER_DISK, CLIENT_VERSION);
+    ss2 << c1;
+    BOOST_CHECK_EQUAL(HexStr(ss2.begin(), ss2.end()), "b0e579001c2f5a00816115944e077fe7c803cfa57f29b36bf87c1d35");
+}
+
+BOOST_AUTO_TEST_CASE(undo_legacy_compatibility)
+{
+    // An undo record carries the metadata and, where older records had the
+    // transaction version, the transaction time.
+    Coin coin(CTxOut(50 * COIN, CScript() << OP_TRUE), 1000, true, false, 1513036800);
+    CTxUndo txundo;
+    txundo.vprevout.push_back(coin);
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << txundo;
+    BOOST_CHECK_EQUAL(ss.size(), txundo.GetSerializeSize(SER_DISK, CLIENT_VERSION));
+
+    CTxUndo txundoRead;
+    ss >> txundoRead;
+    BOOST_CHECK_EQUAL(txundoRead.vprevout.size(), 1U);
+    BOOST_CHECK(txundoRead.vprevout[0] == coin);
+
+    // The last spend of a transaction used to record its version there,
+    // which leaves the time to be recovered.
+    CDataStream ssVersion(SER_DISK, CLIENT_VERSION);
+    WriteCompactSize(ssVersion, 1);
+    ssVersion << VARINT(1000u * 4 + 2) << VARINT(1u);
+    ssVersion << CTxOutCompressor(REF(coin.out));
+    ssVersion >> txundoRead;
+    BOOST_CHECK_EQUAL(txundoRead.vprevout[0].nHeight, 1000U);
+    BOOST_CHECK_EQUAL(txundoRead.vprevout[0].nTime, 0U);
+    BOOST_CHECK(txundoRead.vprevout[0].out == coin.out);
+
+    // Records of earlier spends only carried the txout; the metadata is
+    // recovered from a sibling output when the block is disconnected.
+    CDataStream ssLegacy(SER_DISK, CLIENT_VERSION);
+    WriteCompactSize(ssLegacy, 1);
+    ssLegacy << VARINT(0u);
+    ssLegacy << CTxOutCompressor(REF(coin.out));
+    ssLegacy >> txundoRead;
+    BOOST_CHECK_EQUAL(txundoRead.vprevout[0].nHeight, 0U);
+    BOOST_CHECK(txundoRead.vprevout[0].out == coin.out);
+
+    CCoinsView viewDummy;
+    CCoinsViewCache cache(&viewDummy);
+    uint256 txid = GetRandHash();
+    cache.AddCoin(COutPoint(txid, 1), coin, false);
+    BOOST_CHECK(AccessByTxid(cache, txid) == coin);
+    BOOST_CHECK(AccessByTxid(cache, GetRandHash()).IsSpent());
+}
+
+BOOST_AUTO_TEST_CASE(coins_prefetch)
+{
+    CCoinsViewTest base;
+    Coin coin(CTxOut(50 * COIN, CScript() << OP_TRUE), 100, false, false, 1513036800);
+    COutPoint outpoint(GetRandHash(), 0);
+    {
+        CCoinsViewCache cache(&base);
+        cache.AddCoin(outpoint, coin, false);
+        BOOST_CHECK(cache.Flush());
+    }
+
+    CCoinsViewCache cache(&base);
+    Coin fetched;
+    BOOST_CHECK(cache.GetBackend()->GetCoin(outpoint, fetched));
+    cache.PrefetchCoin(outpoint, fetched);
+    BOOST_CHECK(cache.HaveCoinInCache(outpoint));
+    BOOST_CHECK(cache.AccessCoin(outpoint) == coin);
+
+    // An entry already in the cache wins over a prefetched one.
+    COutPoint outpointNew(GetRandHash(), 1);
+    cache.AddCoin(outpointNew, coin, false);
+    Coin stale(CTxOut(1, CScript() << OP_TRUE), 1, false, false, 1513036800);
+    cache.PrefetchCoin(outpointNew, stale);
+    BOOST_CHECK(cache.AccessCoin(outpointNew) == coin);
+
+    // Prefetched entries are not dirty, so spending the coin in the base is
+    // not undone by a flush.
+    {
+        CCoinsViewCache spender(&base);
+        BOOST_CHECK(spender.SpendCoin(outpoint));
+        BOOST_CHECK(spender.Flush());
+    }
+    BOOST_CHECK(cache.Flush());
+    Coin coinBase;
+    BOOST_CHECK(!base.GetCoin(outpoint, coinBase) || coinBase.IsSpent());
+    BOOST_CHECK(base.GetCoin(outpointNew, coinBase) && coinBase == coin);
+}
+
+BOOST_AUTO_TEST_CASE(coins_async_writer)
+{
+    CCoinsViewDB db(1 << 20, true, true);
+    CCoinsViewAsyncWriter writer(&db, true);
+    Coin coin(CTxOut(50 * COIN, CScript() << OP_TRUE), 100, false, false, 1513036800);
+    std::vector<COutPoint> outpoints;
+
+    // Queue a number of flushes, each creating a few coins and spending the
+    // ones created by the previous flush. Every state must be visible through
+    // the writer right away, whether or not it has reached the database.
+    for (int i = 0; i < 20; i++) {
+        CCoinsViewCache cache(&writer);
+        BOOST_FOREACH (const COutPoint& outpoint, outpoints)
+            BOOST_CHECK(cache.SpendCoin(outpoint));
+        outpoints.clear();
+        for (int j = 0; j < 10; j++) {
+            outpoints.push_back(COutPoint(GetRandHash(), j));
+            cache.AddCoin(outpoints.back(), coin, false);
+        }
+        uint256 hashBlock = GetRandHash();
+        cache.SetBestBlock(hashBlock);
+        BOOST_CHECK(cache.Flush());
+        BOOST_CHECK(writer.GetBestBlock() == hashBlock);
+
+        CCoinsViewCache check(&writer);
+        BOOST_FOREACH (const COutPoint& outpoint, outpoints)
+            BOOST_CHECK(check.AccessCoin(outpoint) == coin);
+    }
+
+    BOOST_CHECK(writer.Sync());
+    BOOST_CHECK(db.GetBestBlock() == writer.GetBestBlock());
+    BOOST_FOREACH (const COutPoint& outpoint, outpoints) {
+        Coin coinRead;
+        BOOST_CHECK(db.GetCoin(outpoint, coinRead));
+        BOOST_CHECK(coinRead == coin);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(coins_find_by_txid)
+{
+    CCoinsViewDB db(1 << 20, true, true);
+    CCoinsViewAsyncWriter writer(&db, true);
+    uint256 txid = GetRandHash();
+    COutPoint outpoint;
+
+    // Indexes whose VARINTs have one, two and three bytes
+    {
+        CCoinsViewCache cache(&writer);
+        cache.AddCoin(COutPoint(txid, 5), Coin(CTxOut(COIN, CScript() << OP_TRUE), 5, false, false, 1513036800), false);
+        cache.AddCoin(COutPoint(txid, 200), Coin(CTxOut(COIN, CScript() << OP_TRUE), 200, false, false, 1513036800), false);
+        cache.AddCoin(COutPoint(txid, 20000), Coin(CTxOut(COIN, CScript() << OP_TRUE), 20000, false, false, 1513036800), false);
+        cache.AddCoin(COutPoint(GetRandHash(), 1), Coin(CTxOut(COIN, CScript() << OP_TRUE), 1, false, false, 1513036800), false);
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(writer.Sync());
+    BOOST_CHECK(db.FindCoinByTxid(txid, 0, 30000, outpoint) && outpoint.n == 5);
+    BOOST_CHECK(db.FindCoinByTxid(txid, 6, 30000, outpoint) && outpoint.n == 200);
+    BOOST_CHECK(db.FindCoinByTxid(txid, 201, 30000, outpoint) && outpoint.n == 20000);
+    BOOST_CHECK(!db.FindCoinByTxid(txid, 6, 200, outpoint));
+    BOOST_CHECK(!db.FindCoinByTxid(GetRandHash(), 0, 30000, outpoint));
+
+    // A spend still queued in the writer hides the database's output
+    {
+        CCoinsViewCache cache(&writer);
+        BOOST_CHECK(cache.SpendCoin(COutPoint(txid, 5)));
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(writer.FindCoinByTxid(txid, 0, 30000, outpoint) && outpoint.n == 200);
+
+    // and so do the cache's own entries, while new ones below are found first
+    CCoinsViewCache cache(&writer);
+    BOOST_CHECK(cache.SpendCoin(COutPoint(txid, 200)));
+    BOOST_CHECK_EQUAL(AccessByTxid(cache, txid).nHeight, 20000U);
+    BOOST_CHECK(AccessByTxid(cache, txid, 1000).IsSpent());
+    cache.AddCoin(COutPoint(txid, 2), Coin(CTxOut(COIN, CScript() << OP_TRUE), 2, false, false, 1513036800), false);
+    BOOST_CHECK_EQUAL(AccessByTxid(cache, txid).nHeight, 2U);
+    BOOST_CHECK(AccessByTxid(cache, GetRandHash()).IsSpent());
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -9,6 +9,7 @@
 #include "crypto/sha512.h"
 #include "crypto/hmac_sha256.h"
 #include "crypto/hmac_sha512.h"
+#include "crypto/muhash.h"
 #include "random.h"
 #include "utilstrencodings.h"
 
@@ -131,6 +132,47 @@ BOOST_AUTO_TEST_CASE(sha256_testvectors) {
     TestSHA256(test1, "a316d55510b49662420f49d145d42fb83f31ef8dc016aa4e32df049991a91e26");
 }
 
+BOOST_AUTO_TEST_CASE(sha256_multi) {
+    // Whatever backends SHA256AutoDetect() picked, on counts that leave
+    // remainders for the narrower lanes and lengths around the padding edges.
+    std::vector<unsigned char> data(1024);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = insecure_rand();
+    const size_t lengths[] = {0, 1, 36, 55, 56, 63, 64, 65, 119, 120, 128, 300};
+    for (size_t t = 0; t < sizeof(lengths) / sizeof(lengths[0]); t++) {
+        for (size_t n = 0; n <= 13; n++) {
+            std::vector<const unsigned char*> in(n + 1);
+            std::vector<unsigned char> out(CSHA256::OUTPUT_SIZE * (n + 1));
+            for (size_t i = 0; i < n; i++)
+                in[i] = &data[i * 53];
+            SHA256Multi(&in[0], lengths[t], n, &out[0]);
+            for (size_t i = 0; i < n; i++) {
+                unsigned char ref[CSHA256::OUTPUT_SIZE];
+                CSHA256().Write(in[i], lengths[t]).Finalize(ref);
+                BOOST_CHECK(memcmp(ref, &out[CSHA256::OUTPUT_SIZE * i], sizeof(ref)) == 0);
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sha256_d64) {
+    // Against two rounds of CSHA256, on counts that leave remainders for the
+    // 4-way lanes and the single-stream path.
+    std::vector<unsigned char> data(64 * 32);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = insecure_rand();
+    for (size_t n = 0; n <= 32; n++) {
+        std::vector<unsigned char> out(CSHA256::OUTPUT_SIZE * (n + 1));
+        SHA256D64(&out[0], &data[0], n);
+        for (size_t i = 0; i < n; i++) {
+            unsigned char ref[CSHA256::OUTPUT_SIZE];
+            CSHA256().Write(&data[64 * i], 64).Finalize(ref);
+            CSHA256().Write(ref, sizeof(ref)).Finalize(ref);
+            BOOST_CHECK(memcmp(ref, &out[CSHA256::OUTPUT_SIZE * i], sizeof(ref)) == 0);
+        }
+    }
+}
+
 BOOST_AUTO_TEST_CASE(sha512_testvectors) {
     TestSHA512("",
                "cf83e1357eefb8bdf1542850d66d8007d620e4050b5715dc83f4a921d36ce9ce"
@@ -282,4 +324,77 @@ BOOST_AUTO_TEST_CASE(rfc6979_hmac_sha256)
             ("7597887cbd76321f32e30440679a22cf7f8d9d2eac390e581fea091ce202ba94"));
 }
 
+static std::vector<unsigned char> ToBytes(const Num3072& num)
+{
+    std::vector<unsigned char> out(Num3072::BYTE_SIZE);
+    num.ToBytes(&out[0]);
+    return out;
+}
+
+BOOST_AUTO_TEST_CASE(num3072_arithmetic)
+{
+    // p - 1 is -1, whose square is 1
+    std::vector<unsigned char> vMinusOne(Num3072::BYTE_SIZE, 0xff);
+    vMinusOne[0] = 0xff - 0x65;
+    vMinusOne[1] = 0xff - 0xd7;
+    vMinusOne[2] = 0xff - 0x10;
+    Num3072 minusOne(&vMinusOne[0]);
+    BOOST_CHECK(ToBytes(minusOne) == vMinusOne);
+    Num3072 x = minusOne;
+    x.Multiply(minusOne);
+    BOOST_CHECK(ToBytes(x) == ToBytes(Num3072()));
+
+    // Dividing undoes multiplying, for values on both sides of the modulus
+    for (int i = 0; i < 4; i++) {
+        std::vector<unsigned char> va(Num3072::BYTE_SIZE), vb(Num3072::BYTE_SIZE);
+        GetRandBytes(&va[0], va.size());
+        GetRandBytes(&vb[0], vb.size());
+        if (i & 1)
+            memset(&va[1], 0xff, va.size() - 1);
+        Num3072 a(&va[0]), b(&vb[0]);
+        Num3072 c = a;
+        c.Multiply(b);
+        c.Divide(b);
+        Num3072 d;
+        d.Multiply(a);
+        BOOST_CHECK(ToBytes(c) == ToBytes(d));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(muhash_multiset)
+{
+    const unsigned char a[] = "a", b[] = "b", c[] = "c";
+    unsigned char hashEmpty[32], hash1[32], hash2[32];
+    MuHash3072().Finalize(hashEmpty);
+
+    // Independent of order, and removing undoes inserting
+    MuHash3072 acc1, acc2;
+    acc1.Insert(a, 1).Insert(b, 1).Insert(c, 1).Remove(b, 1);
+    acc2.Remove(b, 1).Insert(c, 1).Insert(b, 1).Insert(a, 1);
+    acc1.Finalize(hash1);
+    acc2.Finalize(hash2);
+    BOOST_CHECK(memcmp(hash1, hash2, 32) == 0);
+    BOOST_CHECK(memcmp(hash1, hashEmpty, 32) != 0);
+
+    acc1.Remove(a, 1).Remove(c, 1);
+    acc1.Finalize(hash1);
+    BOOST_CHECK(memcmp(hash1, hashEmpty, 32) == 0);
+
+    // A multiset: inserting twice is not inserting once
+    MuHash3072 acc3;
+    acc3.Insert(a, 1).Insert(a, 1).Remove(a, 1);
+    acc3.Finalize(hash1);
+    MuHash3072().Insert(a, 1).Finalize(hash2);
+    BOOST_CHECK(memcmp(hash1, hash2, 32) == 0);
+
+    // The state round-trips
+    unsigned char state[MuHash3072::STATE_SIZE];
+    acc2.ToBytes(state);
+    MuHash3072 acc4;
+    acc4.FromBytes(state);
+    acc2.Finalize(hash1);
+    acc4.Finalize(hash2);
+    BOOST_CHECK(memcmp(hash1, hash2, 32) == 0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,140 @@
+// Copyright (c) 2016 Jeremy Rubin
+// Copyright (c) 2015-2017 The LUX developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "cuckoocache.h"
+#include "random.h"
+#include "script/sigcache.h"
+#include "uint256.h"
+
+#include <cstring>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+/** Test Suite for CuckooCache
+ *
+ *  1) All tests should have a deterministic result (using insecure rand
+ *  with deterministic seeds)
+ *  2) Some test methods are templated to allow for easier testing
+ *  against new versions / comparing
+ *  3) Results should be treated as a regression test, i.e., did the behavior
+ *  change significantly from what was expected. This can be OK, depending on
+ *  the nature of the change, but requires updating the tests to reflect the new
+ *  expected behavior. For example improving the hit rate may cause some tests
+ *  using BOOST_CHECK_CLOSE to fail.
+ *
+ */
+BOOST_AUTO_TEST_SUITE(cuckoocache_tests)
+
+namespace
+{
+/** Same extraction as the signature cache: entries are already random. */
+struct TestHasher {
+    template <uint8_t hash_select>
+    uint32_t operator()(const uint256& key) const
+    {
+        uint32_t u;
+        std::memcpy(&u, key.begin() + 4 * hash_select, 4);
+        return u;
+    }
+};
+
+typedef CuckooCache::cache<uint256, TestHasher> test_cache;
+
+uint256 InsecureRand256()
+{
+    uint256 r;
+    for (int i = 0; i < 8; i++) {
+        uint32_t v = insecure_rand();
+        std::memcpy(r.begin() + 4 * i, &v, 4);
+    }
+    return r;
+}
+
+/** Fraction of n freshly inserted random entries that are still found,
+ *  in a cache of megabytes MiB, after inserting load * capacity entries. */
+double HitRate(double load, size_t megabytes)
+{
+    seed_insecure_rand(true);
+    test_cache set;
+    uint32_t n = set.setup_bytes(megabytes << 20);
+    uint32_t n_insert = static_cast<uint32_t>(load * n);
+    std::vector<uint256> hashes(n_insert);
+    for (uint32_t i = 0; i < n_insert; ++i)
+        hashes[i] = InsecureRand256();
+    for (uint32_t i = 0; i < n_insert; ++i)
+        set.insert(hashes[i]);
+
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < n_insert; ++i)
+        count += set.contains(hashes[i], false);
+    return double(count) / double(n_insert);
+}
+} // anon namespace
+
+/* Test that no values not inserted into the cache are read out of it.
+ *
+ * There are no repeats in the first 200000 insecure_rand calls
+ */
+BOOST_AUTO_TEST_CASE(cuckoocache_no_fakes)
+{
+    seed_insecure_rand(true);
+    test_cache cc;
+    cc.setup_bytes(32 << 20);
+    for (int x = 0; x < 100000; ++x)
+        cc.insert(InsecureRand256());
+    for (int x = 0; x < 100000; ++x)
+        BOOST_CHECK(!cc.contains(InsecureRand256(), false));
+}
+
+/* Below the 90% load target nearly everything inserted stays in the cache. */
+BOOST_AUTO_TEST_CASE(cuckoocache_hit_rate_ok)
+{
+    for (double load = 0.1; load < 2; load *= 2) {
+        double hits = HitRate(load, 1);
+        BOOST_CHECK(hits > (load < 0.9 ? 0.99 : 0.4));
+    }
+}
+
+/* Entries marked for erasure are only dropped when their slot is needed. */
+BOOST_AUTO_TEST_CASE(cuckoocache_erase_ok)
+{
+    seed_insecure_rand(true);
+    test_cache set;
+    uint32_t n = set.setup_bytes(1 << 20);
+    uint32_t n_insert = n / 2;
+    std::vector<uint256> hashes(n_insert);
+    for (uint32_t i = 0; i < n_insert; ++i)
+        hashes[i] = InsecureRand256();
+
+    for (uint32_t i = 0; i < n_insert / 2; ++i)
+        set.insert(hashes[i]);
+    // Mark the first half as erasable
+    for (uint32_t i = 0; i < n_insert / 2; ++i)
+        BOOST_CHECK(set.contains(hashes[i], true));
+    // Erased entries can still be found until overwritten
+    uint32_t count_erased_found = 0;
+    for (uint32_t i = 0; i < n_insert / 2; ++i)
+        count_erased_found += set.contains(hashes[i], false);
+    BOOST_CHECK_EQUAL(count_erased_found, n_insert / 2);
+
+    for (uint32_t i = n_insert / 2; i < n_insert; ++i)
+        set.insert(hashes[i]);
+    // Everything not erased must survive
+    uint32_t count = 0;
+    for (uint32_t i = n_insert / 2; i < n_insert; ++i)
+        count += set.contains(hashes[i], false);
+    BOOST_CHECK(count > 0.99 * (n_insert - n_insert / 2));
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_stats)
+{
+    SignatureCacheStats stats;
+    GetSignatureCacheStats(stats);
+    BOOST_CHECK(stats.nElements >= 2);
+    BOOST_CHECK_EQUAL(stats.nBytes, stats.nElements * sizeof(uint256));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
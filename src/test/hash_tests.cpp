@@ -2,9 +2,13 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "crypto/phi1612.h"
 #include "hash.h"
+#include "primitives/block.h"
+#include "random.h"
 #include "utilstrencodings.h"
 
+#include <limits>
 #include <vector>
 
 #include <boost/test/unit_test.hpp>
@@ -46,4 +50,121 @@ BOOST_AUTO_TEST_CASE(murmurhash3)
 #undef T
 }
 
+BOOST_AUTO_TEST_CASE(siphash)
+{
+    // Test vectors from the SipHash reference implementation, 8 bytes at a time.
+    CSipHasher hasher(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x726fdb47dd0e0e31ull);
+    hasher.Write(0x0706050403020100ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x93f5f5799a932462ull);
+    hasher.Write(0x0F0E0D0C0B0A0908ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x3f2acc7f57c29bdbull);
+    hasher.Write(0x1716151413121110ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0xb8ad50c6f649af94ull);
+    hasher.Write(0x1F1E1D1C1B1A1918ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x7127512f72f27cceull);
+    BOOST_CHECK_EQUAL(SipHashUint256(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, uint256("1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100")), 0x7127512f72f27cceull);
+
+    // The uint256 specialization matches the generic hasher.
+    for (int i = 0; i < 16; i++) {
+        uint64_t k0 = GetRand(std::numeric_limits<uint64_t>::max());
+        uint64_t k1 = GetRand(std::numeric_limits<uint64_t>::max());
+        uint256 x = GetRandHash();
+        CSipHasher sip256(k0, k1);
+        sip256.Write(x.Get64(0)).Write(x.Get64(1)).Write(x.Get64(2)).Write(x.Get64(3));
+        BOOST_CHECK_EQUAL(SipHashUint256(k0, k1, x), sip256.Finalize());
+    }
+}
+
+
+BOOST_AUTO_TEST_CASE(phi1612_batch)
+{
+    // The mainnet genesis header, as a known answer for both paths.
+    CBlockHeader genesis;
+    genesis.nVersion = 1;
+    genesis.hashPrevBlock = 0;
+    genesis.hashMerkleRoot = uint256("0xe08ae0cfc35a1d70e6764f347fdc54355206adeb382446dd54c32cd0201000d3");
+    genesis.nTime = 1507656633;
+    genesis.nBits = 0x1e0fffff;
+    genesis.nNonce = 986946;
+    const uint256 hashGenesis("0x00000759bb3da130d7c9aedae170da8335f5a0d01a9007e4c8d3ccd08ace6a42");
+    uint256 hashScalar;
+    Phi1612Scalar((const unsigned char*)BEGIN(genesis.nVersion), hashScalar.begin());
+    BOOST_CHECK(hashScalar == hashGenesis);
+
+    // The batch API must agree with the scalar hash for every count, including
+    // ones that leave a partial group of lanes for the scalar tail. The batch
+    // seeds each header's memoized hash, so the reference is computed from the
+    // raw header bytes rather than through GetHash().
+    for (size_t n = 0; n <= 19; n++) {
+        vector<CBlockHeader> vHeaders(n);
+        vector<const CBlockHeader*> vpHeaders(n);
+        vector<uint256> vHashes(n);
+        for (size_t i = 0; i < n; i++) {
+            CBlockHeader& header = vHeaders[i];
+            if (i == n / 2) {
+                header = genesis;
+            } else {
+                header.nVersion = insecure_rand();
+                header.hashPrevBlock = GetRandHash();
+                header.hashMerkleRoot = GetRandHash();
+                header.nTime = insecure_rand();
+                header.nBits = insecure_rand();
+                header.nNonce = insecure_rand();
+            }
+            vpHeaders[i] = &header;
+        }
+        if (n > 0)
+            Phi1612Batch(&vpHeaders[0], n, &vHashes[0]);
+        for (size_t i = 0; i < n; i++) {
+            uint256 hashExpected;
+            Phi1612Scalar((const unsigned char*)BEGIN(vHeaders[i].nVersion), hashExpected.begin());
+            BOOST_CHECK(vHashes[i] == hashExpected);
+            if (i == n / 2)
+                BOOST_CHECK(vHashes[i] == hashGenesis);
+        }
+    }
+}
+
+
+BOOST_AUTO_TEST_CASE(phi1612_memoized_header_hash)
+{
+    CBlockHeader header;
+    header.hashPrevBlock = GetRandHash();
+    header.hashMerkleRoot = GetRandHash();
+    header.nTime = insecure_rand();
+    header.nBits = 0x1e0fffff;
+
+    // Repeated calls only evaluate the chain once.
+    uint64_t nStart = GetPhi1612EvaluationCount();
+    uint256 hash = header.GetHash();
+    BOOST_CHECK(header.GetHash() == hash);
+    BOOST_CHECK(CBlock(header).GetHash() == hash);
+    BOOST_CHECK_EQUAL(GetPhi1612EvaluationCount() - nStart, 1U);
+
+    // Direct field assignment invalidates the memoized value.
+    header.nNonce++;
+    uint256 hashNext = header.GetHash();
+    BOOST_CHECK(hashNext != hash);
+    CBlockHeader fresh;
+    fresh.hashPrevBlock = header.hashPrevBlock;
+    fresh.hashMerkleRoot = header.hashMerkleRoot;
+    fresh.nTime = header.nTime;
+    fresh.nBits = header.nBits;
+    fresh.nNonce = header.nNonce;
+    BOOST_CHECK(fresh.GetHash() == hashNext);
+    header.nNonce--;
+    BOOST_CHECK(header.GetHash() == hash);
+    BOOST_CHECK_EQUAL(GetPhi1612EvaluationCount() - nStart, 4U);
+
+    // The batch API seeds the memoized value.
+    header.nTime++;
+    const CBlockHeader* pheader = &header;
+    uint256 hashBatch;
+    Phi1612Batch(&pheader, 1, &hashBatch);
+    nStart = GetPhi1612EvaluationCount();
+    BOOST_CHECK(header.GetHash() == hashBatch);
+    BOOST_CHECK_EQUAL(GetPhi1612EvaluationCount() - nStart, 0U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -8,6 +8,7 @@
 
 #include <boost/test/unit_test.hpp>
 #include <list>
+#include <vector>
 
 BOOST_AUTO_TEST_SUITE(mempool_tests)
 
@@ -99,4 +100,200 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+
+template <int index>
+void CheckSort(CTxMemPool& pool, std::vector<std::string>& sortedOrder)
+{
+    BOOST_CHECK_EQUAL(pool.size(), sortedOrder.size());
+    typename CTxMemPool::indexed_transaction_set::nth_index<index>::type::iterator it = pool.mapTx.get<index>().begin();
+    int count = 0;
+    for (; it != pool.mapTx.get<index>().end(); ++it, ++count) {
+        BOOST_CHECK_EQUAL(it->GetTx().GetHash().ToString(), sortedOrder[count]);
+    }
+}
+
+static CMutableTransaction MakeTx(const uint256& hashPrev, unsigned int nOut, CAmount nValue, unsigned int nOutputs = 1)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << OP_11;
+    tx.vin[0].prevout.hash = hashPrev;
+    tx.vin[0].prevout.n = nOut;
+    tx.vout.resize(nOutputs);
+    for (unsigned int i = 0; i < nOutputs; i++) {
+        tx.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx.vout[i].nValue = nValue;
+    }
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    /* 3rd highest fee */
+    CMutableTransaction tx1 = MakeTx(uint256(1), 0, 10 * COIN);
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 10000LL, 0, 10.0, 1));
+
+    /* highest fee */
+    CMutableTransaction tx2 = MakeTx(uint256(2), 0, 2 * COIN);
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 20000LL, 0, 9.0, 1));
+
+    /* lowest fee */
+    CMutableTransaction tx3 = MakeTx(uint256(3), 0, 5 * COIN);
+    pool.addUnchecked(tx3.GetHash(), CTxMemPoolEntry(tx3, 0LL, 0, 100.0, 1));
+
+    /* 2nd highest fee */
+    CMutableTransaction tx4 = MakeTx(uint256(4), 0, 6 * COIN);
+    pool.addUnchecked(tx4.GetHash(), CTxMemPoolEntry(tx4, 15000LL, 0, 1.0, 1));
+
+    // All transactions have the same size, so fee rate follows fee.
+    std::vector<std::string> sortedOrder;
+    sortedOrder.push_back(tx2.GetHash().ToString());
+    sortedOrder.push_back(tx4.GetHash().ToString());
+    sortedOrder.push_back(tx1.GetHash().ToString());
+    sortedOrder.push_back(tx3.GetHash().ToString());
+    CheckSort<1>(pool, sortedOrder);
+
+    // Descendant score: lowest first.
+    std::reverse(sortedOrder.begin(), sortedOrder.end());
+    CheckSort<2>(pool, sortedOrder);
+
+    /* Child of the lowest fee transaction, paying enough for both */
+    CMutableTransaction tx5 = MakeTx(tx3.GetHash(), 0, 4 * COIN);
+    CTxMemPoolEntry entry5(tx5, 100000LL, 1, 10.0, 1);
+    CTxMemPool::setEntries setAncestors;
+    std::string dummy;
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(entry5, setAncestors, 100, 1000000, 100, 1000000, dummy));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 1U);
+    pool.addUnchecked(tx5.GetHash(), entry5, setAncestors);
+
+    CTxMemPool::txiter it3 = pool.mapTx.find(tx3.GetHash());
+    CTxMemPool::txiter it5 = pool.mapTx.find(tx5.GetHash());
+    BOOST_CHECK_EQUAL(it3->GetCountWithDescendants(), 2U);
+    BOOST_CHECK_EQUAL(it3->GetModFeesWithDescendants(), 100000LL);
+    BOOST_CHECK_EQUAL(it3->GetSizeWithDescendants(), it3->GetTxSize() + it5->GetTxSize());
+    BOOST_CHECK_EQUAL(it5->GetCountWithAncestors(), 2U);
+    BOOST_CHECK_EQUAL(it5->GetModFeesWithAncestors(), 100000LL);
+
+    // With its child, tx3 is no longer the cheapest package to evict.
+    sortedOrder.clear();
+    sortedOrder.push_back(tx1.GetHash().ToString());
+    sortedOrder.push_back(tx4.GetHash().ToString());
+    sortedOrder.push_back(tx2.GetHash().ToString());
+    sortedOrder.push_back(tx3.GetHash().ToString());
+    sortedOrder.push_back(tx5.GetHash().ToString());
+    CheckSort<2>(pool, sortedOrder);
+
+    // Ancestor score: tx5 is mined with tx3, at their combined fee rate.
+    sortedOrder.clear();
+    sortedOrder.push_back(tx5.GetHash().ToString());
+    sortedOrder.push_back(tx2.GetHash().ToString());
+    sortedOrder.push_back(tx4.GetHash().ToString());
+    sortedOrder.push_back(tx1.GetHash().ToString());
+    sortedOrder.push_back(tx3.GetHash().ToString());
+    CheckSort<4>(pool, sortedOrder);
+
+    // Most recent entry last.
+    BOOST_CHECK(pool.mapTx.get<entry_time>().rbegin()->GetTx().GetHash() == tx5.GetHash());
+
+    // Prioritising the parent moves its whole package.
+    pool.PrioritiseTransaction(tx3.GetHash(), tx3.GetHash().ToString(), 0.0, 200000LL);
+    BOOST_CHECK_EQUAL(it3->GetModFeesWithDescendants(), 300000LL);
+    BOOST_CHECK_EQUAL(it5->GetModFeesWithAncestors(), 300000LL);
+    BOOST_CHECK(pool.mapTx.get<ancestor_score>().begin()->GetTx().GetHash() == tx3.GetHash());
+
+    // Removing the parent for a block leaves the child with no ancestors.
+    std::vector<CTransaction> vtx;
+    vtx.push_back(tx3);
+    std::list<CTransaction> conflicts;
+    pool.removeForBlock(vtx, 2, conflicts);
+    BOOST_CHECK_EQUAL(pool.size(), 4U);
+    it5 = pool.mapTx.find(tx5.GetHash());
+    BOOST_CHECK_EQUAL(it5->GetCountWithAncestors(), 1U);
+    BOOST_CHECK_EQUAL(it5->GetModFeesWithAncestors(), 100000LL);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolChainLimitTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    std::string errString;
+
+    // A chain of three transactions.
+    CMutableTransaction tx1 = MakeTx(uint256(1), 0, 10 * COIN);
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 1000LL, 0, 0.0, 1));
+    CMutableTransaction tx2 = MakeTx(tx1.GetHash(), 0, 9 * COIN);
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 1000LL, 0, 0.0, 1));
+    CMutableTransaction tx3 = MakeTx(tx2.GetHash(), 0, 8 * COIN);
+    CTxMemPoolEntry entry3(tx3, 1000LL, 0, 0.0, 1);
+
+    CTxMemPool::setEntries setAncestors;
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(entry3, setAncestors, 3, 1000000, 3, 1000000, errString));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 2U);
+
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entry3, setAncestors, 2, 1000000, 3, 1000000, errString));
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entry3, setAncestors, 3, 1000000, 2, 1000000, errString));
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+
+    CMutableTransaction tx1 = MakeTx(uint256(1), 0, 10 * COIN);
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 10000LL, 0, 0.0, 1));
+    CMutableTransaction tx2 = MakeTx(uint256(2), 0, 10 * COIN);
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 5000LL, 0, 0.0, 1));
+
+    // Nothing to trim.
+    pool.TrimToSize(pool.DynamicMemoryUsage());
+    BOOST_CHECK(pool.exists(tx1.GetHash()));
+    BOOST_CHECK(pool.exists(tx2.GetHash()));
+    BOOST_CHECK(pool.GetMinFee(1).GetFeePerK() == 0);
+
+    // Trimming by one byte evicts the lowest fee rate transaction.
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK(pool.exists(tx1.GetHash()));
+    BOOST_CHECK(!pool.exists(tx2.GetHash()));
+
+    // A low fee parent with a high fee child is evicted as a package, after
+    // a higher fee rate transaction.
+    CMutableTransaction tx3 = MakeTx(uint256(3), 0, 10 * COIN);
+    pool.addUnchecked(tx3.GetHash(), CTxMemPoolEntry(tx3, 0LL, 0, 0.0, 1));
+    CMutableTransaction tx4 = MakeTx(tx3.GetHash(), 0, 9 * COIN);
+    pool.addUnchecked(tx4.GetHash(), CTxMemPoolEntry(tx4, 15000LL, 0, 0.0, 1));
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK(pool.exists(tx1.GetHash()));
+    BOOST_CHECK(!pool.exists(tx3.GetHash()));
+    BOOST_CHECK(!pool.exists(tx4.GetHash()));
+
+    // The minimum fee is raised above the evicted package's fee rate.
+    CTxMemPoolEntry entry4(tx4, 15000LL, 0, 0.0, 1);
+    CFeeRate removed(15000LL, 2 * entry4.GetTxSize());
+    BOOST_CHECK(pool.GetMinFee(1).GetFeePerK() == removed.GetFeePerK() + 1000);
+
+    pool.TrimToSize(0);
+    BOOST_CHECK_EQUAL(pool.size(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolExpiryTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    CMutableTransaction tx1 = MakeTx(uint256(1), 0, 10 * COIN);
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 1000LL, 100, 0.0, 1));
+    CMutableTransaction tx2 = MakeTx(tx1.GetHash(), 0, 9 * COIN);
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 1000LL, 300, 0.0, 1));
+    CMutableTransaction tx3 = MakeTx(uint256(3), 0, 10 * COIN);
+    pool.addUnchecked(tx3.GetHash(), CTxMemPoolEntry(tx3, 1000LL, 200, 0.0, 1));
+
+    BOOST_CHECK_EQUAL(pool.Expire(100), 0);
+    // Expiring the parent takes its younger child with it.
+    BOOST_CHECK_EQUAL(pool.Expire(150), 2);
+    BOOST_CHECK(!pool.exists(tx1.GetHash()));
+    BOOST_CHECK(!pool.exists(tx2.GetHash()));
+    BOOST_CHECK(pool.exists(tx3.GetHash()));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,157 @@
+// Copyright (c) 2015-2017 The LUX developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "hash.h"
+#include "merkleblock.h"
+#include "primitives/block.h"
+#include "random.h"
+#include "uint256.h"
+#include "utilstrencodings.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+// The merkle root as computed before the levels were batched: one Hash()
+// per pair, the last node of an odd level paired with itself.
+static uint256 NaiveMerkleRoot(std::vector<uint256> vLevel, bool& fMutated)
+{
+    fMutated = false;
+    if (vLevel.empty())
+        return 0;
+    while (vLevel.size() > 1) {
+        std::vector<uint256> vNext;
+        for (size_t i = 0; i < vLevel.size(); i += 2) {
+            size_t i2 = std::min(i + 1, vLevel.size() - 1);
+            if (i2 == i + 1 && i2 + 1 == vLevel.size() && vLevel[i] == vLevel[i2])
+                fMutated = true;
+            vNext.push_back(Hash(BEGIN(vLevel[i]), END(vLevel[i]), BEGIN(vLevel[i2]), END(vLevel[i2])));
+        }
+        vLevel.swap(vNext);
+    }
+    return vLevel[0];
+}
+
+static std::vector<uint256> TxHashes(const CBlock& block)
+{
+    std::vector<uint256> vHashes;
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+        vHashes.push_back(block.vtx[i].GetHash());
+    return vHashes;
+}
+
+static void AddDummyTransactions(CBlock& block, unsigned int nTx)
+{
+    for (unsigned int i = 0; i < nTx; i++) {
+        CMutableTransaction tx;
+        tx.nLockTime = block.vtx.size(); // only needs distinct txids
+        block.vtx.push_back(CTransaction(tx));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(merkle_tests)
+
+BOOST_AUTO_TEST_CASE(merkle_root_equivalence)
+{
+    for (unsigned int nTx = 0; nTx <= 70; nTx++) {
+        CBlock block;
+        AddDummyTransactions(block, nTx);
+        bool fMutated = true, fNaiveMutated = true;
+        uint256 root = block.BuildMerkleTree(&fMutated);
+        BOOST_CHECK(root == NaiveMerkleRoot(TxHashes(block), fNaiveMutated));
+        BOOST_CHECK(!fMutated && !fNaiveMutated);
+
+        // every branch leads back to the root
+        for (unsigned int i = 0; i < nTx; i++)
+            BOOST_CHECK(CBlock::CheckMerkleBranch(block.vtx[i].GetHash(), block.GetMerkleBranch(i), i) == root);
+    }
+
+    // and a few large, odd sized blocks
+    const unsigned int nLarge[] = {1023, 1025, 2047, 4095};
+    for (unsigned int t = 0; t < sizeof(nLarge) / sizeof(nLarge[0]); t++) {
+        CBlock block;
+        AddDummyTransactions(block, nLarge[t]);
+        bool fMutated, fNaiveMutated;
+        BOOST_CHECK(block.BuildMerkleTree(&fMutated) == NaiveMerkleRoot(TxHashes(block), fNaiveMutated));
+        BOOST_CHECK(!fMutated && !fNaiveMutated);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(merkle_tree_levels)
+{
+    // all levels match the ones the per-pair loop appended
+    std::vector<uint256> vTree;
+    for (int i = 0; i < 37; i++)
+        vTree.push_back(GetRandHash());
+    std::vector<uint256> vExpected(vTree);
+    size_t j = 0;
+    for (size_t nSize = vExpected.size(); nSize > 1; nSize = (nSize + 1) / 2) {
+        for (size_t i = 0; i < nSize; i += 2) {
+            size_t i2 = std::min(i + 1, nSize - 1);
+            vExpected.push_back(Hash(BEGIN(vExpected[j + i]), END(vExpected[j + i]),
+                BEGIN(vExpected[j + i2]), END(vExpected[j + i2])));
+        }
+        j += nSize;
+    }
+    uint256 root = ComputeMerkleTreeLevels(vTree);
+    BOOST_CHECK(vTree == vExpected);
+    BOOST_CHECK(root == vExpected.back());
+    BOOST_CHECK(MerkleHash(vExpected[0], vExpected[1]) == vExpected[37]);
+}
+
+BOOST_AUTO_TEST_CASE(merkle_mutation)
+{
+    // [1,2,3,4,5,6] and [1,2,3,4,5,6,5,6] have the same root; the second is flagged
+    CBlock block;
+    AddDummyTransactions(block, 6);
+    bool fMutated = true;
+    uint256 root = block.BuildMerkleTree(&fMutated);
+    BOOST_CHECK(!fMutated);
+
+    CBlock blockDup(block);
+    blockDup.vtx.push_back(block.vtx[4]);
+    blockDup.vtx.push_back(block.vtx[5]);
+    bool fNaiveMutated = false;
+    BOOST_CHECK(blockDup.BuildMerkleTree(&fMutated) == root);
+    BOOST_CHECK(fMutated);
+    BOOST_CHECK(NaiveMerkleRoot(TxHashes(blockDup), fNaiveMutated) == root);
+    BOOST_CHECK(fNaiveMutated);
+
+    // a duplicated last transaction, caught at the leaf level
+    for (unsigned int nTx = 1; nTx <= 33; nTx += 2) {
+        CBlock blockOdd;
+        AddDummyTransactions(blockOdd, nTx);
+        uint256 rootOdd = blockOdd.BuildMerkleTree(&fMutated);
+        BOOST_CHECK(!fMutated);
+        blockOdd.vtx.push_back(blockOdd.vtx.back());
+        BOOST_CHECK(blockOdd.BuildMerkleTree(&fMutated) == rootOdd);
+        BOOST_CHECK(fMutated);
+        BOOST_CHECK(NaiveMerkleRoot(TxHashes(blockOdd), fNaiveMutated) == rootOdd);
+        BOOST_CHECK(fNaiveMutated);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(merkle_partial_tree)
+{
+    // the hashes CPartialMerkleTree stores give back the root and matches
+    for (unsigned int nTx = 1; nTx <= 40; nTx++) {
+        CBlock block;
+        AddDummyTransactions(block, nTx);
+        uint256 root = block.BuildMerkleTree();
+        std::vector<uint256> vTxid = TxHashes(block);
+        std::vector<bool> vMatch(nTx, false);
+        std::vector<uint256> vExpected;
+        for (unsigned int i = 0; i < nTx; i++) {
+            vMatch[i] = (i % 3 == 1) || i + 1 == nTx;
+            if (vMatch[i])
+                vExpected.push_back(vTxid[i]);
+        }
+        CPartialMerkleTree pmt(vTxid, vMatch);
+        std::vector<uint256> vMatched;
+        BOOST_CHECK(pmt.ExtractMatches(vMatched) == root);
+        BOOST_CHECK(vMatched == vExpected);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -140,6 +140,8 @@ BOOST_AUTO_TEST_CASE(sighash_test)
         uint256 sh, sho;
         sho = SignatureHashOld(scriptCode, txTo, nIn, nHashType);
         sh = SignatureHash(scriptCode, txTo, nIn, nHashType);
+        PrecomputedTransactionData txdata(txTo);
+        BOOST_CHECK(SignatureHash(scriptCode, txTo, nIn, nHashType, &txdata) == sho);
         #if defined(PRINT_SIGHASH_JSON)
         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
         ss << txTo;
@@ -209,6 +211,48 @@ BOOST_AUTO_TEST_CASE(sighash_from_data)
 
         sh = SignatureHash(scriptCode, tx, nIn, nHashType);
         BOOST_CHECK_MESSAGE(sh.GetHex() == sigHashHex, strTest);
+        PrecomputedTransactionData txdata(tx);
+        sh = SignatureHash(scriptCode, tx, nIn, nHashType, &txdata);
+        BOOST_CHECK_MESSAGE(sh.GetHex() == sigHashHex, strTest);
+    }
+}
+
+// Goal: check that the precomputed data gives the same hash for every input
+// of a transaction with many inputs, whatever the hash type
+BOOST_AUTO_TEST_CASE(sighash_precomputed)
+{
+    seed_insecure_rand(false);
+
+    CMutableTransaction txTo;
+    RandomTransaction(txTo, false);
+    for (int i = 0; i < 100; i++) {
+        CTxIn txin;
+        txin.prevout.hash = GetRandHash();
+        txin.prevout.n = i;
+        RandomScript(txin.scriptSig);
+        txin.nSequence = (insecure_rand() % 2) ? insecure_rand() : (unsigned int)-1;
+        txTo.vin.push_back(txin);
+    }
+    // an output for each input, so that SIGHASH_SINGLE is in range everywhere
+    while (txTo.vout.size() < txTo.vin.size()) {
+        CTxOut txout;
+        txout.nValue = insecure_rand() % 100000000;
+        RandomScript(txout.scriptPubKey);
+        txTo.vout.push_back(txout);
+    }
+    CTransaction tx(txTo);
+    PrecomputedTransactionData txdata(tx);
+
+    const int hashTypes[] = {0, SIGHASH_ALL, SIGHASH_NONE, SIGHASH_SINGLE, 0x41,
+        SIGHASH_ALL | SIGHASH_ANYONECANPAY, SIGHASH_NONE | SIGHASH_ANYONECANPAY, SIGHASH_SINGLE | SIGHASH_ANYONECANPAY};
+    for (unsigned int t = 0; t < sizeof(hashTypes) / sizeof(hashTypes[0]); t++) {
+        for (unsigned int nIn = 0; nIn < tx.vin.size(); nIn++) {
+            CScript scriptCode;
+            RandomScript(scriptCode);
+            uint256 sho = SignatureHashOld(scriptCode, tx, nIn, hashTypes[t]);
+            BOOST_CHECK(SignatureHash(scriptCode, tx, nIn, hashTypes[t], &txdata) == sho);
+            BOOST_CHECK(SignatureHash(scriptCode, tx, nIn, hashTypes[t]) == sho);
+        }
     }
 }
 BOOST_AUTO_TEST_SUITE_END()
@@ -7,6 +7,7 @@
 #include "clientversion.h"
 #include "primitives/transaction.h"
 #include "random.h"
+#include "streams.h"
 #include "sync.h"
 #include "utilstrencodings.h"
 #include "utilmoneystr.h"
@@ -14,6 +15,7 @@
 #include <stdint.h>
 #include <vector>
 
+#include <boost/filesystem.hpp>
 #include <boost/test/unit_test.hpp>
 
 using namespace std;
@@ -354,4 +356,44 @@ BOOST_AUTO_TEST_CASE(test_FormatSubVersion)
     BOOST_CHECK_EQUAL(FormatSubVersion("Test", 99900, comments),std::string("/Test:0.9.99(comment1)/"));
     BOOST_CHECK_EQUAL(FormatSubVersion("Test", 99900, comments2),std::string("/Test:0.9.99(comment1; comment2)/"));
 }
+
+BOOST_AUTO_TEST_CASE(util_CMappedFile)
+{
+    boost::filesystem::path path = GetTempPath() / strprintf("test_lux_mapped_%i.dat", (int)GetRand(100000));
+
+    std::vector<unsigned char> vch(100000);
+    for (size_t i = 0; i < vch.size(); i++)
+        vch[i] = insecure_rand();
+    uint64_t n = 0x0123456789abcdefULL;
+    {
+        CAutoFile fileout(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        BOOST_REQUIRE(!fileout.IsNull());
+        fileout << vch << n;
+    }
+
+    {
+        CMappedFile mapped(path);
+#ifndef WIN32
+        BOOST_REQUIRE(!mapped.IsNull());
+        BOOST_CHECK_EQUAL(mapped.size(), boost::filesystem::file_size(path));
+
+        CBufferReader filein(mapped.begin(), mapped.end(), SER_DISK, CLIENT_VERSION);
+        std::vector<unsigned char> vchRead;
+        uint64_t nRead = 0;
+        filein >> vchRead >> nRead;
+        BOOST_CHECK(vchRead == vch);
+        BOOST_CHECK_EQUAL(nRead, n);
+        BOOST_CHECK(filein.empty());
+        BOOST_CHECK_EQUAL(filein.tell(), mapped.size());
+        BOOST_CHECK_THROW(filein >> nRead, std::ios_base::failure);
+#endif
+    }
+
+    // Missing and empty files are not mapped
+    boost::filesystem::remove(path);
+    BOOST_CHECK(CMappedFile(path).IsNull());
+    fclose(fopen(path.string().c_str(), "wb"));
+    BOOST_CHECK(CMappedFile(path).IsNull());
+    boost::filesystem::remove(path);
+}
 BOOST_AUTO_TEST_SUITE_END()
@@ -5,9 +5,11 @@
 
 #include "txdb.h"
 
+#include "init.h"
 #include "main.h"
 #include "pow.h"
 #include "stake.h"
+#include "ui_interface.h"
 
 #include <stdint.h>
 
@@ -17,13 +19,106 @@ extern map<uint256, uint256> mapProofOfStake;
 
 using namespace std;
 
-void static BatchWriteCoins(CLevelDBBatch& batch, const uint256& hash, const CCoins& coins)
+//! Block index records read per window at startup; one window is decoded while the next is read
+static const size_t BLOCK_INDEX_LOAD_WINDOW = 16384;
+
+//! Key prefix of per-output chainstate records
+static const char DB_COIN = 'C';
+//! Key prefix of the per-transaction records used before the per-output chainstate
+static const char DB_COINS = 'c';
+//! Key of the running UTXO set totals, written together with the best block
+static const char DB_RUNNING_STATS = 'S';
+
+//! Flush the chainstate upgrade batch once it holds this many bytes
+static const size_t UPGRADE_BATCH_SIZE = 1 << 24;
+
+namespace
 {
-    if (coins.IsPruned())
-        batch.Erase(make_pair('c', hash));
-    else
-        batch.Write(make_pair('c', hash), coins);
-}
+/** Database key of a coin: DB_COIN, the txid and VARINT(n). */
+struct CoinEntry {
+    COutPoint* outpoint;
+    char key;
+    CoinEntry(const COutPoint* ptr) : outpoint(const_cast<COutPoint*>(ptr)), key(DB_COIN) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(key);
+        READWRITE(outpoint->hash);
+        READWRITE(VARINT(outpoint->n));
+    }
+};
+
+/**
+ * Per-transaction coins record of the legacy chainstate, kept to read
+ * databases written before the per-output layout. fCoinStake is stored in the
+ * second bit of the header code.
+ *
+ * Serialized format:
+ * - VARINT(nVersion)
+ * - VARINT(nCode)
+ * - unspentness bitvector, for vout[2] and further; least significant byte first
+ * - the non-spent CTxOuts (via CTxOutCompressor)
+ * - VARINT(nHeight)
+ *
+ * The nCode value consists of:
+ * - bit 1: IsCoinBase()
+ * - bit 2: IsCoinStake()
+ * - bit 4: vout[0] is not spent
+ * - bit 8: vout[1] is not spent
+ * - The higher bits encode N, the number of non-zero bytes in the following bitvector.
+ *   - In case both bit 4 and bit 8 are unset, they encode N-1, as there must be at
+ *     least one non-spent output).
+ */
+class CLegacyCoins
+{
+public:
+    bool fCoinBase;
+    bool fCoinStake;
+    std::vector<CTxOut> vout;
+    int nHeight;
+
+    CLegacyCoins() : fCoinBase(false), fCoinStake(false), nHeight(0) {}
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        unsigned int nCode = 0;
+        // version
+        int nTxVersion = 0;
+        ::Unserialize(s, VARINT(nTxVersion), nType, nVersion);
+        // header code
+        ::Unserialize(s, VARINT(nCode), nType, nVersion);
+        fCoinBase = (nCode & 1) != 0;
+        fCoinStake = (nCode & 2) != 0;
+        std::vector<bool> vAvail(2, false);
+        vAvail[0] = (nCode & 4) != 0;
+        vAvail[1] = (nCode & 8) != 0;
+        unsigned int nMaskCode = (nCode / 16) + ((nCode & 12) != 0 ? 0 : 1);
+        // spentness bitmask
+        while (nMaskCode > 0) {
+            unsigned char chAvail = 0;
+            ::Unserialize(s, chAvail, nType, nVersion);
+            for (unsigned int p = 0; p < 8; p++) {
+                bool f = (chAvail & (1 << p)) != 0;
+                vAvail.push_back(f);
+            }
+            if (chAvail != 0)
+                nMaskCode--;
+        }
+        // txouts themself
+        vout.assign(vAvail.size(), CTxOut());
+        for (unsigned int i = 0; i < vAvail.size(); i++) {
+            if (vAvail[i])
+                ::Unserialize(s, REF(CTxOutCompressor(vout[i])), nType, nVersion);
+        }
+        // coinbase height
+        ::Unserialize(s, VARINT(nHeight), nType, nVersion);
+    }
+};
+} // anon namespace
 
 void static BatchWriteHashBestChain(CLevelDBBatch& batch, const uint256& hash)
 {
@@ -34,14 +129,43 @@ CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(Get
 {
 }
 
-bool CCoinsViewDB::GetCoins(const uint256& txid, CCoins& coins) const
+bool CCoinsViewDB::GetCoin(const COutPoint& outpoint, Coin& coin) const
 {
-    return db.Read(make_pair('c', txid), coins);
+    return db.Read(CoinEntry(&outpoint), coin);
 }
 
-bool CCoinsViewDB::HaveCoins(const uint256& txid) const
+bool CCoinsViewDB::HaveCoin(const COutPoint& outpoint) const
 {
-    return db.Exists(make_pair('c', txid));
+    return db.Exists(CoinEntry(&outpoint));
+}
+
+bool CCoinsViewDB::FindCoinByTxid(const uint256& txid, uint32_t nFrom, uint32_t nEnd, COutPoint& outpoint) const
+{
+    // VARINT does not sort like the numbers it encodes, so every record of
+    // txid is looked at rather than seeking straight to nFrom.
+    boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair(DB_COIN, txid);
+    pcursor->Seek(ssKeySet.str());
+    bool fFound = false;
+    for (; pcursor->Valid(); pcursor->Next()) {
+        leveldb::Slice slKey = pcursor->key();
+        if (slKey.size() <= ssKeySet.size() || memcmp(slKey.data(), &ssKeySet[0], ssKeySet.size()) != 0)
+            break;
+        COutPoint key;
+        try {
+            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            CoinEntry entry(&key);
+            ssKey >> entry;
+        } catch (const std::exception& e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+        if (key.n >= nFrom && key.n < nEnd && (!fFound || key.n < outpoint.n)) {
+            outpoint = key;
+            fFound = true;
+        }
+    }
+    return fFound;
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const
@@ -52,27 +176,324 @@ uint256 CCoinsViewDB::GetBestBlock() const
     return hashBestChain;
 }
 
-bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
+bool CCoinsViewDB::GetRunningStats(CCoinsRunningStats& stats) const
+{
+    // Totals stored for another block were left behind by a writer that did
+    // not keep them; RebuildRunningStats() has to start over.
+    return db.Read(DB_RUNNING_STATS, stats) && stats.hashBlock == GetBestBlock();
+}
+
+bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, const CCoinsRunningStats* pstats)
 {
     CLevelDBBatch batch;
     size_t count = 0;
     size_t changed = 0;
-    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            BatchWriteCoins(batch, it->first, it->second.coins);
+            CoinEntry entry(&it->first);
+            if (it->second.coin.IsSpent())
+                batch.Erase(entry);
+            else
+                batch.Write(entry, it->second.coin);
             changed++;
         }
         count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
+        it++;
     }
-    if (hashBlock != uint256(0))
+    if (hashBlock != uint256(0)) {
         BatchWriteHashBestChain(batch, hashBlock);
+        if (pstats) {
+            CCoinsRunningStats stats = *pstats;
+            stats.hashBlock = hashBlock;
+            batch.Write(DB_RUNNING_STATS, stats);
+        }
+    }
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+    LogPrint("coindb", "Committing %u changed transaction outputs (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
     return db.WriteBatch(batch);
 }
 
+bool CCoinsViewDB::Upgrade()
+{
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewIterator());
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair(DB_COINS, uint256(0));
+    pcursor->Seek(ssKeySet.str());
+    if (!pcursor->Valid() || pcursor->key().empty() || pcursor->key()[0] != DB_COINS)
+        return true;
+
+    int64_t nStart = GetTimeMillis();
+    LogPrintf("Upgrading chainstate to one record per transaction output...\n");
+    uiInterface.ShowProgress(_("Upgrading chainstate database..."), 0);
+
+    CLevelDBBatch batch;
+    uint64_t nTransactions = 0;
+    uint64_t nOutputs = 0;
+    int nReportDone = 0;
+    pair<char, uint256> keyLast(DB_COINS, uint256(0));
+    pair<char, uint256> keyPrev(DB_COINS, uint256(0));
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested())
+            break;
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            if (slKey.empty() || slKey[0] != DB_COINS)
+                break;
+            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            pair<char, uint256> key;
+            ssKey >> key;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            CLegacyCoins coins;
+            ssValue >> coins;
+
+            // The per-transaction records did not keep the transaction time
+            unsigned int nTime = 0;
+            if (!GetTransactionTime(key.second, coins.nHeight, nTime))
+                return error("%s : cannot read transaction %s at height %d; restart with -reindex", __func__, key.second.ToString(), coins.nHeight);
+
+            COutPoint outpoint(key.second, 0);
+            for (unsigned int i = 0; i < coins.vout.size(); i++) {
+                const CTxOut& out = coins.vout[i];
+                if (out.IsNull() || out.scriptPubKey.IsUnspendable())
+                    continue;
+                outpoint.n = i;
+                batch.Write(CoinEntry(&outpoint), Coin(out, coins.nHeight, coins.fCoinBase, coins.fCoinStake, nTime));
+                nOutputs++;
+            }
+            batch.Erase(key);
+            keyLast = key;
+
+            if (nTransactions++ % 256 == 0) {
+                // Keys are ordered by txid, so its leading bytes track progress.
+                uint32_t nHigh = 0x100 * *key.second.begin() + *(key.second.begin() + 1);
+                int nPercentageDone = (int)(nHigh * 100.0 / 65536.0 + 0.5);
+                uiInterface.ShowProgress(_("Upgrading chainstate database..."), nPercentageDone);
+                if (nReportDone < nPercentageDone / 10) {
+                    LogPrintf("Upgrading chainstate: %d%% done\n", nPercentageDone);
+                    nReportDone = nPercentageDone / 10;
+                }
+            }
+            if (batch.SizeEstimate() > UPGRADE_BATCH_SIZE) {
+                if (!db.WriteBatch(batch))
+                    return error("%s : failed to write upgraded coins", __func__);
+                batch.Clear();
+                db.CompactRange(keyPrev, keyLast);
+                keyPrev = keyLast;
+            }
+            pcursor->Next();
+        } catch (std::exception& e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+    if (!db.WriteBatch(batch))
+        return error("%s : failed to write upgraded coins", __func__);
+    db.CompactRange(keyPrev, keyLast);
+    uiInterface.ShowProgress("", 100);
+
+    if (ShutdownRequested()) {
+        LogPrintf("Chainstate upgrade interrupted after %u transactions; it resumes on the next start\n", nTransactions);
+        return false;
+    }
+    LogPrintf("Upgraded %u transactions into %u transaction outputs in %dms\n", nTransactions, nOutputs, GetTimeMillis() - nStart);
+    return true;
+}
+
+CCoinsViewAsyncWriter::CCoinsViewAsyncWriter(CCoinsViewDB* baseIn, bool fAsyncIn) : CCoinsViewBacked(baseIn), fAsync(fAsyncIn), fFailed(false), fShutdown(false)
+{
+    if (fAsync)
+        thread = boost::thread(boost::bind(&CCoinsViewAsyncWriter::ThreadWrite, this));
+}
+
+CCoinsViewAsyncWriter::~CCoinsViewAsyncWriter()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        fShutdown = true;
+    }
+    condWork.notify_all();
+    if (thread.joinable())
+        thread.join();
+}
+
+void CCoinsViewAsyncWriter::ThreadWrite()
+{
+    RenameThread("lux-coinsflush");
+    boost::unique_lock<boost::mutex> lock(cs);
+    while (true) {
+        while (queue.empty() && !fShutdown)
+            condWork.wait(lock);
+        // Everything queued before shutdown is still written out.
+        if (queue.empty())
+            return;
+        PendingWrite& write = queue.front();
+        bool fOk = false;
+        // Readers keep using the front batch while it is written; it is only
+        // removed once its contents are visible in the database.
+        lock.unlock();
+        int64_t nStart = GetTimeMicros();
+        try {
+            fOk = base->BatchWrite(write.mapCoins, write.hashBlock, write.fHaveStats ? &write.stats : NULL);
+        } catch (const std::exception& e) {
+            LogPrintf("%s: %s\n", __func__, e.what());
+        }
+        LogPrint("coindb", "Background coin database write took %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
+        lock.lock();
+        if (!fOk) {
+            // Keep the batch queued so lookups stay correct; flushes now fail
+            // and the node shuts down through the usual write error path.
+            LogPrintf("Error writing to coin database in the background\n");
+            fFailed = true;
+            condDone.notify_all();
+            return;
+        }
+        queue.pop_front();
+        condDone.notify_all();
+    }
+}
+
+bool CCoinsViewAsyncWriter::FindPending(const COutPoint& outpoint, Coin* coin) const
+{
+    for (std::list<PendingWrite>::const_reverse_iterator it = queue.rbegin(); it != queue.rend(); it++) {
+        CCoinsMap::const_iterator itCoin = it->mapCoins.find(outpoint);
+        // Entries that are not dirty are unchanged copies of the database.
+        if (itCoin != it->mapCoins.end() && (itCoin->second.flags & CCoinsCacheEntry::DIRTY)) {
+            if (coin)
+                *coin = itCoin->second.coin;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool CCoinsViewAsyncWriter::GetCoin(const COutPoint& outpoint, Coin& coin) const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (FindPending(outpoint, &coin))
+            return !coin.IsSpent();
+    }
+    // Not in any queued batch, so a write that completes meanwhile cannot change it.
+    return base->GetCoin(outpoint, coin);
+}
+
+bool CCoinsViewAsyncWriter::HaveCoin(const COutPoint& outpoint) const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        Coin coin;
+        if (FindPending(outpoint, &coin))
+            return !coin.IsSpent();
+    }
+    return base->HaveCoin(outpoint);
+}
+
+uint256 CCoinsViewAsyncWriter::GetBestBlock() const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        for (std::list<PendingWrite>::const_reverse_iterator it = queue.rbegin(); it != queue.rend(); it++) {
+            if (it->hashBlock != uint256(0))
+                return it->hashBlock;
+        }
+    }
+    return base->GetBestBlock();
+}
+
+bool CCoinsViewAsyncWriter::GetRunningStats(CCoinsRunningStats& stats) const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        for (std::list<PendingWrite>::const_reverse_iterator it = queue.rbegin(); it != queue.rend(); it++) {
+            if (it->fHaveStats && it->hashBlock != uint256(0)) {
+                stats = it->stats;
+                return true;
+            }
+        }
+    }
+    return base->GetRunningStats(stats);
+}
+
+bool CCoinsViewAsyncWriter::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, const CCoinsRunningStats* pstats)
+{
+    if (!fAsync)
+        return base->BatchWrite(mapCoins, hashBlock, pstats);
+
+    uint32_t nMaxIndex = 0;
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
+        nMaxIndex = std::max(nMaxIndex, it->first.n);
+
+    boost::unique_lock<boost::mutex> lock(cs);
+    while (queue.size() >= MAX_PENDING_COIN_WRITES && !fFailed)
+        condDone.wait(lock);
+    if (fFailed)
+        return false;
+    // The caller clears its map after flushing, so take the entries over instead of copying them.
+    queue.push_back(PendingWrite());
+    queue.back().mapCoins.swap(mapCoins);
+    queue.back().hashBlock = hashBlock;
+    queue.back().nMaxIndex = nMaxIndex;
+    queue.back().fHaveStats = pstats != NULL;
+    if (pstats)
+        queue.back().stats = *pstats;
+    condWork.notify_one();
+    return true;
+}
+
+bool CCoinsViewAsyncWriter::GetStats(CCoinsStats& stats) const
+{
+    if (!Sync())
+        return false;
+    return base->GetStats(stats);
+}
+
+bool CCoinsViewAsyncWriter::ForEachCoin(CCoinsVisitor& visitor) const
+{
+    if (!Sync())
+        return false;
+    return base->ForEachCoin(visitor);
+}
+
+class CCoinsViewAsyncWriter::CPendingOverlay : public CCoinsOverlay
+{
+private:
+    const CCoinsViewAsyncWriter& writer;
+
+public:
+    CPendingOverlay(const CCoinsViewAsyncWriter& writerIn) : writer(writerIn) {}
+
+    bool Lookup(const COutPoint& outpoint, bool& fUnspent) const
+    {
+        Coin coin;
+        if (!writer.FindPending(outpoint, &coin))
+            return false;
+        fUnspent = !coin.IsSpent();
+        return true;
+    }
+};
+
+bool CCoinsViewAsyncWriter::FindCoinByTxid(const uint256& txid, uint32_t nFrom, uint32_t nEnd, COutPoint& outpoint) const
+{
+    // Held throughout, so the front batch cannot be dropped between looking
+    // at it and at the database; the database has it either way.
+    boost::unique_lock<boost::mutex> lock(cs);
+    uint32_t nMaxIndex = 0;
+    for (std::list<PendingWrite>::const_iterator it = queue.begin(); it != queue.end(); it++)
+        nMaxIndex = std::max(nMaxIndex, it->nMaxIndex);
+    if (queue.empty())
+        return base->FindCoinByTxid(txid, nFrom, nEnd, outpoint);
+    return FindCoinByTxidOverlay(CPendingOverlay(*this), nMaxIndex, *base, txid, nFrom, nEnd, outpoint);
+}
+
+bool CCoinsViewAsyncWriter::Sync() const
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    while (!queue.empty() && !fFailed)
+        condDone.wait(lock);
+    return !fFailed;
+}
+
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe)
 {
 }
@@ -137,57 +558,128 @@ bool CBlockTreeDB::ReadLastBlockFile(int& nFile)
     return Read('l', nFile);
 }
 
+static void ApplyStats(CCoinsStats& stats, CHashWriter& ss, const uint256& hash, const std::map<uint32_t, Coin>& outputs)
+{
+    assert(!outputs.empty());
+    ss << hash;
+    ss << VARINT(outputs.begin()->second.nHeight * 4 + (outputs.begin()->second.fCoinBase ? 2 : 0) + (outputs.begin()->second.fCoinStake ? 1 : 0));
+    stats.nTransactions++;
+    for (std::map<uint32_t, Coin>::const_iterator it = outputs.begin(); it != outputs.end(); ++it) {
+        ss << VARINT(it->first + 1);
+        ss << it->second.out;
+        stats.nTransactionOutputs++;
+        stats.nTotalAmount += it->second.out.nValue;
+    }
+    ss << VARINT(0);
+}
+
 bool CCoinsViewDB::GetStats(CCoinsStats& stats) const
 {
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
     boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
-    pcursor->SeekToFirst();
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << DB_COIN;
+    pcursor->Seek(ssKeySet.str());
 
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     stats.hashBlock = GetBestBlock();
     ss << stats.hashBlock;
-    CAmount nTotalAmount = 0;
+    // Outputs of one transaction are adjacent in key order; group them so
+    // the serialized hash commits to each transaction once.
+    uint256 prevkey;
+    std::map<uint32_t, Coin> outputs;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         try {
             leveldb::Slice slKey = pcursor->key();
+            if (slKey.empty() || slKey[0] != DB_COIN)
+                break;
             CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'c') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
-                CCoins coins;
-                ssValue >> coins;
-                uint256 txhash;
-                ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n');
-                ss << VARINT(coins.nHeight);
-                stats.nTransactions++;
-                for (unsigned int i = 0; i < coins.vout.size(); i++) {
-                    const CTxOut& out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i + 1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
-                }
-                stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
+            COutPoint outpoint;
+            CoinEntry entry(&outpoint);
+            ssKey >> entry;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            Coin coin;
+            ssValue >> coin;
+            if (!outputs.empty() && outpoint.hash != prevkey) {
+                ApplyStats(stats, ss, prevkey, outputs);
+                outputs.clear();
             }
+            prevkey = outpoint.hash;
+            outputs[outpoint.n] = coin;
+            stats.nSerializedSize += slKey.size() + slValue.size();
             pcursor->Next();
         } catch (std::exception& e) {
             return error("%s : Deserialize or I/O error - %s", __func__, e.what());
         }
     }
+    if (!outputs.empty())
+        ApplyStats(stats, ss, prevkey, outputs);
     stats.nHeight = mapBlockIndex.find(GetBestBlock())->second->nHeight;
     stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
+    return true;
+}
+
+namespace
+{
+class CRunningStatsBuilder : public CCoinsVisitor
+{
+public:
+    CCoinsRunningStats stats;
+
+    bool Visit(const COutPoint& outpoint, const Coin& coin)
+    {
+        stats.AddCoin(outpoint, coin);
+        return true;
+    }
+};
+} // anon namespace
+
+bool CCoinsViewDB::RebuildRunningStats()
+{
+    LogPrintf("Computing UTXO set totals...\n");
+    int64_t nStart = GetTimeMillis();
+    CRunningStatsBuilder builder;
+    if (!ForEachCoin(builder))
+        return false;
+    builder.stats.hashBlock = GetBestBlock();
+    if (!db.Write(DB_RUNNING_STATS, builder.stats, true))
+        return error("%s : failed to write the UTXO set totals", __func__);
+    LogPrintf("Computed UTXO set totals over %u outputs in %dms\n", builder.stats.nTransactionOutputs, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool CCoinsViewDB::ForEachCoin(CCoinsVisitor& visitor) const
+{
+    boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << DB_COIN;
+    pcursor->Seek(ssKeySet.str());
+
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            if (slKey.empty() || slKey[0] != DB_COIN)
+                break;
+            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            COutPoint outpoint;
+            CoinEntry entry(&outpoint);
+            ssKey >> entry;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            Coin coin;
+            ssValue >> coin;
+            if (!visitor.Visit(outpoint, coin))
+                return false;
+            pcursor->Next();
+        } catch (std::exception& e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
     return true;
 }
 
@@ -218,6 +710,88 @@ bool CBlockTreeDB::ReadFlag(const std::string& name, bool& fValue)
     return true;
 }
 
+namespace
+{
+enum BlockIndexDecodeResult {
+    BLOCK_INDEX_DECODE_OK,
+    BLOCK_INDEX_DECODE_FAILED, //! the record did not deserialize
+    BLOCK_INDEX_POW_FAILED,    //! a proof-of-work entry whose hash does not meet its nBits
+};
+
+/** A window of raw block index records and what the decoding threads made of them. */
+struct CBlockIndexLoadWindow {
+    std::vector<std::string> vRaw;
+    std::vector<CDiskBlockIndex> vDiskIndex;
+    std::vector<uint256> vHashes;
+    std::vector<char> vResult;
+};
+
+bool IsProofOfWorkEntry(const CDiskBlockIndex& diskindex)
+{
+    return diskindex.nNonce != 0 && diskindex.nHeight <= Params().LAST_POW_BLOCK();
+}
+
+/**
+ * Read up to BLOCK_INDEX_LOAD_WINDOW 'b' records into the window. Returns
+ * whether the cursor may still be on more of them.
+ */
+bool ReadBlockIndexWindow(leveldb::Iterator* pcursor, CBlockIndexLoadWindow& window)
+{
+    size_t n = 0;
+    bool fMore = true;
+    window.vRaw.resize(BLOCK_INDEX_LOAD_WINDOW);
+    while (n < BLOCK_INDEX_LOAD_WINDOW) {
+        if (!pcursor->Valid()) {
+            fMore = false;
+            break;
+        }
+        leveldb::Slice slKey = pcursor->key();
+        if (slKey.size() == 0 || slKey.data()[0] != 'b') {
+            fMore = false;
+            break; // finished loading block index
+        }
+        leveldb::Slice slValue = pcursor->value();
+        window.vRaw[n++].assign(slValue.data(), slValue.size());
+        pcursor->Next();
+    }
+    window.vRaw.resize(n);
+    return fMore;
+}
+
+/**
+ * Deserialize entries [nBegin, nEnd) of the window, compute their header
+ * hashes with the multi-buffer PHI1612 backend and check the proof of work of
+ * those that claim one. Slices of a window touch disjoint entries.
+ */
+void DecodeBlockIndexSlice(CBlockIndexLoadWindow& window, size_t nBegin, size_t nEnd)
+{
+    std::vector<CBlockHeader> vHeaders(nEnd - nBegin);
+    std::vector<const CBlockHeader*> vpHeaders(nEnd - nBegin);
+    for (size_t i = nBegin; i < nEnd; i++) {
+        try {
+            const std::string& strRaw = window.vRaw[i];
+            CDataStream ssValue(strRaw.data(), strRaw.data() + strRaw.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> window.vDiskIndex[i];
+            window.vResult[i] = BLOCK_INDEX_DECODE_OK;
+        } catch (std::exception& e) {
+            LogPrintf("%s : Deserialize or I/O error - %s\n", "LoadBlockIndexGuts", e.what());
+            window.vResult[i] = BLOCK_INDEX_DECODE_FAILED;
+        }
+        vHeaders[i - nBegin] = window.vDiskIndex[i].GetBlockHeader();
+        vpHeaders[i - nBegin] = &vHeaders[i - nBegin];
+    }
+    if (nEnd > nBegin)
+        Phi1612Batch(&vpHeaders[0], vpHeaders.size(), &window.vHashes[nBegin]);
+
+    for (size_t i = nBegin; i < nEnd; i++) {
+        const CDiskBlockIndex& diskindex = window.vDiskIndex[i];
+        if (window.vResult[i] == BLOCK_INDEX_DECODE_OK && IsProofOfWorkEntry(diskindex) &&
+            !CheckProofOfWork(window.vHashes[i], diskindex.nBits))
+            window.vResult[i] = BLOCK_INDEX_POW_FAILED;
+    }
+}
+} // anon namespace
+
 bool CBlockTreeDB::LoadBlockIndexGuts()
 {
     boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
@@ -232,22 +806,50 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
     int nFirstDiscarded = INT_MAX;
     CLevelDBBatch batch;
 
-    // Load mapBlockIndex
-    while (pcursor->Valid()) {
+    // Load mapBlockIndex. Records are read in windows; while the decoding
+    // threads deserialize and hash one window, this thread reads the next,
+    // then links the decoded entries into mapBlockIndex in disk order.
+    int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency(), MAX_BLOCK_INDEX_LOAD_THREADS));
+    int64_t nTimeRead = 0, nTimeDecode = 0, nTimeLink = 0;
+    uint64_t nEntries = 0;
+    CBlockIndexLoadWindow windows[2];
+    int64_t nTimeStart = GetTimeMillis();
+    bool fMore = ReadBlockIndexWindow(pcursor.get(), windows[0]);
+    nTimeRead += GetTimeMillis() - nTimeStart;
+    for (int nCurrent = 0; !windows[nCurrent].vRaw.empty(); nCurrent = 1 - nCurrent) {
         boost::this_thread::interruption_point();
+        CBlockIndexLoadWindow& window = windows[nCurrent];
+        CBlockIndexLoadWindow& windowNext = windows[1 - nCurrent];
+        size_t nSize = window.vRaw.size();
+        window.vDiskIndex.resize(nSize);
+        window.vHashes.resize(nSize);
+        window.vResult.resize(nSize);
+
+        int64_t nTime0 = GetTimeMillis();
+        {
+            boost::thread_group decoders;
+            size_t nSlice = (nSize + nThreads - 1) / nThreads;
+            for (size_t nBegin = 0; nBegin < nSize; nBegin += nSlice)
+                decoders.create_thread(boost::bind(&DecodeBlockIndexSlice, boost::ref(window), nBegin, std::min(nBegin + nSlice, nSize)));
+            if (fMore)
+                fMore = ReadBlockIndexWindow(pcursor.get(), windowNext);
+            else
+                windowNext.vRaw.clear();
+            int64_t nTime1 = GetTimeMillis();
+            nTimeRead += nTime1 - nTime0;
+            decoders.join_all();
+            nTimeDecode += GetTimeMillis() - nTime1;
+        }
+
+        int64_t nTime2 = GetTimeMillis();
         try {
-            leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'b') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
-                CDiskBlockIndex diskindex;
-                ssValue >> diskindex;
+            for (size_t i = 0; i < nSize; i++) {
+                const CDiskBlockIndex& diskindex = window.vDiskIndex[i];
+                if (window.vResult[i] == BLOCK_INDEX_DECODE_FAILED)
+                    return error("%s : Deserialize or I/O error", __func__);
 
                 // Construct block index object
-                CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
+                CBlockIndex* pindexNew = InsertBlockIndex(window.vHashes[i]);
                 pindexNew->pprev = InsertBlockIndex(diskindex.hashPrev);
                 pindexNew->pnext = InsertBlockIndex(diskindex.hashNext);
                 pindexNew->nHeight = diskindex.nHeight;
@@ -271,10 +873,10 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
                 pindexNew->nStakeTime = diskindex.nStakeTime;
                 pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
 
-                bool isPoW = (diskindex.nNonce != 0) && pindexNew->nHeight <= Params().LAST_POW_BLOCK();
-                if (isPoW) {
-                    auto const &hash(pindexNew->GetBlockHash());
-                    if (!CheckProofOfWork(hash, pindexNew->nBits)) {
+                if (IsProofOfWorkEntry(diskindex)) {
+                    // Checked by the decoding threads
+                    if (window.vResult[i] == BLOCK_INDEX_POW_FAILED) {
+                        auto const &hash(pindexNew->GetBlockHash());
                         unsigned int nBits = pindexPrev ? pindexPrev->nBits : 0;
                         return error("%s: CheckProofOfWork failed: %d %s (%d, %d)", __func__, pindexNew->nHeight, hash.GetHex(), pindexNew->nBits, nBits);
                     }
@@ -287,7 +889,6 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
                         nDiscarded++;
                         nFirstDiscarded = diskindex.nHeight < nFirstDiscarded ? diskindex.nHeight : nFirstDiscarded;
                         batch.Erase(make_pair('b', hash));
-                        pcursor->Next();
                         continue;
                     } else if (stake->GetProof(hash, proof)) {
                         if (proof != pindexNew->hashProofOfStake)
@@ -299,14 +900,15 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
                 }
 
                 pindexPrev = pindexNew;
-                pcursor->Next();
-            } else {
-                break; // if shutdown requested or finished loading block index
             }
         } catch (std::exception& e) {
             return error("%s : Deserialize or I/O error - %s", __func__, e.what());
         }
+        nTimeLink += GetTimeMillis() - nTime2;
+        nEntries += nSize;
     }
+    LogPrintf("%s: %u entries, read %dms, decode %dms (%d threads), link %dms\n", __func__,
+        nEntries, nTimeRead, nTimeDecode, nThreads, nTimeLink);
 
     if (nDiscarded) {
         if (WriteBatch(batch)) {
@@ -9,12 +9,16 @@
 #include "leveldbwrapper.h"
 #include "main.h"
 
+#include <list>
 #include <map>
 #include <string>
 #include <utility>
 #include <vector>
 
-class CCoins;
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
 class uint256;
 
 //! -dbcache default (MiB)
@@ -23,6 +27,10 @@ static const int64_t nDefaultDbCache = 100;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 4096 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
+//! -asyncflush default
+static const bool DEFAULT_ASYNC_FLUSH = false;
+//! Number of flushed coin batches that may wait for the background writer
+static const unsigned int MAX_PENDING_COIN_WRITES = 1;
 
 /** CCoinsView backed by the LevelDB coin database (chainstate/) */
 class CCoinsViewDB : public CCoinsView
@@ -33,11 +41,82 @@ protected:
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
-    bool GetCoins(const uint256& txid, CCoins& coins) const;
-    bool HaveCoins(const uint256& txid) const;
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const;
+    bool HaveCoin(const COutPoint& outpoint) const;
+    uint256 GetBestBlock() const;
+    //! Write all dirty entries, the best block and the running totals in one batch. mapCoins is left untouched.
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, const CCoinsRunningStats* pstats);
+    bool GetStats(CCoinsStats& stats) const;
+    bool GetRunningStats(CCoinsRunningStats& stats) const;
+    bool ForEachCoin(CCoinsVisitor& visitor) const;
+    //! Scans the records of txid, which are adjacent in key order
+    bool FindCoinByTxid(const uint256& txid, uint32_t nFrom, uint32_t nEnd, COutPoint& outpoint) const;
+
+    //! Compute the running totals with a full scan, for a chain state that has none for its best block
+    bool RebuildRunningStats();
+
+    //! Convert a chainstate with one record per transaction to one record per output, reading the transaction times from the blocks
+    bool Upgrade();
+};
+
+/**
+ * Write-behind layer between the coins cache and the coin database.
+ *
+ * In asynchronous mode a flushed cache is queued and written by a background
+ * thread, so the caller does not wait for LevelDB. Queued batches are written
+ * in order, each together with its best block marker in a single atomic
+ * LevelDB batch, so the database always holds the state at some flushed block.
+ * Until a batch has been written, lookups are answered from it. Flushing
+ * blocks while MAX_PENDING_COIN_WRITES batches are already queued.
+ */
+class CCoinsViewAsyncWriter : public CCoinsViewBacked
+{
+private:
+    struct PendingWrite {
+        CCoinsMap mapCoins;
+        uint256 hashBlock;
+        CCoinsRunningStats stats;
+        bool fHaveStats;
+        //! Highest output index in mapCoins
+        uint32_t nMaxIndex;
+
+        PendingWrite() : fHaveStats(false), nMaxIndex(0) {}
+    };
+
+    mutable boost::mutex cs;
+    //! Signalled when a batch is queued or on shutdown
+    boost::condition_variable condWork;
+    //! Signalled when a batch has been written or a write failed
+    mutable boost::condition_variable condDone;
+    //! Queued batches, oldest first. The front one is being written and is not modified.
+    std::list<PendingWrite> queue;
+    bool fAsync;
+    bool fFailed;
+    bool fShutdown;
+    boost::thread thread;
+
+    //! Look up outpoint in the queued batches, newest first
+    bool FindPending(const COutPoint& outpoint, Coin* coin) const;
+    //! The queued batches as seen by FindCoinByTxidOverlay
+    class CPendingOverlay;
+    void ThreadWrite();
+
+public:
+    CCoinsViewAsyncWriter(CCoinsViewDB* baseIn, bool fAsyncIn);
+    ~CCoinsViewAsyncWriter();
+
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const;
+    bool HaveCoin(const COutPoint& outpoint) const;
     uint256 GetBestBlock() const;
-    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, const CCoinsRunningStats* pstats);
     bool GetStats(CCoinsStats& stats) const;
+    bool GetRunningStats(CCoinsRunningStats& stats) const;
+    bool ForEachCoin(CCoinsVisitor& visitor) const;
+    bool FindCoinByTxid(const uint256& txid, uint32_t nFrom, uint32_t nEnd, COutPoint& outpoint) const;
+
+    //! Wait until every queued batch is on disk. Returns false if a write failed.
+    bool Sync() const;
+    bool IsAsync() const { return fAsync; }
 };
 
 /** Access to the block database (blocks/index/) */
@@ -11,7 +11,7 @@
  * network protocol versioning
  */
 
-static const int PROTOCOL_VERSION = 69300;
+static const int PROTOCOL_VERSION = 69400;
 
 //! initial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 209;
@@ -43,5 +43,8 @@ static const int MEMPOOL_GD_VERSION = 60005;
 //! "filter*" commands are disabled without NODE_BLOOM after and including this version
 static const int NO_BLOOM_VERSION = 70005;
 
+//! short-id-based block download (BIP 152) starts with this version
+static const int SHORT_IDS_BLOCKS_VERSION = 69400;
+
 
 #endif // BITCOIN_VERSION_H